@@ -0,0 +1,249 @@
+#include "paging.h"
+#include "string.h"
+#include "stdio.h"
+#include "acpi.h"
+
+#include <stdint.h>
+
+
+#define ACPI_EBDA_PTR          0x40e
+#define ACPI_EBDA_SIZE         1024
+#define ACPI_BIOS_BEGIN        0xe0000
+#define ACPI_BIOS_END          0x100000
+#define ACPI_RSDP_ALIGN        16
+#define ACPI_RSDP_V1_SIZE      20
+
+#define ACPI_MADT_LAPIC        0
+#define ACPI_MADT_LAPIC_ADDR   5
+
+#define ACPI_LAPIC_ENABLED     BIT_CONST(0)
+#define ACPI_LAPIC_CAPABLE     BIT_CONST(1)
+
+
+struct acpi_rsdp {
+	char signature[8];
+	uint8_t checksum;
+	char oem[6];
+	uint8_t revision;
+	uint32_t rsdt;
+	uint32_t length;
+	uint64_t xsdt;
+	uint8_t xchecksum;
+	uint8_t rsrv[3];
+} __attribute__((packed));
+
+struct acpi_header {
+	char signature[4];
+	uint32_t length;
+	uint8_t revision;
+	uint8_t checksum;
+	char oem[6];
+	char oem_table[8];
+	uint32_t oem_revision;
+	uint32_t creator;
+	uint32_t creator_revision;
+} __attribute__((packed));
+
+struct acpi_madt {
+	struct acpi_header header;
+	uint32_t lapic;
+	uint32_t flags;
+} __attribute__((packed));
+
+struct acpi_madt_entry {
+	uint8_t type;
+	uint8_t length;
+} __attribute__((packed));
+
+struct acpi_madt_lapic {
+	struct acpi_madt_entry entry;
+	uint8_t acpi_id;
+	uint8_t apic_id;
+	uint32_t flags;
+} __attribute__((packed));
+
+struct acpi_madt_lapic_addr {
+	struct acpi_madt_entry entry;
+	uint16_t rsrv;
+	uint64_t addr;
+} __attribute__((packed));
+
+
+static bool acpi_checksum(const void *ptr, size_t size)
+{
+	const uint8_t *bytes = ptr;
+	uint8_t sum = 0;
+
+	for (size_t i = 0; i != size; ++i)
+		sum += bytes[i];
+	return sum == 0;
+}
+
+static phys_t acpi_scan_rsdp(phys_t from, phys_t to)
+{
+	const char *begin = ioremap(from, to - from);
+
+	if (!begin)
+		return 0;
+
+	for (phys_t addr = from; addr + sizeof(struct acpi_rsdp) <= to;
+				addr += ACPI_RSDP_ALIGN) {
+		const struct acpi_rsdp *rsdp =
+					(const void *)(begin + (addr - from));
+
+		if (memcmp(rsdp->signature, "RSD PTR ", 8))
+			continue;
+
+		if (!acpi_checksum(rsdp, ACPI_RSDP_V1_SIZE))
+			continue;
+
+		iounmap((void *)begin);
+		return addr;
+	}
+
+	iounmap((void *)begin);
+	return 0;
+}
+
+static phys_t acpi_find_rsdp(void)
+{
+	const uint16_t *ebda_ptr = ioremap(ACPI_EBDA_PTR, sizeof(*ebda_ptr));
+
+	if (!ebda_ptr)
+		return 0;
+
+	const phys_t ebda = (phys_t)*ebda_ptr << 4;
+	phys_t rsdp = 0;
+
+	iounmap((void *)ebda_ptr);
+
+	if (ebda)
+		rsdp = acpi_scan_rsdp(ebda, ebda + ACPI_EBDA_SIZE);
+
+	if (!rsdp)
+		rsdp = acpi_scan_rsdp(ACPI_BIOS_BEGIN, ACPI_BIOS_END);
+
+	return rsdp;
+}
+
+static const struct acpi_header *acpi_map_table(phys_t addr)
+{
+	const struct acpi_header *header = ioremap(addr, sizeof(*header));
+
+	if (!header)
+		return 0;
+
+	const size_t size = header->length;
+
+	iounmap((void *)header);
+	if (size < sizeof(*header))
+		return 0;
+
+	header = ioremap(addr, size);
+	if (!header)
+		return 0;
+
+	if (!acpi_checksum(header, size)) {
+		iounmap((void *)header);
+		return 0;
+	}
+	return header;
+}
+
+static void acpi_unmap_table(const struct acpi_header *header)
+{ iounmap((void *)header); }
+
+/* looks up table with signature in RSDT (entry is 4) or XSDT (entry is 8) */
+static const struct acpi_header *acpi_find_table(phys_t root, size_t entry,
+			const char *signature)
+{
+	const struct acpi_header *sdt = acpi_map_table(root);
+
+	if (!sdt)
+		return 0;
+
+	const char *ptr = (const char *)(sdt + 1);
+	const size_t count = (sdt->length - sizeof(*sdt)) / entry;
+
+	for (size_t i = 0; i != count; ++i) {
+		uint64_t addr = 0;
+
+		memcpy(&addr, ptr + i * entry, entry);
+
+		const struct acpi_header *table = acpi_map_table(addr);
+
+		if (!table)
+			continue;
+
+		if (!memcmp(table->signature, signature, 4)) {
+			acpi_unmap_table(sdt);
+			return table;
+		}
+		acpi_unmap_table(table);
+	}
+
+	acpi_unmap_table(sdt);
+	return 0;
+}
+
+static const struct acpi_header *acpi_find_madt(void)
+{
+	const phys_t addr = acpi_find_rsdp();
+
+	if (!addr)
+		return 0;
+
+	const struct acpi_rsdp *rsdp = ioremap(addr, sizeof(*rsdp));
+
+	if (!rsdp)
+		return 0;
+
+	const bool xsdt = rsdp->revision >= 2 && rsdp->xsdt &&
+				acpi_checksum(rsdp, sizeof(*rsdp));
+	const phys_t root = xsdt ? rsdp->xsdt : rsdp->rsdt;
+
+	iounmap((void *)rsdp);
+	return acpi_find_table(root, xsdt ? 8 : 4, "APIC");
+}
+
+phys_t acpi_parse_madt(acpi_lapic_fptr_t exec)
+{
+	const struct acpi_header *header = acpi_find_madt();
+
+	if (!header) {
+		DBG_INFO("MADT not found");
+		return 0;
+	}
+
+	const struct acpi_madt *madt = (const struct acpi_madt *)header;
+	const char *ptr = (const char *)(madt + 1);
+	const char *end = (const char *)madt + header->length;
+	phys_t lapic = madt->lapic;
+
+	while (ptr + sizeof(struct acpi_madt_entry) <= end) {
+		const struct acpi_madt_entry *entry = (const void *)ptr;
+
+		if (entry->length < sizeof(*entry) || ptr + entry->length > end)
+			break;
+
+		if (entry->type == ACPI_MADT_LAPIC) {
+			const struct acpi_madt_lapic *cpu = (const void *)entry;
+
+			if (cpu->flags & (ACPI_LAPIC_ENABLED |
+						ACPI_LAPIC_CAPABLE))
+				exec(cpu->apic_id);
+		}
+
+		if (entry->type == ACPI_MADT_LAPIC_ADDR) {
+			const struct acpi_madt_lapic_addr *addr =
+						(const void *)entry;
+
+			lapic = addr->addr;
+		}
+
+		ptr += entry->length;
+	}
+
+	acpi_unmap_table(header);
+	return lapic;
+}
@@ -0,0 +1,15 @@
+#ifndef __ACPI_H__
+#define __ACPI_H__
+
+#include "memory.h"
+
+
+typedef void (*acpi_lapic_fptr_t)(int apic_id);
+
+/*
+ * Calls exec for every usable local APIC listed in the MADT, returns
+ * physical address of local APICs or 0 if there is no MADT.
+ */
+phys_t acpi_parse_madt(acpi_lapic_fptr_t exec);
+
+#endif /*__ACPI_H__*/
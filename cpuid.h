@@ -0,0 +1,64 @@
+#ifndef __CPUID_H__
+#define __CPUID_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define CPUID_EXT_BASE         0x80000000ul
+#define CPUID_EXT_FEATURES     0x80000001ul
+#define CPUID_EXT_POWER        0x80000007ul
+
+/* CPUID_EXT_FEATURES edx bits */
+#define CPUID_EXT_PDPE1GB      (1ul << 26)
+
+/* CPUID_EXT_POWER edx bits */
+#define CPUID_EXT_INVARIANT_TSC (1ul << 8)
+
+struct cpuid_regs {
+	uint32_t eax;
+	uint32_t ebx;
+	uint32_t ecx;
+	uint32_t edx;
+};
+
+static inline void cpuid(uint32_t leaf, uint32_t subleaf,
+			struct cpuid_regs *regs)
+{
+	__asm__ volatile ("cpuid"
+		: "=a"(regs->eax), "=b"(regs->ebx),
+		  "=c"(regs->ecx), "=d"(regs->edx)
+		: "a"(leaf), "c"(subleaf));
+}
+
+static inline uint32_t cpuid_max_ext_leaf(void)
+{
+	struct cpuid_regs regs;
+
+	cpuid(CPUID_EXT_BASE, 0, &regs);
+	return regs.eax;
+}
+
+static inline bool cpu_has_pdpe1gb(void)
+{
+	struct cpuid_regs regs;
+
+	if (cpuid_max_ext_leaf() < CPUID_EXT_FEATURES)
+		return false;
+
+	cpuid(CPUID_EXT_FEATURES, 0, &regs);
+	return (regs.edx & CPUID_EXT_PDPE1GB) != 0;
+}
+
+/* TSC ticks at a constant rate in all power states */
+static inline bool cpu_has_invariant_tsc(void)
+{
+	struct cpuid_regs regs;
+
+	if (cpuid_max_ext_leaf() < CPUID_EXT_POWER)
+		return false;
+
+	cpuid(CPUID_EXT_POWER, 0, &regs);
+	return (regs.edx & CPUID_EXT_INVARIANT_TSC) != 0;
+}
+
+#endif /*__CPUID_H__*/
@@ -116,59 +116,97 @@ static int check_elf_hdr(const struct elf_hdr *hdr)
 	return 0;
 }
 
-static int map_elf_phdr(struct mm *mm, const struct elf_phdr *phdr,
-			struct fs_file *file)
+#define EXEC_MAX_PHNUM 64
+
+struct exec_segment {
+	virt_t begin;
+	virt_t end;
+	int perm;
+	size_t count; // pages with the file content
+	struct page **pages;
+};
+
+/*
+ * Parsed ELF file with segment contents read in advance. Pages are shared
+ * between all processes running the binary: they are mapped read only,
+ * so writable segments are copied on write by the anonymous fault handler.
+ */
+struct exec_image {
+	struct list_head link;
+	struct fs_node *node;
+	unsigned long version;
+	int refcount; // the cache and execs mapping it, under exec_cache_lock
+	virt_t entry;
+	int segments;
+	struct exec_segment segment[EXEC_MAX_PHNUM];
+};
+
+static LIST_HEAD(exec_cache);
+static DEFINE_MUTEX(exec_cache_lock);
+static int exec_cache_size;
+
+static void free_exec_image(struct exec_image *image)
 {
-	if (phdr->p_type != PT_LOAD)
-		return 0;
+	for (int i = 0; i != image->segments; ++i) {
+		struct exec_segment *seg = &image->segment[i];
 
-	const virt_t begin = phdr->p_vaddr;
-	const virt_t end = begin + phdr->p_memsz;
-	const int perm = ((phdr->p_flags & PF_W) != 0) ? VMA_PERM_WRITE : 0;
-	const unsigned long flags = (perm == VMA_PERM_WRITE) ? PTE_WRITE : 0;
+		for (size_t j = 0; j != seg->count; ++j)
+			if (seg->pages[j])
+				put_page(seg->pages[j]);
+		kmem_free(seg->pages);
+	}
 
-	int rc = __mmap(mm, begin, end, perm);
+	vfs_node_put(image->node);
+	kmem_free(image);
+}
 
-	if (rc)
-		return rc;
+static int read_elf_segment(struct fs_file *file, const struct elf_phdr *phdr,
+			struct exec_segment *seg)
+{
+	seg->begin = phdr->p_vaddr;
+	seg->end = phdr->p_vaddr + phdr->p_memsz;
+	seg->perm = ((phdr->p_flags & PF_W) != 0) ? VMA_PERM_WRITE : 0;
 
 	if (!phdr->p_filesz)
 		return 0;
 
-	rc = vfs_seek(file, (int)phdr->p_offset, FSS_SET);
+	const virt_t from = ALIGN_DOWN(seg->begin, PAGE_SIZE);
+	const virt_t to = ALIGN(seg->begin + phdr->p_filesz, PAGE_SIZE);
+	const size_t count = (to - from) >> PAGE_BITS;
+
+	seg->pages = kmem_alloc(count * sizeof(*seg->pages));
+	if (!seg->pages)
+		return -ENOMEM;
+
+	memset(seg->pages, 0, count * sizeof(*seg->pages));
+	seg->count = count;
+
+	int rc = vfs_seek(file, (int)phdr->p_offset, FSS_SET);
+
 	if (rc < 0)
 		return rc;
 
-	struct page *page = 0;
-	virt_t addr = ALIGN_DOWN(begin, PAGE_SIZE);
-	size_t offset = begin & PAGE_MASK;
+	size_t offset = seg->begin & PAGE_MASK;
 	size_t remain = phdr->p_filesz;
 
-	while (remain) {
-		page = alloc_pages(0);
+	for (size_t i = 0; i != count; ++i) {
+		struct page *page = alloc_pages(0);
 
-		if (!page) {
-			__munmap(mm, begin, end);
+		if (!page)
 			return -ENOMEM;
-		}
 
 		const size_t size = MINU(remain, PAGE_SIZE - offset);
 		char *buffer = page_addr(page);
 
-		memset(buffer, 0, PAGE_SIZE);
-
-		const int rc = read_buf(file, buffer + offset, size);
+		/* the image holds a reference, so mappings never own it */
+		page->u.refcount = 1;
+		seg->pages[i] = page;
 
-		if (rc) {
-			free_pages(page, 0);
-			__munmap(mm, begin, end);
+		memset(buffer, 0, PAGE_SIZE);
+		rc = read_buf(file, buffer + offset, size);
+		if (rc)
 			return rc;
-		}
 
-		page->u.refcount = 0;
-		__mmap_pages(mm, addr, &page, 1, flags | PTE_USER);
-
-		addr += PAGE_SIZE;
 		remain -= size;
 		offset = 0;
 	}
@@ -176,28 +214,196 @@ static int map_elf_phdr(struct mm *mm, const struct elf_phdr *phdr,
 	return 0;
 }
 
-static int load_binary(struct mm *mm, const struct elf_hdr *hdr,
-			struct fs_file *file)
+static int read_exec_image(struct fs_file *file, struct exec_image *image)
 {
-	int offset = hdr->e_phoff;
+	struct elf_hdr hdr;
+	int rc = read_elf_hdr(file, &hdr);
 
-	for (int i = 0; i != (int)hdr->e_phnum; ++i) {
-		int rc = vfs_seek(file, offset, FSS_SET);
+	if (!rc)
+		rc = check_elf_hdr(&hdr);
+	if (rc)
+		return rc;
 
-		if (rc < 0)
-			return rc;
+	if (hdr.e_phnum > EXEC_MAX_PHNUM)
+		return -ENOEXEC;
+
+	image->entry = hdr.e_entry;
+
+	int offset = hdr.e_phoff;
 
+	for (int i = 0; i != (int)hdr.e_phnum; ++i) {
 		struct elf_phdr phdr;
 
-		rc = read_elf_phdr(file, &phdr);
+		rc = vfs_seek(file, offset, FSS_SET);
 		if (rc < 0)
 			return rc;
 
-		rc = map_elf_phdr(mm, &phdr, file);
+		rc = read_elf_phdr(file, &phdr);
 		if (rc < 0)
 			return rc;
 
-		offset += hdr->e_phentsize;
+		offset += hdr.e_phentsize;
+		if (phdr.p_type != PT_LOAD)
+			continue;
+
+		/* count segment first, so free_exec_image releases it */
+		rc = read_elf_segment(file, &phdr,
+					&image->segment[image->segments++]);
+		if (rc)
+			return rc;
+	}
+
+	return 0;
+}
+
+/* must be called with exec_cache_lock held, returns image to free if any */
+static struct exec_image *exec_cache_remove(struct exec_image *image)
+{
+	list_del(&image->link);
+	list_init(&image->link);
+	--exec_cache_size;
+	return --image->refcount ? 0 : image;
+}
+
+/* must be called with exec_cache_lock held, *stale gets image to free */
+static struct exec_image *lookup_exec_image(struct fs_node *node,
+			struct exec_image **stale)
+{
+	struct list_head *head = &exec_cache;
+
+	for (struct list_head *ptr = head->next; ptr != head; ptr = ptr->next) {
+		struct exec_image *image = LIST_ENTRY(ptr, struct exec_image,
+					link);
+
+		if (image->node != node)
+			continue;
+
+		/* the file has been written since, so drop the image */
+		if (image->version != __atomic_load_n(&node->version,
+					__ATOMIC_ACQUIRE)) {
+			*stale = exec_cache_remove(image);
+			return 0;
+		}
+
+		list_del(&image->link);
+		list_add(&image->link, head);
+		++image->refcount;
+		return image;
+	}
+
+	return 0;
+}
+
+static struct exec_image *find_exec_image(struct fs_node *node)
+{
+	struct exec_image *stale = 0;
+
+	mutex_lock(&exec_cache_lock);
+
+	struct exec_image *image = lookup_exec_image(node, &stale);
+
+	mutex_unlock(&exec_cache_lock);
+
+	if (stale)
+		free_exec_image(stale);
+	return image;
+}
+
+static void put_exec_image(struct exec_image *image)
+{
+	mutex_lock(&exec_cache_lock);
+
+	const int refcount = --image->refcount;
+
+	mutex_unlock(&exec_cache_lock);
+
+	if (!refcount)
+		free_exec_image(image);
+}
+
+/*
+ * The file is read without exec_cache_lock, so execs of other binaries
+ * don't wait for it. If somebody cached the same image meanwhile, we
+ * use theirs and drop ours.
+ */
+static int get_exec_image(struct fs_file *file, struct exec_image **res)
+{
+	struct fs_node *node = file->node;
+	struct exec_image *image = find_exec_image(node);
+
+	if (image) {
+		*res = image;
+		return 0;
+	}
+
+	image = kmem_alloc(sizeof(*image));
+	if (!image)
+		return -ENOMEM;
+
+	memset(image, 0, sizeof(*image));
+	list_init(&image->link);
+	image->refcount = 1;
+	image->node = vfs_node_get(node);
+	image->version = __atomic_load_n(&node->version, __ATOMIC_ACQUIRE);
+
+	const int rc = read_exec_image(file, image);
+
+	if (rc) {
+		free_exec_image(image);
+		return rc;
+	}
+
+	/* shared writable mapping can change the file any time */
+	if (__atomic_load_n(&node->mmap_writable, __ATOMIC_RELAXED)) {
+		*res = image;
+		return 0;
+	}
+
+	struct exec_image *stale = 0;
+	struct exec_image *evicted = 0;
+
+	mutex_lock(&exec_cache_lock);
+
+	struct exec_image *cached = lookup_exec_image(node, &stale);
+
+	if (!cached) {
+		++image->refcount;
+		list_add(&image->link, &exec_cache);
+		if (++exec_cache_size > CONFIG_EXEC_CACHE_SIZE)
+			evicted = exec_cache_remove(LIST_ENTRY(exec_cache.prev,
+						struct exec_image, link));
+	}
+	mutex_unlock(&exec_cache_lock);
+
+	if (stale)
+		free_exec_image(stale);
+	if (evicted)
+		free_exec_image(evicted);
+	if (cached) {
+		free_exec_image(image);
+		image = cached;
+	}
+
+	*res = image;
+	return 0;
+}
+
+static int map_exec_image(struct mm *mm, const struct exec_image *image)
+{
+	for (int i = 0; i != image->segments; ++i) {
+		const struct exec_segment *seg = &image->segment[i];
+		int rc = __mmap(mm, seg->begin, seg->end, seg->perm);
+
+		if (rc)
+			return rc;
+
+		if (!seg->count)
+			continue;
+
+		rc = __mmap_pages(mm, ALIGN_DOWN(seg->begin, PAGE_SIZE),
+					seg->pages, seg->count, PTE_USER);
+		if (rc)
+			return rc;
 	}
 
 	return 0;
@@ -269,14 +475,17 @@ static int copy_args(struct mm *mm, int argc, const char **argv)
 		data += len;
 	}
 
-	__mmap_pages(mm, stack->end - size, pages, count,
+	rc = __mmap_pages(mm, stack->end - size, pages, count,
 				PTE_WRITE | PTE_USER);
+	kunmap(buffer);
+
+	if (rc)
+		goto out;
 
 	mm->stack_pointer = usrarray;
 	mm->argv_addr = usrarray;
 	mm->argc = argc;
 
-	kunmap(buffer);
 	kmem_free(pages);
 
 	return 0;	
@@ -290,7 +499,13 @@ out:
 	return rc;
 }
 
-int exec(int argc, const char **argv)
+/*
+ * Loads the program into mm (it must be empty) and initializes regs to
+ * start it, doesn't touch the current thread, so it's shared by exec and
+ * spawn.
+ */
+int exec_mm(struct mm *mm, struct thread_regs *regs,
+			int argc, const char **argv)
 {
 	if (argc <= 0)
 		return -EINVAL;
@@ -302,66 +517,64 @@ int exec(int argc, const char **argv)
 	if (rc)
 		return -EIO;
 
-	struct elf_hdr hdr;
+	rc = setup_stack(mm, USER_STACK_SIZE);
+	if (!rc)
+		rc = copy_args(mm, argc, argv);
 
-	rc = read_elf_hdr(&file, &hdr);
-	if (rc) {
-		vfs_release(&file);
-		return rc;
+	struct exec_image *image;
+	virt_t entry = 0;
+
+	if (!rc)
+		rc = get_exec_image(&file, &image);
+	if (!rc) {
+		entry = image->entry;
+		rc = map_exec_image(mm, image);
+		put_exec_image(image);
 	}
+	vfs_release(&file);
 
-	rc = check_elf_hdr(&hdr);
-	if (rc) {
-		vfs_release(&file);
+	if (rc)
 		return rc;
-	}
 
+	memset(regs, 0, sizeof(*regs));
+	regs->rip = entry;
+	regs->rsp = mm->stack_pointer;
+	regs->rdi = mm->argc;
+	regs->rsi = mm->argv_addr;
+	regs->cs = USER_CS;
+	regs->ss = USER_DS;
+	regs->rflags = RFLAGS_IF;
+
+	return 0;
+}
+
+int exec(int argc, const char **argv)
+{
 	struct mm *new_mm = create_mm();
 
-	if (!new_mm) {
-		vfs_release(&file);
+	if (!new_mm)
 		return -ENOMEM;
-	}
-
-	rc = setup_stack(new_mm, USER_STACK_SIZE);
-	if (rc) {
-		release_mm(new_mm);
-		vfs_release(&file);
-		return rc;
-	}
 
-	rc = copy_args(new_mm, argc, argv);
-	if (rc) {
-		release_mm(new_mm);
-		vfs_release(&file);
-		return rc;
-	}
+	struct thread_regs regs;
+	const int rc = exec_mm(new_mm, &regs, argc, argv);
 
-	rc = load_binary(new_mm, &hdr, &file);
 	if (rc) {
-		release_mm(new_mm);
-		vfs_release(&file);
+		put_mm(new_mm);
 		return rc;
 	}
 
 	struct thread *thread = current();
 	struct mm *old_mm = thread->mm;
+	const bool enabled = local_preempt_save();
 
 	thread->mm = new_mm;
-	store_pml4(page_paddr(new_mm->pt));
-	release_mm(old_mm);
+	switch_mm(old_mm, new_mm);
+	local_preempt_restore(enabled);
+	put_mm(old_mm);
 
-	struct thread_regs *regs = thread_regs(thread);
+	/* we don't use vfork parent address space anymore */
+	vfork_done(thread);
+	*thread_regs(thread) = regs;
 
-	memset(regs, 0, sizeof(*regs));
-	regs->rip = hdr.e_entry;
-	regs->rsp = new_mm->stack_pointer;
-	regs->rdi = new_mm->argc;
-	regs->rsi = new_mm->argv_addr;
-	regs->cs = USER_CS;
-	regs->ss = USER_DS;
-	regs->rflags = RFLAGS_IF;
-	vfs_release(&file);
-
-	return rc;
+	return 0;
 }
@@ -1,6 +1,11 @@
 #ifndef __EXEC_H__
 #define __EXEC_H__
 
+struct thread_regs;
+struct mm;
+
+int exec_mm(struct mm *mm, struct thread_regs *regs,
+			int argc, const char **argv);
 int exec(int argc, const char **argv);
 
 #endif /*__EXEC_H__*/
@@ -0,0 +1,300 @@
+#include "kmem_cache.h"
+#include "threads.h"
+#include "rbtree.h"
+#include "stdio.h"
+#include "time.h"
+
+/*
+ * Fair scheduler: every thread has a virtual runtime - time it ran scaled
+ * by its weight, the runqueue is an rbtree ordered by virtual runtime and
+ * the thread that got the least CPU so far runs next. Within
+ * FAIR_LATENCY_NS all the runnable threads get a slice proportional to
+ * their weight (nice level).
+ */
+#define FAIR_LATENCY_NS            20000000ull
+#define FAIR_MIN_GRANULARITY_NS    4000000ull
+#define FAIR_WAKEUP_GRANULARITY_NS 4000000ull
+#define FAIR_NICE_0_WEIGHT         1024ul
+
+struct fair_thread {
+	struct thread thread;
+	struct rb_node node;
+	struct fair_rq *rq; // the last runqueue, vruntime is relative to it
+	unsigned long long vruntime;
+	unsigned long long exec_start;
+	unsigned long long slice_start;
+	unsigned long weight;
+};
+
+
+static struct fair_thread *FAIR_THREAD(struct thread *thread)
+{ return (struct fair_thread *)thread; }
+
+static struct thread *THREAD(struct fair_thread *thread)
+{ return &thread->thread; }
+
+
+static struct kmem_cache *fair_thread_cache;
+
+/* every nice level is ~10% of CPU time, weights are from Linux */
+static const unsigned long fair_nice_weight[] = {
+	88761, 71755, 56483, 46273, 36291,
+	29154, 23254, 18705, 14949, 11916,
+	9548, 7620, 6100, 4904, 3906,
+	3121, 2501, 1991, 1586, 1277,
+	1024, 820, 655, 526, 423,
+	335, 272, 215, 172, 137,
+	110, 87, 70, 56, 45,
+	36, 29, 23, 18, 15
+};
+
+
+static unsigned long long fair_clock(void)
+{ return ktime_get_ns(); }
+
+static bool fair_before(unsigned long long l, unsigned long long r)
+{ return (long long)(l - r) < 0; }
+
+static unsigned long long fair_max(unsigned long long l, unsigned long long r)
+{ return fair_before(l, r) ? r : l; }
+
+static unsigned long fair_weight(const struct thread *thread)
+{ return fair_nice_weight[thread->nice - MIN_NICE]; }
+
+static struct fair_thread *fair_first(struct runqueue *rq)
+{
+	struct rb_node *node = rq->fair.tree.root;
+
+	if (!node)
+		return 0;
+	return TREE_ENTRY(rb_leftmost(node), struct fair_thread, node);
+}
+
+static void fair_update_min_vruntime(struct runqueue *rq,
+			unsigned long long vruntime)
+{
+	struct fair_thread *first = fair_first(rq);
+
+	if (first && fair_before(first->vruntime, vruntime))
+		vruntime = first->vruntime;
+	__atomic_store_n(&rq->fair.min_vruntime,
+				fair_max(rq->fair.min_vruntime, vruntime),
+				__ATOMIC_RELAXED);
+}
+
+/* charge the running thread for the time since the last update */
+static void fair_update_curr(struct fair_thread *thread)
+{
+	const unsigned long long now = fair_clock();
+	const unsigned long long delta = now - thread->exec_start;
+
+	thread->vruntime += delta * FAIR_NICE_0_WEIGHT / thread->weight;
+	thread->exec_start = now;
+}
+
+/*
+ * vruntime on another CPU means nothing here, keep the lag only. The old
+ * runqueue isn't locked, so its min_vruntime is read atomically and the
+ * lag is only as precise as that snapshot.
+ */
+static void fair_set_rq(struct runqueue *rq, struct fair_thread *thread)
+{
+	if (!thread->rq) {
+		thread->vruntime = rq->fair.min_vruntime;
+	} else if (thread->rq != &rq->fair) {
+		thread->vruntime -= __atomic_load_n(&thread->rq->min_vruntime,
+					__ATOMIC_RELAXED);
+		thread->vruntime += rq->fair.min_vruntime;
+	}
+	thread->rq = &rq->fair;
+}
+
+static void fair_insert(struct runqueue *rq, struct fair_thread *thread)
+{
+	struct rb_node **plink = &rq->fair.tree.root;
+	struct rb_node *parent = 0;
+
+	while (*plink) {
+		struct fair_thread *other = TREE_ENTRY(*plink,
+					struct fair_thread, node);
+
+		parent = *plink;
+		if (fair_before(thread->vruntime, other->vruntime))
+			plink = &parent->left;
+		else
+			plink = &parent->right;
+	}
+
+	rb_link(&thread->node, parent, plink);
+	rb_insert(&thread->node, &rq->fair.tree);
+	rq->fair.weight += thread->weight;
+}
+
+static void fair_erase(struct runqueue *rq, struct fair_thread *thread)
+{
+	rb_erase(&thread->node, &rq->fair.tree);
+	rq->fair.weight -= thread->weight;
+}
+
+static struct thread *fair_alloc_thread(void)
+{
+	struct fair_thread *thread = kmem_cache_alloc(fair_thread_cache);
+
+	if (!thread)
+		return 0;
+
+	thread->rq = 0;
+	thread->vruntime = 0;
+	thread->exec_start = 0;
+	thread->slice_start = 0;
+	thread->weight = FAIR_NICE_0_WEIGHT;
+
+	return THREAD(thread);
+}
+
+static void fair_free_thread(struct thread *thread)
+{
+	kmem_cache_free(fair_thread_cache, FAIR_THREAD(thread));
+}
+
+/*
+ * New thread starts at min_vruntime, so it can't monopolize the CPU. A
+ * sleeper gets at most half of latency of credit, enough to run soon after
+ * wakeup, but not to starve the others because it slept for long.
+ */
+static void fair_activate_thread(struct runqueue *rq, struct thread *thread)
+{
+	struct fair_thread *fair = FAIR_THREAD(thread);
+
+	DBG_ASSERT(local_preempt_disabled());
+	DBG_ASSERT(thread->state == THREAD_ACTIVE);
+
+	fair->weight = fair_weight(thread);
+	fair_set_rq(rq, fair);
+	fair->vruntime = fair_max(fair->vruntime,
+				rq->fair.min_vruntime - FAIR_LATENCY_NS / 2);
+	fair_insert(rq, fair);
+}
+
+static void fair_preempt_thread(struct runqueue *rq, struct thread *thread)
+{
+	struct fair_thread *fair = FAIR_THREAD(thread);
+
+	DBG_ASSERT(local_preempt_disabled());
+
+	fair_update_curr(fair);
+	fair->weight = fair_weight(thread);
+	fair_set_rq(rq, fair);
+	fair_insert(rq, fair);
+}
+
+static void fair_block_thread(struct thread *thread)
+{
+	fair_update_curr(FAIR_THREAD(thread));
+}
+
+static struct thread *fair_next_thread(struct runqueue *rq)
+{
+	struct fair_thread *thread = fair_first(rq);
+
+	DBG_ASSERT(local_preempt_disabled());
+
+	if (!thread)
+		return 0;
+
+	fair_erase(rq, thread);
+	fair_update_min_vruntime(rq, thread->vruntime);
+	return THREAD(thread);
+}
+
+/* the rightmost thread would be the last to run here anyway */
+static struct thread *fair_steal_thread(struct runqueue *rq)
+{
+	struct rb_node *node = rq->fair.tree.root;
+
+	DBG_ASSERT(local_preempt_disabled());
+
+	for (node = node ? rb_rightmost(node) : 0; node; node = rb_prev(node)) {
+		struct fair_thread *thread = TREE_ENTRY(node,
+					struct fair_thread, node);
+
+		if (THREAD(thread)->on_cpu)
+			continue;
+
+		fair_erase(rq, thread);
+		return THREAD(thread);
+	}
+	return 0;
+}
+
+static void fair_place_thread(struct thread *thread)
+{
+	struct fair_thread *fair = FAIR_THREAD(thread);
+
+	fair->exec_start = fair->slice_start = fair_clock();
+}
+
+/*
+ * Current thread is preempted when it used up its share of the latency or
+ * when the leftmost thread is behind it by more than wakeup granularity,
+ * that's how a woken up I/O bound thread gets the CPU quickly.
+ */
+static bool fair_need_preempt(struct runqueue *rq, struct thread *thread)
+{
+	struct fair_thread *curr = FAIR_THREAD(thread);
+
+	/* a stolen thread runs here without being queued here first */
+	fair_set_rq(rq, curr);
+	fair_update_curr(curr);
+	fair_update_min_vruntime(rq, curr->vruntime);
+
+	struct fair_thread *first = fair_first(rq);
+
+	if (!first)
+		return false;
+
+	const unsigned long weight = rq->fair.weight + curr->weight;
+	const unsigned long long slice = MAXU(FAIR_LATENCY_NS * curr->weight
+				/ weight, FAIR_MIN_GRANULARITY_NS);
+
+	if (curr->exec_start - curr->slice_start >= slice)
+		return true;
+
+	return fair_before(first->vruntime + FAIR_WAKEUP_GRANULARITY_NS,
+				curr->vruntime);
+}
+
+static unsigned long long fair_slice(struct runqueue *rq,
+			struct thread *thread)
+{
+	struct fair_thread *curr = FAIR_THREAD(thread);
+
+	if (!rq->fair.tree.root)
+		return SCHED_SLICE_NONE;
+
+	const unsigned long weight = rq->fair.weight + curr->weight;
+	const unsigned long long slice = MAXU(FAIR_LATENCY_NS * curr->weight
+				/ weight, FAIR_MIN_GRANULARITY_NS);
+	const unsigned long long ran = fair_clock() - curr->slice_start;
+
+	return ran < slice ? slice - ran : 0;
+}
+
+
+struct scheduler fair = {
+	.alloc = fair_alloc_thread,
+	.free = fair_free_thread,
+	.activate = fair_activate_thread,
+	.need_preempt = fair_need_preempt,
+	.slice = fair_slice,
+	.next = fair_next_thread,
+	.steal = fair_steal_thread,
+	.preempt = fair_preempt_thread,
+	.block = fair_block_thread,
+	.place = fair_place_thread
+};
+
+void setup_fair(void)
+{
+	DBG_ASSERT((fair_thread_cache = KMEM_CACHE(struct fair_thread)) != 0);
+}
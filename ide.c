@@ -63,9 +63,12 @@
 
 #define IDE_CMD_WRITE_LBA48    0x34
 #define IDE_CMD_READ_LBA48     0x24
+#define IDE_CMD_IDENTIFY       0xec
 
 #define IDE_SECTOR_SIZE        512
 
+#define IDE_RT_PRIO            50
+
 
 static struct kmem_cache *ide_bio_cache;
 
@@ -73,6 +76,7 @@ static DEFINE_MUTEX(ide_bio_queue_mutex);
 static DEFINE_CONDITION(ide_bio_queue_condition);
 static LIST_HEAD(ide_bio_queue);
 static volatile int done; // Well... We are never going to use it.
+static unsigned long long ide_sectors;
 
 
 static struct bio *dequeue_bio(void)
@@ -196,6 +200,33 @@ static int __write_sectors_lba48(const void *data, unsigned long long sector,
 	return 0;
 }
 
+/* LBA48 capacity of the master disk in sectors, 0 if there is no disk */
+static unsigned long long ide_identify(void)
+{
+	uint16_t id[IDE_SECTOR_SIZE / sizeof(uint16_t)];
+
+	out8(IDE_DEVCTL_REG, IDE_NIEN);
+	out8(IDE_DEV_REG, IDE_RSRV);
+	out8(IDE_CMD_REG, IDE_CMD_IDENTIFY);
+
+	/* nothing answers on a floating bus */
+	const int status = in8(IDE_STATUS_REG);
+
+	if (status == 0 || status == 0xff)
+		return 0;
+
+	if (ide_wait_ready() != 0 || !(in8(IDE_STATUS_REG) & IDE_DRQ))
+		return 0;
+
+	for (size_t i = 0; i != sizeof(id) / sizeof(id[0]); ++i)
+		id[i] = in16(IDE_DATA_REG);
+
+	return (unsigned long long)id[100] |
+		((unsigned long long)id[101] << 16) |
+		((unsigned long long)id[102] << 32) |
+		((unsigned long long)id[103] << 48);
+}
+
 static int write_sectors(const char *data, unsigned long long sector,
 			size_t count)
 {
@@ -237,6 +268,9 @@ static int process_bio_queue(void *data)
 {
 	(void) data;
 
+	/* threads waiting for the disk shouldn't also wait for the CPU */
+	set_thread_scheduler(current(), SCHED_FIFO, IDE_RT_PRIO);
+
 	while (!done) {
 		struct bio *bio = dequeue_bio();
 
@@ -284,8 +318,15 @@ void bio_wait(struct bio *bio)
 	mutex_unlock(&bio->mutex);
 }
 
+unsigned long long ide_capacity(void)
+{ return ide_sectors; }
+
 void setup_ide(void)
 {
+	local_preempt_disable();
+	ide_sectors = ide_identify();
+	local_preempt_enable();
+
 	DBG_ASSERT((ide_bio_cache = KMEM_CACHE(struct bio)) != 0);
 	DBG_ASSERT(create_kthread(&process_bio_queue, 0) >= 0);
 
@@ -37,6 +37,8 @@ void bio_free(struct bio *bio);
 void bio_submit(struct bio *bio);
 void bio_wait(struct bio *bio);
 
+/* disk size in 512 byte sectors, 0 if there is no disk */
+unsigned long long ide_capacity(void);
 void setup_ide(void);
 
 #endif /*__IDE_H__*/
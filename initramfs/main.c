@@ -21,8 +21,23 @@ static long wait(long pid)
 static long fork(void)
 { return syscall(4); }
 
-static long exec(const char *cmd)
-{ return syscall(5, cmd); }
+static long exec(int argc, const char **argv)
+{ return syscall(5, argc, argv); }
+
+static void *mmap(size_t size, int writable)
+{ return (void *)syscall(6, size, writable); }
+
+static long munmap(void *addr, size_t size)
+{ return syscall(7, addr, size); }
+
+static long spawn(int argc, const char **argv)
+{ return syscall(8, argc, argv); }
+
+static long vfork(void)
+{ return syscall(9); }
+
+static void *mmap_file(const char *name, size_t offset, size_t size, int perm)
+{ return (void *)syscall(10, name, offset, size, perm); }
 
 static void printf_write(struct vsnprintf_sink *sink,
 			const char *data, size_t size)
@@ -54,6 +69,87 @@ static void puts(const char *str)
 	write("\n", 1);
 }
 
+static int check_pages(const char *buf, size_t size, char tag)
+{
+	for (size_t i = 0; i < size; i += 4096) {
+		if (buf[i] != tag || buf[i + 1] != (char)(i >> 12))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Parent and child write to the same page tables shared after fork at the
+ * same time, both must end up with their own copy of every page.
+ */
+static void test_fork_cow(void)
+{
+	const size_t size = 4 * 1024 * 1024;
+	char *buf = mmap(size, 1);
+
+	if ((long)buf < 0) {
+		printf("mmap failed with error %ld\n", (long)buf);
+		return;
+	}
+
+	for (size_t i = 0; i < size; i += 4096) {
+		buf[i] = 'o';
+		buf[i + 1] = (char)(i >> 12);
+	}
+
+	const long pid = fork();
+
+	if (pid < 0) {
+		printf("Fork failed with error %ld\n", pid);
+		munmap(buf, size);
+		return;
+	}
+
+	const char tag = pid ? 'p' : 'c';
+
+	for (size_t i = 0; i < size; i += 4096)
+		buf[i] = tag;
+
+	printf("Fork COW test %s in %s\n",
+		check_pages(buf, size, tag) ? "passed" : "FAILED",
+		pid ? "parent" : "child");
+
+	if (!pid)
+		exit();
+
+	wait(pid);
+	printf("Fork COW test %s in parent after child exit\n",
+		check_pages(buf, size, tag) ? "passed" : "FAILED");
+	munmap(buf, size);
+}
+
+/* runs argv[0] child with spawn and with vfork + exec */
+static void test_spawn(const char *name)
+{
+	const char *args[] = { name, "child", 0 };
+	long pid = spawn(2, args);
+
+	if (pid < 0) {
+		printf("Spawn failed with error %ld\n", pid);
+	} else {
+		printf("Spawned child process %ld\n", pid);
+		printf("Wait returned %ld\n", wait(pid));
+	}
+
+	pid = vfork();
+	if (pid == 0) {
+		const long rc = exec(2, args);
+
+		printf("Exec in vfork child failed with error %ld\n", rc);
+		exit();
+	} else if (pid > 0) {
+		printf("Vforked child process %ld\n", pid);
+		printf("Wait returned %ld\n", wait(pid));
+	} else {
+		printf("Vfork failed with error %ld\n", pid);
+	}
+}
+
 void main(int argc, char **argv)
 {
 	printf("Userspace process pid %ld\n", getpid());
@@ -61,6 +157,33 @@ void main(int argc, char **argv)
 	for (int i = 0; i != argc; ++i)
 		printf("argv[%d] = %s\n", i, argv[i]);
 
+	if (argc > 1 && !strcmp(argv[1], "child")) {
+		printf("Child process %ld exits\n", getpid());
+		exit();
+	}
+
+	const size_t size = 64 * 1024;
+	char *buf = mmap(size, 1);
+
+	if ((long)buf < 0) {
+		printf("mmap failed with error %ld\n", (long)buf);
+	} else {
+		for (size_t i = 0; i != size; ++i)
+			buf[i] = (char)i;
+		printf("Mapped %lu bytes at %p\n", (unsigned long)size, buf);
+		munmap(buf, size);
+	}
+
+	const char *image = mmap_file(argv[0], 0, 4096, 0);
+
+	if ((long)image < 0) {
+		printf("mmap_file failed with error %ld\n", (long)image);
+	} else {
+		printf("%s starts with %s ELF magic\n", argv[0],
+			memcmp(image, "\177ELF", 4) ? "wrong" : "correct");
+		munmap((void *)image, 4096);
+	}
+
 	const long pid = fork();
 
 	if (pid == 0) {
@@ -76,5 +199,8 @@ void main(int argc, char **argv)
 		printf("Fork failed with error %ld\n", pid);
 	}
 
+	test_fork_cow();
+	test_spawn(argv[0]);
+
 	while (1);
 }
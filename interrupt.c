@@ -7,6 +7,7 @@
 #include "string.h"
 #include "stdio.h"
 #include "error.h"
+#include "lapic.h"
 #include "mm.h"
 
 #include <stdint.h>
@@ -15,10 +16,13 @@
 #define IDT_64INT      ((uint64_t)14 << 40)
 #define IDT_64TRAP     ((uint64_t)15 << 40)
 #define IDT_USER       ((uint64_t)3 << 45)
+#define IDT_SPURIOUS   SPURIOUS_INTNO
 #define IDT_SYSCALL    0x80
 #define IDT_SIZE       (IDT_SYSCALL + 1)
 #define IDT_IRQS       16
 #define IDT_EXCEPTIONS 32
+#define IDT_LOCAL      TIMER_INTNO
+#define IDT_LOCAL_IRQS 3
 
 
 struct idt_entry {
@@ -34,11 +38,13 @@ struct idt_ptr {
 
 typedef void (*raw_isr_entry_t)(void);
 extern raw_isr_entry_t isr_entry[];
+extern raw_isr_entry_t local_isr_entry[];
 extern void trap_handler(void);
 
 static struct idt_entry idt[IDT_SIZE];
 static struct idt_ptr idt_ptr;
 static irq_t handler[IDT_IRQS];
+static irq_t local_handler[IDT_LOCAL_IRQS];
 static int irqmask_count[IDT_IRQS];
 static const struct irqchip *irqchip;
 
@@ -195,14 +201,22 @@ void isr_common_handler(struct thread_regs *ctx)
 		return;
 	}
 
-	const int irqno = intno - IDT_EXCEPTIONS;
-	const irq_t irq = handler[irqno];
-
-	mask_irq(irqno);
-	ack_irq(irqno);
-	if (irq)
-		irq(irqno);
-	unmask_irq(irqno);
+	if (intno >= IDT_LOCAL && intno < IDT_LOCAL + IDT_LOCAL_IRQS) {
+		const irq_t irq = local_handler[intno - IDT_LOCAL];
+
+		lapic_eoi();
+		if (irq)
+			irq(intno);
+	} else {
+		const int irqno = intno - IDT_EXCEPTIONS;
+		const irq_t irq = handler[irqno];
+
+		mask_irq(irqno);
+		ack_irq(irqno);
+		if (irq)
+			irq(irqno);
+		unmask_irq(irqno);
+	}
 
 	if (need_resched())
 		schedule();
@@ -232,6 +246,17 @@ void unregister_irq_handler(int irq, irq_t isr)
 	}
 }
 
+void register_local_handler(int intno, irq_t isr)
+{
+	DBG_ASSERT(intno >= IDT_LOCAL && intno < IDT_LOCAL + IDT_LOCAL_IRQS);
+
+	local_handler[intno - IDT_LOCAL] = isr;
+	setup_irq(local_isr_entry[intno - IDT_LOCAL], intno);
+}
+
+void load_ints(void)
+{ set_idt(&idt_ptr); }
+
 void setup_ints(void)
 {
 	for (int i = 0; i != IDT_IRQS; ++i)
@@ -244,6 +269,10 @@ void setup_ints(void)
 
 	setup_syscall(&syscall_handler, IDT_SYSCALL);
 
+	extern void spurious_handler(void);
+
+	setup_irq(&spurious_handler, IDT_SPURIOUS);
+
 	idt_ptr.size = sizeof(idt) - 1;
 	idt_ptr.base = (uintptr_t)idt;
 	set_idt(&idt_ptr);
@@ -5,6 +5,18 @@
 
 #define RFLAGS_IF (1ul << 9)
 
+/* local APIC spurious interrupt vector, has nothing to acknowledge */
+#define SPURIOUS_INTNO 0x7f
+
+/* local APIC timer vector, every CPU has its own timer */
+#define TIMER_INTNO    0x40
+
+/* IPI that wakes up a halted CPU to look for work */
+#define RESCHED_INTNO  0x41
+
+/* IPI that asks a CPU to flush its TLB, see flush_tlb_range */
+#define TLB_INTNO      0x42
+
 typedef void (*irq_t)(int irq);
 
 inline static void local_irq_disable(void)
@@ -24,6 +36,10 @@ inline static unsigned long local_save_flags(void)
 inline static void local_restore_flags(unsigned long flags)
 { __asm__ ("pushq %0 ; popfq" : : "g"(flags) : "memory"); }
 
+/* sti takes effect after hlt starts, so no interrupt slips in between */
+inline static void local_irq_enable_halt(void)
+{ __asm__ volatile ("sti ; hlt" : : : "memory"); }
+
 inline static bool local_irq_enabled(void)
 { return (local_save_flags() & RFLAGS_IF) != 0; }
 
@@ -46,6 +62,10 @@ inline static void local_irqrestore(unsigned long flags)
 
 void register_irq_handler(int irq, irq_t isr);
 void unregister_irq_handler(int irq, irq_t isr);
+/* handler of a local APIC vector, gets the vector instead of irq */
+void register_local_handler(int intno, irq_t isr);
 void setup_ints(void);
+/* loads IDT on a secondary CPU */
+void load_ints(void);
 
 #endif /*__INTERRUPT_H__*/
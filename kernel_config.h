@@ -17,5 +17,17 @@
 #define CONFIG_KMAP_SIZE        (512ul * 1024ul * 1024ul - 4096ul)
 #define CONFIG_KERNEL_STACK     1
 #define CONFIG_USER_STACK_SIZE  (2ul * 1024ul * 1024ul) // 2M is enough so far
+#define CONFIG_PT_QUICKLIST_SIZE 64     /* cached zeroed page tables */
+#define CONFIG_FAULT_AROUND_PAGES 16    /* power of 2, at most 512 */
+#define CONFIG_EXEC_CACHE_SIZE  8       /* cached ELF images */
+#define CONFIG_KSM_SCAN_PAGES   256     /* page slots per ksm scan step */
+#define CONFIG_KSM_SCAN_MS      1000    /* pause between ksm passes */
+#define CONFIG_SWAP_RECLAIM_PAGES 32    /* pages to swap out when out of memory */
+#define CONFIG_SWAP_CLUSTER_PAGES 8     /* pages per swap disk transfer */
+#define CONFIG_SWAP_SECTOR      4096    /* start of mkswap'ed area on the disk */
+#define CONFIG_SWAP_PAGES       0       /* size of the swap area, 0 - no swap */
+#define CONFIG_MAX_CPUS         8       /* CPUs above the limit stay offline */
+#define CONFIG_SCHED_BALANCE_MS 100     /* period of runqueue load balancing */
+#define CONFIG_SCHED_FAIR               /* fair scheduler instead of round robin */
 
 #endif /*__KERNEL_CONFIG_H__*/
@@ -28,7 +28,7 @@ struct kmem_cache {
 	struct list_head part_list;
 	struct list_head free_list;
 	struct list_head full_list;
-	struct spinlock lock;
+	struct mcs_lock lock;
 	size_t object_align;
 	size_t object_size;
 	int order;
@@ -40,7 +40,7 @@ static void kmem_cache_init(struct kmem_cache *cache)
 	list_init(&cache->free_list);
 	list_init(&cache->part_list);
 	list_init(&cache->full_list);
-	spinlock_init(&cache->lock);
+	mcs_lock_init(&cache->lock);
 }
 
 static bool kmem_cache_grow(struct kmem_cache *cache)
@@ -64,10 +64,11 @@ static bool kmem_cache_grow(struct kmem_cache *cache)
 	slab->cache = cache;
 	slab->pages = pages;
 
-	const bool enabled = spin_lock_irqsave(&cache->lock);
+	struct mcs_node mcs;
+	const bool enabled = mcs_lock_irqsave(&cache->lock, &mcs);
 
 	list_add(&slab->link, &cache->free_list);
-	spin_unlock_irqrestore(&cache->lock, enabled);
+	mcs_unlock_irqrestore(&cache->lock, &mcs, enabled);
 
 	return true;
 }
@@ -75,11 +76,12 @@ static bool kmem_cache_grow(struct kmem_cache *cache)
 void kmem_cache_reap(struct kmem_cache *cache)
 {
 	LIST_HEAD(list);
+	struct mcs_node mcs;
 
-	const bool enabled = spin_lock_irqsave(&cache->lock);
+	const bool enabled = mcs_lock_irqsave(&cache->lock, &mcs);
 
 	list_splice(&cache->free_list, &list);
-	spin_unlock_irqrestore(&cache->lock, enabled);
+	mcs_unlock_irqrestore(&cache->lock, &mcs, enabled);
 
 	for (struct list_head *ptr = list.next; ptr != &list;) {
 		struct kmem_slab *slab =
@@ -94,10 +96,9 @@ void kmem_cache_reap(struct kmem_cache *cache)
 	}
 }
 
-void *kmem_cache_alloc(struct kmem_cache *cache)
+/* cache->lock must be held, returns 0 if the cache has to grow */
+static void *__kmem_cache_alloc(struct kmem_cache *cache)
 {
-	const bool enabled = spin_lock_irqsave(&cache->lock);
-
 	if (!list_empty(&cache->part_list)) {
 		struct list_head *node = list_first(&cache->part_list);
 		struct kmem_slab *slab =
@@ -111,14 +112,11 @@ void *kmem_cache_alloc(struct kmem_cache *cache)
 			list_del(&slab->link);
 			list_add(&slab->link, &cache->full_list);
 		}
-		spin_unlock_irqrestore(&cache->lock, enabled);
 		return ptr;
 	}
 
-	if (list_empty(&cache->free_list) && !kmem_cache_grow(cache)) {
-		spin_unlock_irqrestore(&cache->lock, enabled);
+	if (list_empty(&cache->free_list))
 		return 0;
-	}
 
 	struct list_head *node = list_first(&cache->free_list);
 	struct kmem_slab *slab = LIST_ENTRY(node, struct kmem_slab, link);
@@ -130,7 +128,22 @@ void *kmem_cache_alloc(struct kmem_cache *cache)
 	list_del(&slab->link);
 	list_add(&slab->link, &cache->part_list);
 
-	spin_unlock_irqrestore(&cache->lock, enabled);
+	return ptr;
+}
+
+/* grows the cache without the lock, it takes the lock itself */
+void *kmem_cache_alloc(struct kmem_cache *cache)
+{
+	struct mcs_node mcs;
+	void *ptr;
+
+	do {
+		const bool enabled = mcs_lock_irqsave(&cache->lock, &mcs);
+
+		ptr = __kmem_cache_alloc(cache);
+		mcs_unlock_irqrestore(&cache->lock, &mcs, enabled);
+	} while (!ptr && kmem_cache_grow(cache));
+
 	return ptr;
 }
 
@@ -144,7 +157,8 @@ static struct kmem_slab *kmem_get_slab(void *ptr)
 void kmem_cache_free(struct kmem_cache *cache, void *ptr)
 {
 	struct kmem_slab *slab = kmem_get_slab(ptr);
-	const bool enabled = spin_lock_irqsave(&cache->lock);
+	struct mcs_node mcs;
+	const bool enabled = mcs_lock_irqsave(&cache->lock, &mcs);
 
 	slab->ops->free(cache, slab, ptr);
 	++slab->free;
@@ -152,7 +166,7 @@ void kmem_cache_free(struct kmem_cache *cache, void *ptr)
 	if (slab->free == slab->total) {
 		list_del(&slab->link);
 		list_add(&slab->link, &cache->free_list);
-		spin_unlock_irqrestore(&cache->lock, enabled);
+		mcs_unlock_irqrestore(&cache->lock, &mcs, enabled);
 		return;
 	}
 
@@ -160,7 +174,7 @@ void kmem_cache_free(struct kmem_cache *cache, void *ptr)
 		list_del(&slab->link);
 		list_add(&slab->link, &cache->part_list);
 	}
-	spin_unlock_irqrestore(&cache->lock, enabled);
+	mcs_unlock_irqrestore(&cache->lock, &mcs, enabled);
 }
 
 
@@ -0,0 +1,364 @@
+#include "kmem_cache.h"
+#include "threads.h"
+#include "paging.h"
+#include "memory.h"
+#include "string.h"
+#include "stdio.h"
+#include "time.h"
+#include "rmap.h"
+#include "ksm.h"
+#include "mm.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+/* the scanner only saves memory, it shouldn't take CPU from anybody */
+#define KSM_NICE 19
+
+/* pages mapped by more mms than that are not merged */
+#define KSM_MAX_MMS 16
+
+/*
+ * Same page merging works like this: the scanner walks writable anonymous
+ * pages of all mms and looks every page up by content in two trees:
+ *  - stable tree contains merged pages, they are mapped read only, so
+ *    anon_page_fault copies them on write as any other COW page;
+ *  - unstable tree contains pages seen during the current pass, their
+ *    content might change at any time, so it's rebuilt on every pass.
+ * When a page matches a page from the unstable tree, both are merged and
+ * the page moves to the stable tree.
+ */
+struct ksm_item {
+	struct rb_node link;
+	uint64_t hash;
+	struct page *page; // holds a reference
+};
+
+struct ksm_iter {
+	struct rb_node **plink;
+	struct rb_node *parent;
+	struct ksm_item *item;
+};
+
+static struct kmem_cache *ksm_item_cache;
+static struct rb_tree ksm_stable;
+static struct rb_tree ksm_unstable;
+static bool ksm_flush; // write protected something since the last flush
+
+static uint64_t ksm_hash(const void *data)
+{
+	const uint64_t *words = data;
+	uint64_t hash = 14695981039346656037ull;
+
+	for (size_t i = 0; i != PAGE_SIZE / sizeof(*words); ++i) {
+		hash ^= words[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+static int ksm_cmp(uint64_t hash, const void *data,
+			const struct ksm_item *item)
+{
+	if (hash != item->hash)
+		return hash < item->hash ? -1 : 1;
+	return memcmp(data, page_addr(item->page), PAGE_SIZE);
+}
+
+static bool ksm_lookup(struct rb_tree *tree, uint64_t hash, const void *data,
+			struct ksm_iter *iter)
+{
+	struct rb_node **plink = &tree->root;
+	struct rb_node *parent = 0;
+
+	while (*plink) {
+		struct ksm_item *item = TREE_ENTRY(*plink, struct ksm_item,
+					link);
+		const int cmp = ksm_cmp(hash, data, item);
+
+		if (!cmp) {
+			iter->plink = plink;
+			iter->parent = parent;
+			iter->item = item;
+			return true;
+		}
+
+		parent = *plink;
+		if (cmp < 0)
+			plink = &parent->left;
+		else
+			plink = &parent->right;
+	}
+
+	iter->plink = plink;
+	iter->parent = parent;
+	iter->item = 0;
+	return false;
+}
+
+static void ksm_insert(struct rb_tree *tree, struct ksm_item *item,
+			struct ksm_iter *iter)
+{
+	rb_link(&item->link, iter->parent, iter->plink);
+	rb_insert(&item->link, tree);
+}
+
+static struct page *pte_page(pte_t pte)
+{ return pfn2page(pte_phys(pte) >> PAGE_BITS); }
+
+/* maps page instead of the one pte points to, write protected */
+static void ksm_replace(pte_t *pte, struct page *page)
+{
+	struct page *old = pte_page(*pte);
+
+	get_page(page);
+	*pte = page_paddr(page) | ((*pte & PTE_FLAGS) & ~PTE_WRITE);
+	put_page(old);
+	ksm_flush = true;
+}
+
+static bool ksm_locked(struct mm **mms, int count, struct mm *mm)
+{
+	for (int i = 0; i != count; ++i) {
+		if (mms[i] == mm)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Makes sure nobody writes to the page behind our back, page tables of mm
+ * are locked by the caller. Page tables of other mms can change until we
+ * lock them, so a mapping that shows up later fails the whole thing.
+ */
+static bool ksm_write_protect(struct mm *mm, struct page *page)
+{
+	struct mm *mms[KSM_MAX_MMS];
+	struct rmap_iter iter;
+	bool ok = true;
+	int count = 0;
+
+	/* some mappings aren't tracked, so we can't find them all */
+	if (!page->anon_vma && page_count(page) != 1)
+		return false;
+
+	mms[count++] = mm;
+	for_each_rmap(page, iter) {
+		struct mm *other = iter.vma->mm;
+
+		if (ksm_locked(mms, count, other))
+			continue;
+
+		if (count == KSM_MAX_MMS || !mm_pt_trylock_scan(other)) {
+			ok = false;
+			break;
+		}
+		mms[count++] = other;
+	}
+
+	if (ok) {
+		for_each_rmap(page, iter) {
+			if (!ksm_locked(mms, count, iter.vma->mm)) {
+				ok = false;
+				continue;
+			}
+			*iter.pte &= ~PTE_WRITE;
+		}
+		ksm_flush = true;
+	}
+
+	while (count != 1)
+		mm_pt_unlock_scan(mms[--count]);
+	return ok;
+}
+
+static void ksm_scan_pte(struct mm *mm, pte_t *pte)
+{
+	/*
+	 * read only pages are the zero page, merged pages or pages already
+	 * shared by COW, nothing to do with them
+	 */
+	if (!pte_present(*pte) || !pte_write(*pte))
+		return;
+
+	struct page *page = pte_page(*pte);
+	const void *data = page_addr(page);
+	const uint64_t hash = ksm_hash(data);
+	struct ksm_iter iter;
+
+	if (ksm_lookup(&ksm_stable, hash, data, &iter)) {
+		ksm_replace(pte, iter.item->page);
+		return;
+	}
+
+	struct ksm_iter stable = iter;
+
+	if (!ksm_lookup(&ksm_unstable, hash, data, &iter)) {
+		struct ksm_item *item = kmem_cache_alloc(ksm_item_cache);
+
+		if (!item)
+			return;
+
+		get_page(page);
+		item->hash = hash;
+		item->page = page;
+		ksm_insert(&ksm_unstable, item, &iter);
+		return;
+	}
+
+	struct ksm_item *item = iter.item;
+
+	if (item->page == page)
+		return;
+
+	if (!ksm_write_protect(mm, item->page))
+		return;
+
+	/* merged page is mapped at different addresses */
+	page_remove_rmap(item->page);
+	rb_erase(&item->link, &ksm_unstable);
+	ksm_insert(&ksm_stable, item, &stable);
+	ksm_replace(pte, item->page);
+}
+
+/*
+ * Scans up to count page slots of mm starting from addr, returns address
+ * to continue from or TASK_SIZE if we are done with the mm.
+ */
+static virt_t ksm_scan_mm(struct mm *mm, virt_t addr, size_t count)
+{
+	pte_t *pml4 = page_addr(mm->pt);
+
+	while (count) {
+		struct vma *vma = find_vma(mm, addr);
+
+		if (!vma)
+			return TASK_SIZE;
+
+		/* file pages belong to the file */
+		if (vma->node || !(vma->perm & VMA_PERM_WRITE)) {
+			addr = vma->end;
+			continue;
+		}
+
+		const virt_t from = MAXU(addr, vma->begin);
+		const virt_t to = MINU(vma->end,
+					from + ((virt_t)count << PAGE_BITS));
+		struct pt_iter iter;
+
+		for_each_slot_in_range(pml4, from, to, iter) {
+			if (iter.level == 0)
+				ksm_scan_pte(mm, &iter.pt[0][iter.idx[0]]);
+			if (count)
+				--count;
+		}
+		addr = to;
+	}
+
+	return addr;
+}
+
+static void __ksm_release(struct rb_node *node)
+{
+	while (node) {
+		struct ksm_item *item = TREE_ENTRY(node, struct ksm_item, link);
+
+		__ksm_release(node->right);
+		node = node->left;
+
+		put_page(item->page);
+		kmem_cache_free(ksm_item_cache, item);
+	}
+}
+
+/* drops merged pages nobody maps anymore, returns number of saved pages */
+static unsigned long ksm_prune(void)
+{
+	struct rb_node *ptr = rb_leftmost(ksm_stable.root);
+	unsigned long saved = 0;
+
+	while (ptr) {
+		struct ksm_item *item = TREE_ENTRY(ptr, struct ksm_item, link);
+
+		ptr = rb_next(ptr);
+
+		/* one reference is ours */
+		const unsigned long count = page_count(item->page);
+
+		if (count > 2) {
+			saved += count - 2;
+			continue;
+		}
+
+		if (count == 1) {
+			rb_erase(&item->link, &ksm_stable);
+			put_page(item->page);
+			kmem_cache_free(ksm_item_cache, item);
+		}
+	}
+	return saved;
+}
+
+static void ksm_scan_pass(void)
+{
+	struct mm *mm = 0;
+
+	while ((mm = next_mm(mm))) {
+		virt_t addr = 0;
+
+		while (addr < TASK_SIZE) {
+			/* nobody can change page tables under us */
+			const bool enabled = local_preempt_save();
+
+			/* wait for page fault or munmap to finish */
+			if (mm_pt_trylock_scan(mm)) {
+				addr = ksm_scan_mm(mm, addr,
+							CONFIG_KSM_SCAN_PAGES);
+				mm_pt_unlock_scan(mm);
+			}
+
+			/* we might have write protected pages of any mm */
+			if (ksm_flush)
+				flush_tlb_all();
+			ksm_flush = false;
+			local_preempt_restore(enabled);
+			schedule();
+		}
+	}
+
+	const bool enabled = local_preempt_save();
+
+	__ksm_release(ksm_unstable.root);
+	ksm_unstable.root = 0;
+	local_preempt_restore(enabled);
+}
+
+static int ksm_scanner(void *data)
+{
+	unsigned long reported = 0;
+
+	(void) data;
+
+	set_thread_nice(current(), KSM_NICE);
+	while (1) {
+		ksm_scan_pass();
+
+		const bool enabled = local_preempt_save();
+		const unsigned long saved = ksm_prune();
+
+		local_preempt_restore(enabled);
+
+		if (saved != reported)
+			DBG_INFO("ksm: %lu pages saved", saved);
+		reported = saved;
+		thread_sleep_ns(CONFIG_KSM_SCAN_MS * NSEC_PER_MSEC);
+	}
+	return 0;
+}
+
+void setup_ksm(void)
+{
+	DBG_ASSERT((ksm_item_cache = KMEM_CACHE(struct ksm_item)) != 0);
+	DBG_ASSERT(create_kthread(&ksm_scanner, 0) >= 0);
+}
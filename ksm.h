@@ -0,0 +1,6 @@
+#ifndef __KSM_H__
+#define __KSM_H__
+
+void setup_ksm(void);
+
+#endif /*__KSM_H__*/
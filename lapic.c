@@ -0,0 +1,112 @@
+#include "paging.h"
+#include "kernel.h"
+#include "lapic.h"
+#include "error.h"
+#include "stdio.h"
+
+
+#define LAPIC_ID               0x020
+#define LAPIC_EOI              0x0b0
+#define LAPIC_SVR              0x0f0
+#define LAPIC_ICR_LOW          0x300
+#define LAPIC_ICR_HIGH         0x310
+#define LAPIC_LVT_TIMER        0x320
+#define LAPIC_LVT_LINT0        0x350
+#define LAPIC_LVT_LINT1        0x360
+#define LAPIC_TIMER_INIT       0x380
+#define LAPIC_TIMER_CURRENT    0x390
+#define LAPIC_TIMER_DIVIDE     0x3e0
+#define LAPIC_SIZE             0x400
+
+#define LAPIC_SVR_ENABLE       BIT_CONST(8)
+
+#define LAPIC_ICR_INIT         (5ul << 8)
+#define LAPIC_ICR_STARTUP      (6ul << 8)
+#define LAPIC_ICR_PENDING      BIT_CONST(12)
+#define LAPIC_ICR_ASSERT       BIT_CONST(14)
+
+#define LAPIC_LVT_NMI          (4ul << 8)
+#define LAPIC_LVT_EXTINT       (7ul << 8)
+#define LAPIC_LVT_MASKED       BIT_CONST(16)
+
+/* one-shot mode is 0 in the timer mode bits, counts bus clock / 16 */
+#define LAPIC_TIMER_DIV16      0x3
+
+
+static volatile uint32_t *lapic;
+
+
+static uint32_t lapic_read(int reg)
+{ return lapic[reg / sizeof(*lapic)]; }
+
+static void lapic_write(int reg, uint32_t value)
+{ lapic[reg / sizeof(*lapic)] = value; }
+
+int lapic_id(void)
+{ return lapic_read(LAPIC_ID) >> 24; }
+
+void lapic_enable(int spurious)
+{ lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | (spurious & 0xff)); }
+
+void lapic_eoi(void)
+{ lapic_write(LAPIC_EOI, 0); }
+
+bool lapic_present(void)
+{ return lapic != 0; }
+
+/* i8259 interrupts reach the BSP through LINT0 once the APIC is enabled */
+void lapic_virtual_wire(void)
+{
+	lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_EXTINT);
+	lapic_write(LAPIC_LVT_LINT1, LAPIC_LVT_NMI);
+}
+
+void lapic_timer_setup(int vector)
+{
+	lapic_write(LAPIC_TIMER_INIT, 0);
+	lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIV16);
+	lapic_write(LAPIC_LVT_TIMER, vector & 0xff);
+}
+
+/* count 0 stops the timer */
+void lapic_timer_start(uint32_t count)
+{ lapic_write(LAPIC_TIMER_INIT, count); }
+
+uint32_t lapic_timer_count(void)
+{ return lapic_read(LAPIC_TIMER_CURRENT); }
+
+static void lapic_send_ipi(int apic_id, uint32_t cmd)
+{
+	lapic_write(LAPIC_ICR_HIGH, (uint32_t)apic_id << 24);
+	lapic_write(LAPIC_ICR_LOW, cmd);
+
+	while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING)
+		barrier();
+}
+
+void lapic_send_init(int apic_id)
+{ lapic_send_ipi(apic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT); }
+
+void lapic_send_sipi(int apic_id, int vector)
+{
+	lapic_send_ipi(apic_id, LAPIC_ICR_STARTUP | LAPIC_ICR_ASSERT |
+				(vector & 0xff));
+}
+
+/* fixed delivery mode is 0 */
+void lapic_send_fixed(int apic_id, int vector)
+{ lapic_send_ipi(apic_id, LAPIC_ICR_ASSERT | (vector & 0xff)); }
+
+/* all local APICs are at the same physical address */
+int setup_lapic(phys_t base)
+{
+	if (lapic)
+		return 0;
+
+	lapic = ioremap(base, LAPIC_SIZE);
+	if (!lapic)
+		return -ENOMEM;
+
+	DBG_INFO("local APIC at %#lx", (unsigned long)base);
+	return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef __LAPIC_H__
+#define __LAPIC_H__
+
+#include "memory.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+int lapic_id(void);
+void lapic_enable(int spurious);
+void lapic_eoi(void);
+bool lapic_present(void);
+void lapic_virtual_wire(void);
+void lapic_timer_setup(int vector);
+void lapic_timer_start(uint32_t count);
+uint32_t lapic_timer_count(void);
+void lapic_send_init(int apic_id);
+void lapic_send_sipi(int apic_id, int vector);
+void lapic_send_fixed(int apic_id, int vector);
+
+int setup_lapic(phys_t base);
+
+#endif /*__LAPIC_H__*/
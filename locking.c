@@ -1,5 +1,52 @@
 #include "locking.h"
 #include "threads.h"
+#include "error.h"
+
+
+void __mcs_lock(struct mcs_lock *lock, struct mcs_node *node)
+{
+	node->next = 0;
+	node->locked = 0;
+
+	struct mcs_node *prev = __atomic_exchange_n(&lock->tail, node,
+				__ATOMIC_ACQ_REL);
+
+	if (!prev)
+		return;
+
+	__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+	while (!__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
+		cpu_relax();
+}
+
+bool __mcs_trylock(struct mcs_lock *lock, struct mcs_node *node)
+{
+	struct mcs_node *tail = 0;
+
+	node->next = 0;
+	node->locked = 0;
+	return __atomic_compare_exchange_n(&lock->tail, &tail, node, false,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+void __mcs_unlock(struct mcs_lock *lock, struct mcs_node *node)
+{
+	struct mcs_node *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+
+	if (!next) {
+		struct mcs_node *tail = node;
+
+		if (__atomic_compare_exchange_n(&lock->tail, &tail, 0, false,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return;
+
+		/* somebody is between xchg and linking to us */
+		while (!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)))
+			cpu_relax();
+	}
+
+	__atomic_store_n(&next->locked, 1, __ATOMIC_RELEASE);
+}
 
 
 static void __wait_queue_notify(struct wait_queue *queue)
@@ -9,6 +56,7 @@ static void __wait_queue_notify(struct wait_queue *queue)
 		struct wait_head *wh = LIST_ENTRY(ptr, struct wait_head, link);
 
 		list_del(ptr);
+		list_init(ptr);
 		activate_thread(wh->thread);
 	}
 }
@@ -21,22 +69,14 @@ void wait_queue_notify(struct wait_queue *queue)
 	spin_unlock_irqrestore(&queue->lock, flags);
 }
 
+/* wait heads are on the waiters stacks, so they go with the lock held */
 void wait_queue_notify_all(struct wait_queue *queue)
 {
-	LIST_HEAD(threads);
 	const unsigned long flags = spin_lock_irqsave(&queue->lock);
 
-	list_splice(&queue->threads, &threads);
+	while (!list_empty(&queue->threads))
+		__wait_queue_notify(queue);
 	spin_unlock_irqrestore(&queue->lock, flags);
-
-	struct list_head *head = &threads;
-	struct list_head *ptr = head->next;
-
-	for (; ptr != head; ptr = ptr->next) {
-		struct wait_head *wh = LIST_ENTRY(ptr, struct wait_head, link);
-
-		activate_thread(wh->thread);
-	}
 }
 
 static bool __mutex_try_lock(struct mutex *mutex)
@@ -53,6 +93,14 @@ void mutex_lock(struct mutex *mutex)
 	WAIT_EVENT(&mutex->wq, __mutex_try_lock(mutex));
 }
 
+int mutex_lock_timeout(struct mutex *mutex, unsigned long long timeout)
+{
+	int rc;
+
+	WAIT_EVENT_TIMEOUT(&mutex->wq, __mutex_try_lock(mutex), timeout, rc);
+	return rc;
+}
+
 void mutex_unlock(struct mutex *mutex)
 {
 	const bool enabled = spin_lock_irqsave(&mutex->wq.lock);
@@ -80,6 +128,40 @@ void condition_wait(struct mutex *mutex, struct condition *condition)
 	mutex_lock(mutex);
 }
 
+int condition_wait_timeout(struct mutex *mutex, struct condition *condition,
+			unsigned long long timeout)
+{
+	struct thread *self = current();
+	struct wakeup_timer timer;
+	struct wait_head wh;
+	int rc = 0;
+
+	wakeup_timer_init(&timer, timeout);
+	wh.thread = self;
+
+	spin_lock(&condition->wq.lock);
+	self->state = THREAD_BLOCKED;
+	list_add_tail(&wh.link, &condition->wq.threads);
+	wakeup_timer_arm(&timer);
+	mutex_unlock(mutex);
+	spin_unlock(&condition->wq.lock);
+
+	schedule();
+
+	/* still queued, so nobody notified us */
+	spin_lock(&condition->wq.lock);
+	if (!list_empty(&wh.link)) {
+		list_del(&wh.link);
+		if (wakeup_timer_expired(&timer))
+			rc = -ETIMEDOUT;
+	}
+	spin_unlock(&condition->wq.lock);
+
+	wakeup_timer_cancel(&timer);
+	mutex_lock(mutex);
+	return rc;
+}
+
 void condition_notify(struct condition *condition)
 {
 	wait_queue_notify(&condition->wq);
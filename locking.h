@@ -5,39 +5,157 @@
 #include "stdio.h"
 #include "list.h"
 
-struct spinlock { void *padding; };
+#include <stdint.h>
 
-#define SPINLOCK_INIT(name)	{ 0 }
+
+static inline void cpu_relax(void)
+{ __asm__ volatile ("pause" : : : "memory"); }
+
+
+/*
+ * Ticket lock: CPUs take the lock in the order they came, so nobody
+ * starves. Like before, holding a spinlock disables interrupts, since
+ * that's how we disable preemption.
+ */
+struct spinlock {
+	uint16_t owner;
+	uint16_t next;
+};
+
+#define SPINLOCK_INIT(name)	{ 0, 0 }
 #define DEFINE_SPINLOCK(name) 	struct spinlock name = SPINLOCK_INIT(name)
 
 static inline void spinlock_init(struct spinlock *lock)
-{ lock->padding = 0; }
+{
+	lock->owner = 0;
+	lock->next = 0;
+}
+
+static inline void __spin_lock(struct spinlock *lock)
+{
+	const uint16_t ticket = __atomic_fetch_add(&lock->next, 1,
+				__ATOMIC_RELAXED);
+
+	while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket)
+		cpu_relax();
+}
+
+static inline bool __spin_trylock(struct spinlock *lock)
+{
+	const uint16_t owner = __atomic_load_n(&lock->owner, __ATOMIC_RELAXED);
+	uint16_t next = owner;
+
+	return __atomic_compare_exchange_n(&lock->next, &next,
+				(uint16_t)(owner + 1), false,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void __spin_unlock(struct spinlock *lock)
+{
+	__atomic_store_n(&lock->owner, (uint16_t)(lock->owner + 1),
+				__ATOMIC_RELEASE);
+}
+
+static inline bool spin_is_locked(struct spinlock *lock)
+{
+	return __atomic_load_n(&lock->owner, __ATOMIC_RELAXED) !=
+				__atomic_load_n(&lock->next, __ATOMIC_RELAXED);
+}
 
 static inline void spin_lock(struct spinlock *lock)
 {
-	(void) lock;
+	local_preempt_disable();
+	__spin_lock(lock);
+}
 
+static inline bool spin_trylock(struct spinlock *lock)
+{
 	local_preempt_disable();
+	if (__spin_trylock(lock))
+		return true;
+	local_preempt_enable();
+	return false;
 }
 
 static inline void spin_unlock(struct spinlock *lock)
 {
-	(void) lock;
-
+	__spin_unlock(lock);
 	local_preempt_enable();
 }
 
 static inline bool spin_lock_irqsave(struct spinlock *lock)
 {
-	(void) lock;
+	const bool enabled = local_preempt_save();
 
-	return local_preempt_save();
+	__spin_lock(lock);
+	return enabled;
+}
+
+/* on success *enabled is set like spin_lock_irqsave does */
+static inline bool spin_trylock_irqsave(struct spinlock *lock, bool *enabled)
+{
+	*enabled = local_preempt_save();
+	if (__spin_trylock(lock))
+		return true;
+	local_preempt_restore(*enabled);
+	return false;
 }
 
 static inline void spin_unlock_irqrestore(struct spinlock *lock, bool enabled)
 {
-	(void) lock;
+	__spin_unlock(lock);
+	local_preempt_restore(enabled);
+}
+
+
+/*
+ * MCS lock: every waiter spins on its own node instead of the shared lock
+ * word, so heavily contended locks don't bounce a cache line between all
+ * the waiting CPUs. The node belongs to the lock owner until unlock,
+ * usually it's just on the stack.
+ */
+struct mcs_node {
+	struct mcs_node *next;
+	int locked;
+};
 
+struct mcs_lock {
+	struct mcs_node *tail;
+};
+
+#define MCS_LOCK_INIT(name)	{ 0 }
+#define DEFINE_MCS_LOCK(name)	struct mcs_lock name = MCS_LOCK_INIT(name)
+
+static inline void mcs_lock_init(struct mcs_lock *lock)
+{ lock->tail = 0; }
+
+void __mcs_lock(struct mcs_lock *lock, struct mcs_node *node);
+bool __mcs_trylock(struct mcs_lock *lock, struct mcs_node *node);
+void __mcs_unlock(struct mcs_lock *lock, struct mcs_node *node);
+
+static inline bool mcs_lock_irqsave(struct mcs_lock *lock,
+			struct mcs_node *node)
+{
+	const bool enabled = local_preempt_save();
+
+	__mcs_lock(lock, node);
+	return enabled;
+}
+
+static inline bool mcs_trylock_irqsave(struct mcs_lock *lock,
+			struct mcs_node *node, bool *enabled)
+{
+	*enabled = local_preempt_save();
+	if (__mcs_trylock(lock, node))
+		return true;
+	local_preempt_restore(*enabled);
+	return false;
+}
+
+static inline void mcs_unlock_irqrestore(struct mcs_lock *lock,
+			struct mcs_node *node, bool enabled)
+{
+	__mcs_unlock(lock, node);
 	local_preempt_restore(enabled);
 }
 
@@ -68,6 +186,7 @@ static inline void wait_queue_init(struct wait_queue *wq)
 void wait_queue_notify(struct wait_queue *queue);
 void wait_queue_notify_all(struct wait_queue *queue);
 
+/* notified waiter is off the queue, a waiter that timed out isn't */
 #define WAIT_EVENT(wq, cond) \
 	do { 								\
 		DBG_ASSERT(local_preempt_enabled());			\
@@ -89,6 +208,38 @@ void wait_queue_notify_all(struct wait_queue *queue);
 		spin_unlock(&__WAIT_EVENT_wq->lock);			\
 	} while (0);
 
+/* rc is 0 if cond became true or -ETIMEDOUT after timeout ns */
+#define WAIT_EVENT_TIMEOUT(wq, cond, timeout, rc) \
+	do { 								\
+		DBG_ASSERT(local_preempt_enabled());			\
+		struct wait_queue *__WAIT_EVENT_wq = (wq);		\
+		struct wait_head __WAIT_EVENT_wh;			\
+		struct wakeup_timer __WAIT_EVENT_timer;			\
+									\
+		wakeup_timer_init(&__WAIT_EVENT_timer, (timeout));	\
+		__WAIT_EVENT_wh.thread = current();			\
+		(rc) = 0;						\
+		spin_lock(&__WAIT_EVENT_wq->lock);			\
+									\
+		while (!(cond)) {					\
+			if (wakeup_timer_expired(&__WAIT_EVENT_timer)) {\
+				(rc) = -ETIMEDOUT;			\
+				break;					\
+			}						\
+			__WAIT_EVENT_wh.thread->state = THREAD_BLOCKED;	\
+			list_add_tail(&__WAIT_EVENT_wh.link,		\
+				&__WAIT_EVENT_wq->threads);		\
+			wakeup_timer_arm(&__WAIT_EVENT_timer);		\
+			spin_unlock(&__WAIT_EVENT_wq->lock);		\
+			schedule();					\
+			spin_lock(&__WAIT_EVENT_wq->lock);		\
+			list_del(&__WAIT_EVENT_wh.link);		\
+		}							\
+									\
+		spin_unlock(&__WAIT_EVENT_wq->lock);			\
+		wakeup_timer_cancel(&__WAIT_EVENT_timer);		\
+	} while (0);
+
 
 #define MUTEX_STATE_UNLOCKED 0
 #define MUTEX_STATE_LOCKED   1
@@ -111,6 +262,8 @@ static inline void mutex_init(struct mutex *mutex)
 }
 
 void mutex_lock(struct mutex *mutex);
+/* returns 0 or -ETIMEDOUT if the mutex wasn't taken in timeout ns */
+int mutex_lock_timeout(struct mutex *mutex, unsigned long long timeout);
 void mutex_unlock(struct mutex *mutex);
 
 
@@ -130,6 +283,9 @@ static inline void condition_init(struct condition *condition)
 }
 
 void condition_wait(struct mutex *mutex, struct condition *condition);
+/* returns 0 if notified or -ETIMEDOUT, mutex is locked again either way */
+int condition_wait_timeout(struct mutex *mutex, struct condition *condition,
+			unsigned long long timeout);
 void condition_notify(struct condition *condition);
 void condition_notify_all(struct condition *condition);
 
@@ -0,0 +1,196 @@
+#include "string.h"
+#include "stdio.h"
+#include "lz.h"
+
+#include <stdint.h>
+
+
+#define LZ_HASH_BITS  10
+#define LZ_MIN_MATCH  4
+#define LZ_MAX_NIBBLE 15
+
+/*
+ * Compressed block is a sequence of:
+ *  - token: high nibble - literals length, low nibble - match length - 4,
+ *    15 in a nibble means that more length bytes follow (255 means more);
+ *  - literals;
+ *  - 16 bit little endian match offset and match length bytes (if any),
+ *    the last sequence has literals only.
+ */
+
+static uint32_t lz_read32(const uint8_t *ptr)
+{
+	uint32_t value;
+
+	memcpy(&value, ptr, sizeof(value));
+	return value;
+}
+
+static size_t lz_hash(uint32_t value)
+{ return (value * 2654435761u) >> (32 - LZ_HASH_BITS); }
+
+static uint8_t *lz_put_length(uint8_t *op, const uint8_t *oend, size_t len)
+{
+	for (; len >= 255; len -= 255) {
+		if (op == oend)
+			return 0;
+		*op++ = 255;
+	}
+
+	if (op == oend)
+		return 0;
+	*op++ = (uint8_t)len;
+	return op;
+}
+
+static uint8_t *lz_put_sequence(uint8_t *op, const uint8_t *oend,
+			const uint8_t *lit, size_t litlen,
+			size_t offset, size_t matchlen)
+{
+	const size_t mlen = offset ? matchlen - LZ_MIN_MATCH : 0;
+	uint8_t *token = op++;
+
+	if (token >= oend)
+		return 0;
+
+	*token = (uint8_t)(MINU(litlen, LZ_MAX_NIBBLE) << 4);
+	if (litlen >= LZ_MAX_NIBBLE) {
+		op = lz_put_length(op, oend, litlen - LZ_MAX_NIBBLE);
+		if (!op)
+			return 0;
+	}
+
+	if ((size_t)(oend - op) < litlen)
+		return 0;
+	memcpy(op, lit, litlen);
+	op += litlen;
+
+	if (!offset)
+		return op;
+
+	if (oend - op < 2)
+		return 0;
+	*op++ = (uint8_t)(offset & 0xff);
+	*op++ = (uint8_t)(offset >> 8);
+
+	*token |= (uint8_t)MINU(mlen, LZ_MAX_NIBBLE);
+	if (mlen >= LZ_MAX_NIBBLE)
+		op = lz_put_length(op, oend, mlen - LZ_MAX_NIBBLE);
+	return op;
+}
+
+size_t lz_compress(const void *src, size_t size, void *dst, size_t cap)
+{
+	uint16_t table[1 << LZ_HASH_BITS];
+	const uint8_t *in = src;
+	const uint8_t *iend = in + size;
+	const uint8_t *ip = in;
+	const uint8_t *anchor = in;
+	uint8_t *op = dst;
+	uint8_t *oend = op + cap;
+
+	DBG_ASSERT(size < 0xffff);
+
+	/* positions are stored + 1, so 0 means empty */
+	memset(table, 0, sizeof(table));
+
+	while (ip + LZ_MIN_MATCH <= iend) {
+		const uint32_t seq = lz_read32(ip);
+		const size_t hash = lz_hash(seq);
+		const size_t pos = table[hash];
+
+		table[hash] = (uint16_t)(ip - in + 1);
+		if (!pos || lz_read32(in + pos - 1) != seq) {
+			++ip;
+			continue;
+		}
+
+		const uint8_t *match = in + pos - 1;
+		size_t len = LZ_MIN_MATCH;
+
+		while (ip + len < iend && ip[len] == match[len])
+			++len;
+
+		op = lz_put_sequence(op, oend, anchor, ip - anchor,
+					ip - match, len);
+		if (!op)
+			return 0;
+
+		ip += len;
+		anchor = ip;
+	}
+
+	op = lz_put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+	if (!op)
+		return 0;
+
+	return op - (uint8_t *)dst;
+}
+
+static const uint8_t *lz_get_length(const uint8_t *ip, const uint8_t *iend,
+			size_t *len)
+{
+	uint8_t byte;
+
+	do {
+		if (ip == iend)
+			return 0;
+		byte = *ip++;
+		*len += byte;
+	} while (byte == 255);
+
+	return ip;
+}
+
+size_t lz_decompress(const void *src, size_t size, void *dst, size_t cap)
+{
+	const uint8_t *ip = src;
+	const uint8_t *iend = ip + size;
+	uint8_t *out = dst;
+	uint8_t *op = out;
+	uint8_t *oend = op + cap;
+
+	while (ip < iend) {
+		const uint8_t token = *ip++;
+		size_t litlen = token >> 4;
+
+		if (litlen == LZ_MAX_NIBBLE && !(ip = lz_get_length(ip, iend,
+					&litlen)))
+			return 0;
+
+		if ((size_t)(iend - ip) < litlen || (size_t)(oend - op) < litlen)
+			return 0;
+
+		memcpy(op, ip, litlen);
+		ip += litlen;
+		op += litlen;
+
+		/* the last sequence doesn't have a match */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return 0;
+
+		const size_t offset = ip[0] | ((size_t)ip[1] << 8);
+		size_t len = (token & LZ_MAX_NIBBLE);
+
+		ip += 2;
+		if (len == LZ_MAX_NIBBLE && !(ip = lz_get_length(ip, iend,
+					&len)))
+			return 0;
+		len += LZ_MIN_MATCH;
+
+		if (!offset || offset > (size_t)(op - out) ||
+				(size_t)(oend - op) < len)
+			return 0;
+
+		/* match might overlap with the output, so byte by byte */
+		const uint8_t *match = op - offset;
+
+		while (len--)
+			*op++ = *match++;
+	}
+
+	return op - out;
+}
@@ -0,0 +1,14 @@
+#ifndef __LZ_H__
+#define __LZ_H__
+
+#include <stddef.h>
+
+/*
+ * Simple LZ77 compressor with LZ4 like block format, size of the input
+ * must be less than 64K. Both functions return size of the output or 0
+ * if it doesn't fit in cap bytes (or input is malformed).
+ */
+size_t lz_compress(const void *src, size_t size, void *dst, size_t cap);
+size_t lz_decompress(const void *src, size_t size, void *dst, size_t cap);
+
+#endif /*__LZ_H__*/
@@ -5,12 +5,17 @@
 #include "memory.h"
 #include "paging.h"
 #include "serial.h"
+#include "string.h"
+#include "swap.h"
+#include "smp.h"
 #include "error.h"
 #include "ramfs.h"
+#include "timer.h"
 #include "time.h"
 #include "misc.h"
 #include "exec.h"
 #include "ide.h"
+#include "ksm.h"
 #include "vga.h"
 #include "vfs.h"
 #include "mm.h"
@@ -33,6 +38,193 @@ static void test_threading(void)
 	DBG_INFO("finish threading test");
 }
 
+#define TEST_WAIT_THREADS 16
+
+static int test_sleep_function(void *data)
+{
+	const unsigned long long *ns = data;
+
+	thread_sleep_ns(*ns);
+	return 0;
+}
+
+/* children finish in random order, wait_any must reap each exactly once */
+static void test_wait_any(void)
+{
+	unsigned long long sleep[TEST_WAIT_THREADS];
+	pid_t pids[TEST_WAIT_THREADS];
+	unsigned long long seed = ktime_get_ns() | 1;
+
+	DBG_INFO("start wait_any test");
+	for (int i = 0; i != TEST_WAIT_THREADS; ++i) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		sleep[i] = (seed % 32) * NSEC_PER_MSEC;
+		pids[i] = create_kthread(&test_sleep_function, &sleep[i]);
+		DBG_ASSERT(pids[i] >= 0);
+	}
+
+	for (int reaped = 0; reaped != TEST_WAIT_THREADS; ++reaped) {
+		const pid_t pid = wait_any();
+		int i = 0;
+
+		while (i != TEST_WAIT_THREADS && pids[i] != pid)
+			++i;
+
+		DBG_ASSERT(i != TEST_WAIT_THREADS);
+		DBG_ASSERT(wait(pid) == -ENOENT);
+		pids[i] = -1;
+	}
+	DBG_INFO("finish wait_any test");
+}
+
+#define TEST_TIMEOUT_NS      (20 * NSEC_PER_MSEC)
+#define TEST_LONG_TIMEOUT_NS (10 * NSEC_PER_SEC)
+
+static DEFINE_WAIT_QUEUE(test_wq);
+static DEFINE_MUTEX(test_mutex);
+static DEFINE_CONDITION(test_condition);
+static int test_event;
+static int test_rc;
+
+static unsigned long long test_elapsed(unsigned long long start)
+{ return ktime_get_ns() - start; }
+
+static int test_notify_event(void *dummy)
+{
+	(void) dummy;
+
+	thread_sleep_ns(TEST_TIMEOUT_NS);
+	__atomic_store_n(&test_event, 1, __ATOMIC_RELEASE);
+	wait_queue_notify_all(&test_wq);
+	return 0;
+}
+
+static int test_notify_condition(void *dummy)
+{
+	(void) dummy;
+
+	thread_sleep_ns(TEST_TIMEOUT_NS);
+	mutex_lock(&test_mutex);
+	test_event = 1;
+	condition_notify(&test_condition);
+	mutex_unlock(&test_mutex);
+	return 0;
+}
+
+static int test_lock_mutex(void *data)
+{
+	const unsigned long long *timeout = data;
+
+	test_rc = mutex_lock_timeout(&test_mutex, *timeout);
+	if (!test_rc)
+		mutex_unlock(&test_mutex);
+	return 0;
+}
+
+static void test_timeouts(void)
+{
+	unsigned long long timeout = TEST_TIMEOUT_NS;
+	unsigned long long start = ktime_get_ns();
+	unsigned long long elapsed;
+	pid_t pid;
+	int rc;
+
+	DBG_INFO("start timeout test");
+	thread_sleep_ns(TEST_TIMEOUT_NS);
+	elapsed = test_elapsed(start);
+	DBG_INFO("slept %lu us for %lu us",
+				(unsigned long)(elapsed / 1000),
+				(unsigned long)(TEST_TIMEOUT_NS / 1000));
+	DBG_ASSERT(elapsed >= TEST_TIMEOUT_NS);
+	DBG_ASSERT(elapsed < TEST_LONG_TIMEOUT_NS);
+
+	/* nobody notifies, so all of them time out */
+	test_event = 0;
+	start = ktime_get_ns();
+	WAIT_EVENT_TIMEOUT(&test_wq, test_event, TEST_TIMEOUT_NS, rc);
+	DBG_ASSERT(rc == -ETIMEDOUT);
+	DBG_ASSERT(test_elapsed(start) >= TEST_TIMEOUT_NS);
+
+	mutex_lock(&test_mutex);
+	start = ktime_get_ns();
+	rc = condition_wait_timeout(&test_mutex, &test_condition,
+				TEST_TIMEOUT_NS);
+	DBG_ASSERT(rc == -ETIMEDOUT);
+	DBG_ASSERT(test_elapsed(start) >= TEST_TIMEOUT_NS);
+
+	/* the mutex is ours, so the helper can't get it */
+	pid = create_kthread(&test_lock_mutex, &timeout);
+	DBG_ASSERT(pid >= 0);
+	wait(pid);
+	DBG_ASSERT(test_rc == -ETIMEDOUT);
+
+	/* and now the helper gets it once we unlock it */
+	timeout = TEST_LONG_TIMEOUT_NS;
+	pid = create_kthread(&test_lock_mutex, &timeout);
+	DBG_ASSERT(pid >= 0);
+	thread_sleep_ns(TEST_TIMEOUT_NS);
+	mutex_unlock(&test_mutex);
+	wait(pid);
+	DBG_ASSERT(test_rc == 0);
+
+	/* notified waiters return 0 long before the timeout */
+	pid = create_kthread(&test_notify_event, 0);
+	DBG_ASSERT(pid >= 0);
+	start = ktime_get_ns();
+	WAIT_EVENT_TIMEOUT(&test_wq,
+				__atomic_load_n(&test_event, __ATOMIC_ACQUIRE),
+				TEST_LONG_TIMEOUT_NS, rc);
+	DBG_ASSERT(rc == 0);
+	DBG_ASSERT(test_elapsed(start) < TEST_LONG_TIMEOUT_NS);
+	wait(pid);
+
+	test_event = 0;
+	mutex_lock(&test_mutex);
+	pid = create_kthread(&test_notify_condition, 0);
+	DBG_ASSERT(pid >= 0);
+	rc = 0;
+	while (!test_event && !rc)
+		rc = condition_wait_timeout(&test_mutex, &test_condition,
+					TEST_LONG_TIMEOUT_NS);
+	DBG_ASSERT(rc == 0 && test_event);
+	mutex_unlock(&test_mutex);
+	wait(pid);
+
+	DBG_INFO("finish timeout test");
+}
+
+/* we sleep, so at least our CPU must be idle most of the time */
+static void test_idle_time(void)
+{
+	unsigned long long before[CONFIG_MAX_CPUS];
+	unsigned long long idle = 0;
+	const unsigned long long start = ktime_get_ns();
+
+	DBG_INFO("start idle time test");
+	for (int i = 0; i != cpu_count(); ++i)
+		before[i] = cpu_idle_ns(i);
+
+	thread_sleep_ns(TEST_TIMEOUT_NS);
+
+	const unsigned long long elapsed = test_elapsed(start);
+
+	for (int i = 0; i != cpu_count(); ++i) {
+		const unsigned long long after = cpu_idle_ns(i);
+
+		DBG_ASSERT(after >= before[i]);
+		DBG_ASSERT(after - before[i] <= elapsed + 2 * NSEC_PER_JIFFY);
+		DBG_INFO("cpu %d: idle %lu us of %lu us, %lu ms total", i,
+					(unsigned long)((after - before[i]) / 1000),
+					(unsigned long)(elapsed / 1000),
+					(unsigned long)(after / NSEC_PER_MSEC));
+		idle += after - before[i];
+	}
+	DBG_ASSERT(idle != 0);
+	DBG_INFO("finish idle time test");
+}
+
 static void test_exec(void)
 {
 	static const char test[] = "/initramfs/test";
@@ -75,15 +267,71 @@ static void test_page_fault(void)
 	DBG_INFO("finish page fault test");
 }
 
+static void test_mmap_file(void)
+{
+	static const char name[] = "/initramfs/mmap_test";
+	static char buffer[PAGE_SIZE];
+	const size_t size = 2 * PAGE_SIZE;
+	struct mm *mm = current()->mm;
+	/* both map the same file pages, the compiler can't know that */
+	volatile char *shared = (volatile char *)(4 * PAGE_SIZE);
+	volatile char *private = (volatile char *)(8 * PAGE_SIZE);
+	struct fs_file file;
+
+	DBG_INFO("start file mmap test");
+	DBG_ASSERT(vfs_create(name, &file) == 0);
+	for (size_t i = 0; i != size; i += PAGE_SIZE) {
+		memset(buffer, (int)(i >> PAGE_BITS) + 1, PAGE_SIZE);
+		DBG_ASSERT(vfs_write(&file, buffer, PAGE_SIZE) == PAGE_SIZE);
+	}
+
+	DBG_ASSERT(__mmap_file(mm, (virt_t)shared, (virt_t)shared + size,
+				VMA_PERM_WRITE | VMA_PERM_SHARED, &file, 0) == 0);
+	DBG_ASSERT(__mmap_file(mm, (virt_t)private, (virt_t)private + size,
+				VMA_PERM_WRITE, &file, 0) == 0);
+
+	const unsigned long version = file.node->version;
+
+	DBG_ASSERT(shared[0] == 1 && shared[PAGE_SIZE] == 2);
+	DBG_ASSERT(private[0] == 1 && private[PAGE_SIZE] == 2);
+
+	/* private write is copied, shared one goes to the file */
+	private[0] = 'p';
+	shared[PAGE_SIZE] = 's';
+	DBG_ASSERT(shared[0] == 1);
+	DBG_ASSERT(private[PAGE_SIZE] == 's');
+
+	DBG_ASSERT(munmap((virt_t)shared, (virt_t)shared + size) == 0);
+	DBG_ASSERT(munmap((virt_t)private, (virt_t)private + size) == 0);
+	DBG_ASSERT(file.node->version != version);
+
+	DBG_ASSERT(vfs_seek(&file, 0, FSS_SET) == 0);
+	DBG_ASSERT(vfs_read(&file, buffer, PAGE_SIZE) == PAGE_SIZE);
+	DBG_ASSERT(buffer[0] == 1);
+	DBG_ASSERT(vfs_read(&file, buffer, PAGE_SIZE) == PAGE_SIZE);
+	DBG_ASSERT(buffer[0] == 's');
+
+	vfs_release(&file);
+	vfs_unlink(name);
+	DBG_INFO("finish file mmap test");
+}
+
 static int start(void *dummy)
 {
 	(void) dummy;
 
 	setup_ramfs();
 	setup_initramfs();
-	setup_ide(); // we aren't going to use it in near future
+	setup_ide();
+	setup_swap();
+	setup_ksm();
+	setup_smp();
 	test_threading();
+	test_wait_any();
+	test_timeouts();
+	test_idle_time();
 	test_page_fault();
+	test_mmap_file();
 	test_exec();
 
 	DBG_INFO("Jump to userspace!!!");
@@ -92,14 +340,17 @@ static int start(void *dummy)
 
 void main(void)
 {
+	setup_boot_cpu();
 	setup_serial();
 	setup_vga();
 	setup_misc();
 	setup_ints();
 	setup_memory();
+	setup_trampoline();
 	setup_buddy();
 	setup_paging();
 	setup_alloc();
+	setup_timers();
 	setup_time();
 	setup_threading();
 	setup_vfs();
@@ -53,7 +53,7 @@ static void __memory_node_add(enum node_type type, unsigned long begin,
 	const pfn_t pfn = begin >> PAGE_BITS;
 
 	list_init(&node->link);
-	spinlock_init(&node->lock);
+	mcs_lock_init(&node->lock);
 	node->begin_pfn = pfn;
 	node->end_pfn = pfn + pages;
 	node->id = memory_nodes++;
@@ -71,6 +71,7 @@ static void __memory_node_add(enum node_type type, unsigned long begin,
 		page->flags = node->id;
 		page_set_busy(page);
 		list_init(&page->link);
+		page->anon_vma = 0;
 	}
 
 	printf("memory node %ld (%s): pfns %ld-%ld\n",
@@ -272,10 +273,11 @@ static struct page *__alloc_pages_node(int order, struct memory_node *node)
 
 struct page *alloc_pages_node(int order, struct memory_node *node)
 {
-	const bool enabled = spin_lock_irqsave(&node->lock);
+	struct mcs_node mcs;
+	const bool enabled = mcs_lock_irqsave(&node->lock, &mcs);
 	struct page * pages = __alloc_pages_node(order, node);
 
-	spin_unlock_irqrestore(&node->lock, enabled);
+	mcs_unlock_irqrestore(&node->lock, &mcs, enabled);
 
 	return pages;
 }
@@ -343,10 +345,11 @@ void free_pages_node(struct page *pages, int order, struct memory_node *node)
 	if (!pages)
 		return;
 
-	const bool enabled = spin_lock_irqsave(&node->lock);
+	struct mcs_node mcs;
+	const bool enabled = mcs_lock_irqsave(&node->lock, &mcs);
 
 	__free_pages_node(pages, order, node);
-	spin_unlock_irqrestore(&node->lock, enabled);	
+	mcs_unlock_irqrestore(&node->lock, &mcs, enabled);
 }
 
 struct page *__alloc_pages(int order, int type)
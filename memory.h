@@ -75,6 +75,7 @@ static inline void *va(phys_t paddr)
 
 struct memory_node;
 struct kmem_slab;
+struct anon_vma;
 
 struct page {
 	unsigned long flags;
@@ -85,6 +86,9 @@ struct page {
 		unsigned long refcount;
 		int order;
 	} u;
+	unsigned long shared; // page tables: number of extra users
+	struct anon_vma *anon_vma; // user pages: see rmap.h
+	virt_t index;
 };
 
 
@@ -119,7 +123,7 @@ enum node_type {
 struct memory_node {
 	struct list_head link;
 	struct page *mmap;
-	struct spinlock lock;
+	struct mcs_lock lock;
 	pfn_t begin_pfn;
 	pfn_t end_pfn;
 	int id;
@@ -3,40 +3,71 @@
 #include "memory.h"
 #include "string.h"
 #include "error.h"
+#include "swap.h"
+#include "rmap.h"
+#include "vfs.h"
 #include "mm.h"
 
 #include <stdbool.h>
 
 
+/* freeing dead mms can wait for anybody who does real work */
+#define MM_REAPER_NICE 10
+
+static LIST_HEAD(mms);
+static DEFINE_SPINLOCK(mms_lock);
 static struct kmem_cache *mm_cachep;
 static struct kmem_cache *vma_cachep;
 static struct page *zero_page;
 
-static struct page *alloc_page_table(void)
+static struct vma *alloc_vma(void)
 {
-	struct page *page = alloc_pages(0);
+	struct vma *vma = kmem_cache_alloc(vma_cachep);
 
-	if (page)
-		memset(page_addr(page), 0, PAGE_SIZE);
-	return page;
+	if (vma) {
+		memset(vma, 0, sizeof(*vma));
+		list_init(&vma->anon_chain);
+	}
+	return vma;
 }
 
-static void free_page_table(struct page *pt)
+static bool vma_shared_writable(const struct vma *vma)
 {
-	free_pages(pt, 0);
+	const int mask = VMA_PERM_SHARED | VMA_PERM_WRITE;
+
+	return (vma->perm & mask) == mask;
 }
 
-static struct vma *alloc_vma(void)
+/*
+ * Writes through shared writable mappings don't go through vfs_write, so
+ * the version is bumped when such a mapping comes and goes, and nobody
+ * must trust it in between (see mmap_writable).
+ */
+static void vma_set_node(struct vma *vma, struct fs_node *node)
 {
-	struct vma *vma = kmem_cache_alloc(vma_cachep);
+	vma->node = vfs_node_get(node);
+	if (node && vma_shared_writable(vma)) {
+		__atomic_add_fetch(&node->mmap_writable, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&node->version, 1, __ATOMIC_RELEASE);
+	}
+}
 
-	if (vma)
-		memset(vma, 0, sizeof(*vma));
-	return vma;
+static void vma_put_node(struct vma *vma)
+{
+	struct fs_node *node = vma->node;
+
+	if (node && vma_shared_writable(vma)) {
+		__atomic_add_fetch(&node->version, 1, __ATOMIC_RELEASE);
+		__atomic_sub_fetch(&node->mmap_writable, 1, __ATOMIC_RELAXED);
+	}
+	vfs_node_put(node);
+	vma->node = 0;
 }
 
 static void free_vma(struct vma *vma)
 {
+	unlink_anon_vmas(vma);
+	vma_put_node(vma);
 	kmem_cache_free(vma_cachep, vma);
 }
 
@@ -54,12 +85,19 @@ static void free_mm(struct mm *mm)
 	kmem_cache_free(mm_cachep, mm);
 }
 
-static struct page *copy_page(struct page *page)
+/* user pages can be swapped out to make room for a new one */
+static struct page *alloc_user_page(void)
 {
-	if (page->u.refcount == 1)
-		return page;
+	struct page *page = alloc_pages(0);
+
+	if (!page && swap_reclaim(CONFIG_SWAP_RECLAIM_PAGES))
+		page = alloc_pages(0);
+	return page;
+}
 
-	struct page *new = alloc_pages(0);
+static struct page *__copy_page(struct page *page)
+{
+	struct page *new = alloc_user_page();
 
 	if (!new)
 		return 0;
@@ -68,9 +106,17 @@ static struct page *copy_page(struct page *page)
 	void *src = page_addr(page);
 
 	memcpy(dst, src, PAGE_SIZE);
+	new->u.refcount = 0;
 	return new;
 }
 
+static struct page *copy_page(struct page *page)
+{
+	if (page_count(page) == 1)
+		return page;
+	return __copy_page(page);
+}
+
 static struct page *mapped_page(struct mm *mm, virt_t addr)
 {
 	const virt_t from = addr;
@@ -78,9 +124,6 @@ static struct page *mapped_page(struct mm *mm, virt_t addr)
 	struct pt_iter iter;
 
 	for_each_slot_in_range(page_addr(mm->pt), from, to, iter) {
-		DBG_ASSERT(iter.level == 0);
-		DBG_ASSERT(iter.pt[iter.level] != 0);
-
 		if (iter.level != 0)
 			return 0;
 
@@ -100,16 +143,78 @@ static struct page *mapped_page(struct mm *mm, virt_t addr)
 	return 0;
 }
 
+static struct page *alloc_zeroed_page(void)
+{
+	struct page *page = alloc_user_page();
+
+	if (!page)
+		return 0;
+
+	memset(page_addr(page), 0, PAGE_SIZE);
+	page->u.refcount = 0;
+	return page;
+}
+
+/*
+ * Maps not present slots around vaddr (but in the same vma and PML1 table)
+ * with the zero page if zero is set or with fresh zeroed pages otherwise.
+ * vaddr itself must be mapped already. Failure to allocate a page isn't
+ * an error here, we just map less.
+ */
+static void fault_around(struct mm *mm, struct vma *vma, virt_t vaddr,
+			bool zero, unsigned long flags)
+{
+	const virt_t size = (virt_t)CONFIG_FAULT_AROUND_PAGES << PAGE_BITS;
+	const virt_t table = ALIGN_DOWN(vaddr, PML1_SIZE);
+	const virt_t from = MAXU(MAXU(ALIGN_DOWN(vaddr, size), table),
+				vma->begin);
+	const virt_t to = MINU(MINU(ALIGN_DOWN(vaddr, size) + size,
+				table + PML1_SIZE), vma->end);
+
+	pte_t *pml4 = page_addr(mm->pt);
+	struct pt_iter iter;
+	pfn_t mapped = 0;
+
+	for_each_slot_in_range(pml4, from, to, iter) {
+		DBG_ASSERT(iter.level == 0);
+
+		const int index = iter.idx[iter.level];
+		pte_t *pt = iter.pt[iter.level];
+
+		if (pte_present(pt[index]) || pte_swap(pt[index]))
+			continue;
+
+		struct page *page = zero ? zero_page : alloc_zeroed_page();
+
+		if (!page)
+			break;
+
+		if (!zero)
+			page_add_anon_rmap(page, vma, iter.addr);
+		get_page(page);
+		pt[index] = page_paddr(page) | flags | PTE_PRESENT;
+		++mapped;
+	}
+
+	if (mapped)
+		pt_get_pages(pml4, vaddr, mapped);
+}
+
 static int anon_page_fault(struct mm *mm, struct vma *vma,
 				virt_t vaddr, int access)
 {
 	if (access == VMA_ACCESS_WRITE && (vma->perm & VMA_PERM_WRITE) == 0)
 		return -EINVAL;
 
+	int rc;
+
 	if (access == VMA_ACCESS_READ) {
-		__mmap_pages(mm, vaddr, &zero_page, 1, PTE_USER);
-		flush_tlb_addr(vaddr);
+		rc = __mmap_pages(mm, vaddr, &zero_page, 1, PTE_USER);
+		if (rc)
+			return rc;
 
+		fault_around(mm, vma, vaddr, true, PTE_USER);
+		flush_tlb_addr(vaddr);
 		return 0;
 	}
 
@@ -121,23 +226,162 @@ static int anon_page_fault(struct mm *mm, struct vma *vma,
 		if (!new)
 			return -ENOMEM;
 
-		__mmap_pages(mm, vaddr, &new, 1, PTE_USER | PTE_WRITE);
-		flush_tlb_addr(vaddr);
+		rc = __mmap_pages(mm, vaddr, &new, 1, PTE_USER | PTE_WRITE);
+		if (rc) {
+			if (new != old)
+				free_pages(new, 0);
+			return rc;
+		}
+
+		/* other threads of the mm might still read the old page */
+		flush_tlb_range(mm, vaddr, vaddr + PAGE_SIZE);
 		put_page(old);
 
 		return 0;
 	}
 
-	struct page *page = alloc_pages(0);
+	struct page *page = alloc_zeroed_page();
 
 	if (!page)
 		return -ENOMEM;
 
-	memset(page_addr(page), 0, PAGE_SIZE);
-	page->u.refcount = 0;
-	__mmap_pages(mm, vaddr, &page, 1, PTE_USER | PTE_WRITE);
+	rc = __mmap_pages(mm, vaddr, &page, 1, PTE_USER | PTE_WRITE);
+	if (rc) {
+		free_pages(page, 0);
+		return rc;
+	}
+
+	fault_around(mm, vma, vaddr, false, PTE_USER | PTE_WRITE);
 	flush_tlb_addr(vaddr);
+	return 0;
+}
+
+/*
+ * Swap-in readahead: pages around vaddr that were swapped out together
+ * are likely to be stored in adjacent disk slots, so we read them all at
+ * once. Returns the number of pages and the first of them in from.
+ */
+static pfn_t swap_readahead(struct mm *mm, struct vma *vma, virt_t vaddr,
+			virt_t *from)
+{
+	const virt_t size = (virt_t)CONFIG_SWAP_CLUSTER_PAGES << PAGE_BITS;
+	const virt_t table = ALIGN_DOWN(vaddr, PML1_SIZE);
+	const virt_t begin = MAXU(MAXU(vaddr - MINU(vaddr, size / 2), table),
+				vma->begin);
+	const virt_t end = MINU(MINU(begin + size, table + PML1_SIZE),
+				vma->end);
+	const pte_t *pte = pt_lookup_pte(page_addr(mm->pt), vaddr);
+	const pfn_t max_before = (vaddr - begin) >> PAGE_BITS;
+	const pfn_t max_after = ((end - vaddr) >> PAGE_BITS) - 1;
+	pfn_t before = 0;
+	pfn_t after = 0;
+
+	while (before != max_before &&
+			swap_adjacent(*(pte - before - 1), *(pte - before)))
+		++before;
+
+	while (after != max_after &&
+			swap_adjacent(*(pte + after), *(pte + after + 1)))
+		++after;
+
+	*from = vaddr - ((virt_t)before << PAGE_BITS);
+	return before + after + 1;
+}
+
+/* pte is a swap entry, so bring the page back from the swap */
+static int swap_page_fault(struct mm *mm, struct vma *vma, virt_t vaddr,
+			int access)
+{
+	const bool writable = (vma->perm & VMA_PERM_WRITE) != 0;
+
+	if (access == VMA_ACCESS_WRITE && !writable)
+		return -EINVAL;
+
+	struct page *pages[CONFIG_SWAP_CLUSTER_PAGES];
+	virt_t from;
+	pfn_t count = swap_readahead(mm, vma, vaddr, &from);
+	pfn_t allocated = 0;
+
+	for (; allocated != count; ++allocated) {
+		pages[allocated] = alloc_user_page();
+		if (!pages[allocated])
+			break;
+		pages[allocated]->u.refcount = 0;
+	}
+
+	/* readahead is optional, so just read the page we need */
+	if (allocated != count) {
+		if (!allocated)
+			return -ENOMEM;
+
+		for (pfn_t i = 1; i != allocated; ++i)
+			free_pages(pages[i], 0);
+		from = vaddr;
+		count = 1;
+	}
+
+	const pte_t *pte = pt_lookup_pte(page_addr(mm->pt), from);
+	int rc = swap_read(*pte, pages, count);
+
+	/* the pages are private, so no reason to copy them on write later */
+	if (!rc)
+		rc = __mmap_pages(mm, from, pages, count,
+				writable ? PTE_USER | PTE_WRITE : PTE_USER);
+
+	if (rc) {
+		for (pfn_t i = 0; i != count; ++i)
+			free_pages(pages[i], 0);
+		return rc;
+	}
+
+	for (pfn_t i = 0; i != count; ++i)
+		flush_tlb_addr(from + ((virt_t)i << PAGE_BITS));
+	return 0;
+}
+
+/*
+ * Common part of file backed vma fault handlers, page is the file page
+ * for vaddr. Shared vmas map the page itself, private vmas map it read
+ * only and copy it on write.
+ */
+int vma_fault_page(struct mm *mm, struct vma *vma, virt_t vaddr, int access,
+			struct page *page)
+{
+	const bool writable = (vma->perm & VMA_PERM_WRITE) != 0;
+	const bool shared = (vma->perm & VMA_PERM_SHARED) != 0;
+
+	if (access == VMA_ACCESS_WRITE && !writable)
+		return -EINVAL;
+
+	struct page *old = mapped_page(mm, vaddr);
+	struct page *new = page;
+	unsigned long flags = PTE_USER;
+
+	if (shared && writable)
+		flags |= PTE_WRITE;
+
+	if (!shared && access == VMA_ACCESS_WRITE) {
+		/* file page always has a reference from the file itself */
+		new = old ? copy_page(old) : __copy_page(page);
+		if (!new)
+			return -ENOMEM;
+		flags |= PTE_WRITE;
+	}
+
+	const int rc = __mmap_pages(mm, vaddr, &new, 1, flags);
+
+	if (rc) {
+		if (new != old && new != page)
+			free_pages(new, 0);
+		return rc;
+	}
 
+	if (old) {
+		flush_tlb_range(mm, vaddr, vaddr + PAGE_SIZE);
+		put_page(old);
+	} else {
+		flush_tlb_addr(vaddr);
+	}
 	return 0;
 }
 
@@ -176,12 +420,76 @@ static int __lookup_vma(struct mm *mm, virt_t begin, virt_t end,
 	return 0;
 }
 
+static int vma_cache_slot(virt_t addr)
+{ return (addr / PML1_SIZE) & (VMA_CACHE_SIZE - 1); }
+
+static struct vma *vma_cache_lookup(struct mm *mm, virt_t addr)
+{
+	struct vma_cache *cache = &mm->vma_cache;
+
+	if (cache->seq != mm->vma_seq) {
+		memset(cache->vma, 0, sizeof(cache->vma));
+		cache->seq = mm->vma_seq;
+		return 0;
+	}
+
+	for (int i = 0; i != VMA_CACHE_SIZE; ++i) {
+		struct vma *vma = cache->vma[i];
+
+		if (vma && vma->begin <= addr && addr < vma->end)
+			return vma;
+	}
+	return 0;
+}
+
+static void vma_cache_update(struct mm *mm, virt_t addr, struct vma *vma)
+{
+	struct vma_cache *cache = &mm->vma_cache;
+
+	if (cache->seq == mm->vma_seq)
+		cache->vma[vma_cache_slot(addr)] = vma;
+}
+
+/* mm layout has changed, so cached vmas might be stale */
+static void vma_cache_invalidate(struct mm *mm)
+{ ++mm->vma_seq; }
+
+/* returns the first vma that ends after addr */
+struct vma *find_vma(struct mm *mm, virt_t addr)
+{
+	struct rb_node *node = mm->vma.root;
+	struct vma *res = 0;
+
+	while (node) {
+		struct vma *vma = TREE_ENTRY(node, struct vma, link);
+
+		if (vma->end > addr) {
+			res = vma;
+			node = node->left;
+		} else {
+			node = node->right;
+		}
+	}
+	return res;
+}
+
 struct vma *lookup_vma(struct mm *mm, virt_t addr)
 {
+	addr &= ~((virt_t)PAGE_MASK);
+
+	struct vma *vma = vma_cache_lookup(mm, addr);
+
+	if (vma)
+		return vma;
+
 	struct vma_iter iter;
 
-	addr &= ~((virt_t)PAGE_MASK);
-	__lookup_vma(mm, addr, addr + 1, &iter);
+	/*
+	 * __lookup_vma won't work with empty regions, so +1.
+	 * Seems like a dirty hack.
+	 */
+	if (__lookup_vma(mm, addr, addr + 1, &iter))
+		vma_cache_update(mm, addr, iter.vma);
 	return iter.vma;
 }
 
@@ -194,16 +502,76 @@ int mm_page_fault(struct thread *thread, virt_t vaddr, int access)
 
 	vaddr &= ~((virt_t)PAGE_MASK);
 
-	struct vma_iter iter;
+	struct vma *vma = lookup_vma(mm, vaddr);
+
+	if (!vma)
+		return -EINVAL;
+
+	pte_t *pml4 = page_addr(mm->pt);
+	int rc = 0;
+
+	mm_pt_lock(mm);
 
 	/*
-	 * __lookup_vma won't work with empty regions, so +1.
-	 * Seems like a dirty hack.
+	 * page table might be shared with another mm after fork, and we
+	 * need a private copy of it before we can decide whether a page
+	 * must be copied or not.
 	 */
-	if (!__lookup_vma(mm, vaddr, vaddr + 1, &iter))
-		return -EINVAL;
+	if (access == VMA_ACCESS_WRITE && (vma->perm & VMA_PERM_WRITE))
+		rc = pt_unshare_pml1(pml4, vaddr);
+
+	if (!rc) {
+		const pte_t *pte = pt_lookup_pte(pml4, vaddr);
+
+		if (pte && pte_swap(*pte))
+			rc = swap_page_fault(mm, vma, vaddr, access);
+		else
+			rc = vma->fault(mm, vma, vaddr, access);
+	}
+
+	mm_pt_unlock(mm);
+	return rc;
+}
+
+static struct vma *vma_entry(struct rb_node *node)
+{ return node ? TREE_ENTRY(node, struct vma, link) : 0; }
+
+static void vma_augment(struct rb_node *node)
+{
+	struct vma *vma = vma_entry(node);
+	struct vma *left = vma_entry(node->left);
+	struct vma *right = vma_entry(node->right);
+	virt_t max_gap = vma->gap;
+
+	if (left)
+		max_gap = MAXU(max_gap, left->max_gap);
+	if (right)
+		max_gap = MAXU(max_gap, right->max_gap);
+	vma->max_gap = max_gap;
+}
+
+static virt_t vma_gap_begin(struct vma *prev)
+{ return prev ? MAXU(prev->end, MMAP_BASE) : MMAP_BASE; }
 
-	return iter.vma->fault(mm, iter.vma, vaddr, access);
+static void vma_update_gap(struct vma *vma)
+{
+	if (!vma)
+		return;
+
+	const virt_t begin = vma_gap_begin(vma_entry(rb_prev(&vma->link)));
+
+	vma->gap = vma->begin > begin ? vma->begin - begin : 0;
+	rb_augment_propagate(&vma->link, &vma_augment);
+}
+
+static void __insert_vma(struct mm *mm, struct vma *vma,
+			struct vma_iter *iter)
+{
+	rb_link(&vma->link, iter->parent, iter->plink);
+	rb_insert_augmented(&vma->link, &mm->vma, &vma_augment);
+	vma_update_gap(vma);
+	vma_update_gap(vma_entry(rb_next(&vma->link)));
+	vma_cache_invalidate(mm);
 }
 
 static void insert_vma(struct mm *mm, struct vma *vma)
@@ -211,11 +579,75 @@ static void insert_vma(struct mm *mm, struct vma *vma)
 	struct vma_iter iter;
 
 	__lookup_vma(mm, vma->begin, vma->end, &iter);
-	rb_link(&vma->link, iter.parent, iter.plink);
-	rb_insert(&vma->link, &mm->vma);	
+	__insert_vma(mm, vma, &iter);
 }
 
-int __mmap(struct mm *mm, virt_t begin, virt_t end, int perm)
+static void erase_vma(struct mm *mm, struct vma *vma)
+{
+	struct vma *next = vma_entry(rb_next(&vma->link));
+
+	rb_erase_augmented(&vma->link, &mm->vma, &vma_augment);
+	vma_update_gap(next);
+	vma_cache_invalidate(mm);
+}
+
+/* leftmost vma in the subtree with a gap of at least size bytes */
+static struct vma *find_gap(struct rb_node *node, virt_t size)
+{
+	if (!node || vma_entry(node)->max_gap < size)
+		return 0;
+
+	while (1) {
+		struct vma *left = vma_entry(node->left);
+		struct vma *vma = vma_entry(node);
+
+		if (left && left->max_gap >= size) {
+			node = node->left;
+			continue;
+		}
+
+		if (vma->gap >= size)
+			return vma;
+
+		DBG_ASSERT(node->right);
+		node = node->right;
+	}
+}
+
+/*
+ * Finds the lowest free range of size bytes aligned to align (a power of
+ * two, not less than PAGE_SIZE), returns 0 if there is no such range. To
+ * keep it O(log n) we look for a gap big enough for any alignment, so
+ * we might skip a suitable gap if it's only barely big enough.
+ */
+virt_t get_unmapped_area(struct mm *mm, size_t size, size_t align)
+{
+	size = ALIGN_CONST(size, PAGE_SIZE);
+	if (align < PAGE_SIZE)
+		align = PAGE_SIZE;
+
+	const virt_t length = size + align - PAGE_SIZE;
+
+	if (!size || length < size)
+		return 0;
+
+	struct vma *vma = find_gap(mm->vma.root, length);
+	virt_t begin;
+
+	if (vma) {
+		begin = vma->begin - vma->gap;
+	} else {
+		/* no gaps between vmas, try the space after the last one */
+		begin = vma_gap_begin(vma_entry(rb_rightmost(mm->vma.root)));
+		if (begin > TASK_SIZE || TASK_SIZE - begin < length)
+			return 0;
+	}
+
+	return ALIGN(begin, align);
+}
+
+static int __mmap_vma(struct mm *mm, virt_t begin, virt_t end, int perm,
+			struct vma **res)
 {
 	struct vma_iter iter;
 
@@ -225,74 +657,149 @@ int __mmap(struct mm *mm, virt_t begin, virt_t end, int perm)
 	if (__lookup_vma(mm, begin, end, &iter))
 		return -EBUSY;
 
-	int rc = pt_populate_range(page_addr(mm->pt), begin, end);
-
-	if (rc)
-		return rc;
-
+	/* page tables are populated on demand in __mmap_pages */
 	struct vma *vma = alloc_vma();
 
-	if (!vma) {
-		pt_release_range(page_addr(mm->pt), begin, end);
+	if (!vma)
 		return -ENOMEM;
-	}
 
 	vma->begin = begin;
 	vma->end = end;
 	vma->perm = perm;
 	vma->mm = mm;
 	vma->fault = &anon_page_fault;
+	__insert_vma(mm, vma, &iter);
 
-	rb_link(&vma->link, iter.parent, iter.plink);
-	rb_insert(&vma->link, &mm->vma);
-
+	if (res)
+		*res = vma;
 	return 0;
 }
 
+int __mmap(struct mm *mm, virt_t begin, virt_t end, int perm)
+{
+	return __mmap_vma(mm, begin, end, perm, 0);
+}
+
+int __mmap_file(struct mm *mm, virt_t begin, virt_t end, int perm,
+			struct fs_file *file, size_t offset)
+{
+	if (offset & PAGE_MASK)
+		return -EINVAL;
+
+	struct vma *vma;
+	int rc = __mmap_vma(mm, begin, end, perm, &vma);
+
+	if (rc)
+		return rc;
+
+	vma_set_node(vma, file->node);
+	vma->pgoff = offset >> PAGE_BITS;
+
+	rc = vfs_mmap(file, vma);
+	if (rc) {
+		/* nothing is mapped yet, so page tables are intact */
+		erase_vma(mm, vma);
+		free_vma(vma);
+	}
+	return rc;
+}
+
 int mmap(virt_t begin, virt_t end, int perm)
 {
 	return __mmap(current()->mm, begin, end, perm);
 }
 
-void __munmap(struct mm *mm, virt_t begin, virt_t end)
+/*
+ * Unmapping the middle of a vma splits it in two, get the upper part
+ * ready before anything is unmapped, so that we fail cleanly.
+ */
+static int munmap_prepare_split(struct mm *mm, virt_t begin, virt_t end,
+			struct vma **res)
+{
+	struct vma *vma = lookup_vma(mm, begin);
+
+	*res = 0;
+	if (!vma || vma->begin >= begin || vma->end <= end)
+		return 0;
+
+	struct vma *high = alloc_vma();
+
+	if (!high)
+		return -ENOMEM;
+
+	if (anon_vma_clone(high, vma)) {
+		free_vma(high);
+		return -ENOMEM;
+	}
+
+	*res = high;
+	return 0;
+}
+
+int __munmap(struct mm *mm, virt_t begin, virt_t end)
 {
 	struct vma_iter iter;
+	struct vma *split;
 
-	__munmap_pages(mm, begin, (end - begin) >> PAGE_BITS);
-	pt_release_range(page_addr(mm->pt), begin, end);
+	mm_pt_lock(mm);
+
+	int rc = munmap_prepare_split(mm, begin, end, &split);
+
+	if (!rc)
+		rc = __munmap_pages(mm, begin, (end - begin) >> PAGE_BITS);
+
+	if (rc) {
+		if (split)
+			free_vma(split);
+		mm_pt_unlock(mm);
+		return rc;
+	}
+
+	flush_tlb_range(mm, begin, end);
+	vma_cache_invalidate(mm);
 
 	while (__lookup_vma(mm, begin, end, &iter)) {
 		struct vma *vma = iter.vma;
 
 		if (vma->begin >= begin) {
 			if (vma->end <= end) {
-				rb_erase(&vma->link, &mm->vma);
+				erase_vma(mm, vma);
 				free_vma(vma);
 			} else {
+				vma->pgoff += (end - vma->begin) >> PAGE_BITS;
 				vma->begin = end;
+				vma_update_gap(vma);
 			}
 		} else {
 			if (vma->end <= end) {
 				vma->end = begin;
+				vma_update_gap(vma_entry(rb_next(&vma->link)));
 			} else {
-				struct vma *high = 0;
+				struct vma *high = split;
 
-				/* we must not fail */
-				while (!high)
-					high = alloc_vma();
-
-				*high = *vma;
+				/* anon_chain is linked in advance already */
+				split = 0;
 				high->begin = end;
+				high->end = vma->end;
+				high->perm = vma->perm;
+				high->mm = mm;
+				high->fault = vma->fault;
+				high->pgoff = vma->pgoff +
+					((end - vma->begin) >> PAGE_BITS);
+				high->anon_vma = vma->anon_vma;
+				vma_set_node(high, vma->node);
 				vma->end = begin;
 				insert_vma(mm, high);
 			}
 		}
 	}
+	mm_pt_unlock(mm);
+	return 0;
 }
 
-void munmap(virt_t begin, virt_t end)
+int munmap(virt_t begin, virt_t end)
 {
-	__munmap(current()->mm, begin, end);
+	return __munmap(current()->mm, begin, end);
 }
 
 struct mm *create_mm(void)
@@ -302,7 +809,7 @@ struct mm *create_mm(void)
 	if (!mm)
 		return 0;
 
-	struct page *pt = alloc_page_table();
+	struct page *pt = alloc_page_table(0);
 
 	if (!pt) {
 		free_mm(mm);
@@ -318,38 +825,84 @@ struct mm *create_mm(void)
 	memcpy((char *)page_addr(pt) + offset,
 		(char *)va(load_pml4()) + offset, PAGE_SIZE - offset);
 	mm->pt = pt;
+	mm->refcount = 1;
+
+	const bool enabled = spin_lock_irqsave(&mms_lock);
+
+	list_add_tail(&mm->link, &mms);
+	spin_unlock_irqrestore(&mms_lock, enabled);
 
 	return mm;
 }
 
-static int copy_vma(struct mm *dst, struct vma *vma)
+/*
+ * Iterates over all live mms: returns the mm after prev (or the first one
+ * if prev is 0) with a reference taken, and drops the reference on prev.
+ */
+struct mm *next_mm(struct mm *prev)
 {
-	if (__mmap(dst, vma->begin, vma->end, vma->perm))
-		return -ENOMEM;
+	const bool enabled = spin_lock_irqsave(&mms_lock);
+	struct list_head *ptr = prev ? prev->link.next : mms.next;
+	struct mm *mm = 0;
 
-	struct mm *old_mm = vma->mm;
-	pte_t *pt = page_addr(old_mm->pt);
-	struct pt_iter iter;
+	for (; ptr != &mms; ptr = ptr->next) {
+		struct mm *next = LIST_ENTRY(ptr, struct mm, link);
 
-	for_each_slot_in_range(pt, vma->begin, vma->end, iter) {
-		DBG_ASSERT(iter.level == 0);
-		DBG_ASSERT(iter.pt[iter.level] != 0);
+		int refcount = __atomic_load_n(&next->refcount,
+					__ATOMIC_RELAXED);
 
-		const int level = iter.level;
-		const int index = iter.idx[level];
-		const pte_t pte = iter.pt[level][index];
+		/* it's dying, but isn't in the reaper queue yet */
+		do {
+			if (!refcount)
+				break;
+		} while (!__atomic_compare_exchange_n(&next->refcount,
+					&refcount, refcount + 1, false,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
 
-		if (!pte_present(pte))
+		if (!refcount)
 			continue;
 
-		const phys_t phys = pte_phys(pte);
-		struct page *page = pfn2page(phys >> PAGE_BITS);
+		mm = next;
+		break;
+	}
+	spin_unlock_irqrestore(&mms_lock, enabled);
 
-		if ((pte & PTE_WRITE) != 0) {
-			iter.pt[level][index] &= ~((pte_t)PTE_WRITE);
-			flush_tlb_addr(iter.addr);
-		}
-		__mmap_pages(dst, iter.addr, &page, 1, PTE_USER);
+	if (prev)
+		put_mm(prev);
+	return mm;
+}
+
+static int copy_vma(struct mm *dst, struct vma *vma)
+{
+	struct vma *new;
+	const int rc = __mmap_vma(dst, vma->begin, vma->end, vma->perm, &new);
+
+	if (rc)
+		return rc;
+
+	new->fault = vma->fault;
+	vma_set_node(new, vma->node);
+	new->pgoff = vma->pgoff;
+
+	/* the child might map the same pages, so it joins our anon_vmas */
+	const int err = anon_vma_clone(new, vma);
+
+	if (err)
+		return err;
+
+	pte_t *dst_pt = page_addr(dst->pt);
+	pte_t *src_pt = page_addr(vma->mm->pt);
+	const virt_t from = ALIGN_DOWN(vma->begin, PML1_SIZE);
+
+	/*
+	 * we don't copy anything here, but share whole PML1 tables instead,
+	 * they will be unshared on the first write to them.
+	 */
+	for (virt_t addr = from; addr < vma->end; addr += PML1_SIZE) {
+		const int rc = pt_share_pml1(dst_pt, src_pt, addr);
+
+		if (rc)
+			return rc;
 	}
 
 	return 0;
@@ -358,43 +911,95 @@ static int copy_vma(struct mm *dst, struct vma *vma)
 int copy_mm(struct mm *dst, struct mm *src)
 {
 	struct rb_node *ptr = rb_leftmost(src->vma.root);
+	int rc = 0;
 
 	while (ptr) {
 		struct vma *vma = TREE_ENTRY(ptr, struct vma, link);
-		const int rc = copy_vma(dst, vma);
 
+		rc = copy_vma(dst, vma);
 		if (rc)
-			return rc;
+			break;
 		ptr = rb_next(ptr);
 	}
 
-	return 0;
+	/* shared tables are write protected now */
+	flush_tlb_range(src, 0, TASK_SIZE);
+
+	return rc;
 }
 
 static void unmap_all_vma(struct mm *mm)
 {
+	pte_t *pt = page_addr(mm->pt);
 	struct rb_node *ptr = rb_leftmost(mm->vma.root);
 
+	/* don't bother unsharing tables that are going away anyway */
 	while (ptr) {
 		struct vma *vma = TREE_ENTRY(ptr, struct vma, link);
+		const virt_t from = ALIGN_DOWN(vma->begin, PML1_SIZE);
 
+		for (virt_t addr = from; addr < vma->end; addr += PML1_SIZE)
+			pt_release_shared_pml1(pt, addr);
 		ptr = rb_next(ptr);
+	}
+
+	ptr = rb_leftmost(mm->vma.root);
+
+	while (ptr) {
+		struct vma *vma = TREE_ENTRY(ptr, struct vma, link);
+
+		ptr = rb_next(ptr);
+		/* can't fail, shared tables are released above */
 		__munmap(mm, vma->begin, vma->end);
 	}
 }
 
-void __mmap_pages(struct mm *mm, virt_t addr, struct page **pages, pfn_t count,
+static int unshare_range(pte_t *pml4, virt_t from, virt_t to)
+{
+	for (virt_t addr = ALIGN_DOWN(from, PML1_SIZE); addr < to;
+				addr += PML1_SIZE) {
+		const int rc = pt_unshare_pml1(pml4, addr);
+
+		if (rc)
+			return rc;
+	}
+	return 0;
+}
+
+int __mmap_pages(struct mm *mm, virt_t addr, struct page **pages, pfn_t count,
 			unsigned long flags)
 {
 	DBG_ASSERT((addr & PAGE_MASK) == 0);
 
 	const virt_t from = addr;
 	const virt_t to = from + ((virt_t)count << PAGE_BITS);
+	pte_t *pml4 = page_addr(mm->pt);
+	int rc = unshare_range(pml4, from, to);
+
+	if (rc)
+		return rc;
+
+	rc = pt_populate_range(pml4, from, to);
+	if (rc)
+		return rc;
+
+	/* pages mapped for the first time get reverse mapping */
+	struct vma *vma = lookup_vma(mm, addr);
+
+	for (pfn_t i = 0; vma && i != count; ++i) {
+		if (page_count(pages[i]))
+			continue;
+
+		rc = anon_vma_prepare(vma);
+		if (rc)
+			return rc;
+		break;
+	}
 
 	struct pt_iter iter;
 	pfn_t i = 0;
 
-	for_each_slot_in_range(page_addr(mm->pt), from, to, iter) {
+	for_each_slot_in_range(pml4, from, to, iter) {
 		DBG_ASSERT(iter.level == 0);
 		DBG_ASSERT(iter.pt[iter.level] != 0);
 
@@ -403,50 +1008,168 @@ void __mmap_pages(struct mm *mm, virt_t addr, struct page **pages, pfn_t count,
 		const int index = iter.idx[iter.level];
 		pte_t *pt = iter.pt[iter.level];
 
+		/*
+		 * replaced mapping already holds a reference to the page
+		 * tables, so drop the one we've just taken for it
+		 */
+		if (pte_present(pt[index]) || pte_swap(pt[index]))
+			pt_put_pages(pml4, iter.addr, 1);
+
+		if (pte_swap(pt[index]))
+			swap_free(pt[index]);
+
+		if (vma && !page_count(page))
+			page_add_anon_rmap(page, vma, iter.addr);
 		get_page(page);
 		pt[index] = paddr | flags | PTE_PRESENT;
 	}
+
+	return 0;
 }
 
-void __munmap_pages(struct mm *mm, virt_t addr, pfn_t count)
+int __munmap_pages(struct mm *mm, virt_t addr, pfn_t count)
 {
 	DBG_ASSERT((addr & PAGE_MASK) == 0);
 
-	const virt_t from = addr;
-	const virt_t to = from + ((virt_t)count << PAGE_BITS);
+	const virt_t to = addr + ((virt_t)count << PAGE_BITS);
+	pte_t *pml4 = page_addr(mm->pt);
+	virt_t from = addr;
 
-	struct pt_iter iter;
+	if (!count)
+		return 0;
 
-	for_each_slot_in_range(page_addr(mm->pt), from, to, iter) {
-		DBG_ASSERT(iter.level == 0);
-		DBG_ASSERT(iter.pt[iter.level] != 0);
+	/* only partially unmapped tables need a copy, get them first */
+	int rc = unshare_range(pml4, addr, addr + 1);
 
-		const int index = iter.idx[iter.level];
-		pte_t *pt = iter.pt[iter.level];
-		const pte_t pte = pt[index];
+	if (!rc)
+		rc = unshare_range(pml4, to - 1, to);
+	if (rc)
+		return rc;
+
+	while (from < to) {
+		const virt_t end = MINU(ALIGN_DOWN(from, PML1_SIZE) + PML1_SIZE,
+					to);
+		const virt_t table = ALIGN_DOWN(from, PML1_SIZE);
+		struct pt_iter iter;
+		pfn_t unmapped = 0;
+
+		if (from == table && end == table + PML1_SIZE &&
+				pt_release_shared_pml1(pml4, table)) {
+			from = end;
+			continue;
+		}
+
+		/* doesn't copy, the table is private or we are its last user */
+		pt_unshare_pml1(pml4, table);
+
+		for_each_slot_in_range(pml4, from, end, iter) {
+			if (iter.level != 0)
+				continue;
+
+			const int index = iter.idx[iter.level];
+			pte_t *pt = iter.pt[iter.level];
+			const pte_t pte = pt[index];
+
+			if (pte_swap(pte)) {
+				pt[index] = 0;
+				swap_free(pte);
+				++unmapped;
+				continue;
+			}
+
+			if (!pte_present(pte))
+				continue;
 
-		pt[index] = 0;
-		if (pte_present(pte)) {
 			const phys_t phys = pte_phys(pte);
 			const pfn_t pfn = phys >> PAGE_BITS;
 			struct page *page = pfn2page(pfn);
 
+			pt[index] = 0;
 			put_page(page);
+			++unmapped;
 		}
+
+		/* tables may go away here, so do it after the iteration */
+		if (unmapped)
+			pt_put_pages(pml4, from, unmapped);
+		from = end;
 	}
+	return 0;
 }
 
 void release_mm(struct mm *mm)
 {
 	unmap_all_vma(mm);
+
+	/* user part is empty at this point, but kernel part isn't */
+	const size_t offset = pml4_i(HIGH_BASE) * sizeof(pte_t);
+
+	memset((char *)page_addr(mm->pt) + offset, 0, PAGE_SIZE - offset);
 	free_page_table(mm->pt);
 	free_mm(mm);
 }
 
+/*
+ * Tearing down an address space walks all the vmas and page tables, so
+ * we don't want exec or wait to pay for it, dead mms are released in a
+ * background thread instead.
+ */
+static LIST_HEAD(dead_mms);
+static DEFINE_WAIT_QUEUE(mm_reaper_wq);
+
+void defer_release_mm(struct mm *mm)
+{
+	bool enabled = spin_lock_irqsave(&mms_lock);
+
+	list_del(&mm->link);
+	spin_unlock_irqrestore(&mms_lock, enabled);
+
+	enabled = spin_lock_irqsave(&mm_reaper_wq.lock);
+	list_add_tail(&mm->link, &dead_mms);
+	spin_unlock_irqrestore(&mm_reaper_wq.lock, enabled);
+	wait_queue_notify(&mm_reaper_wq);
+}
+
+static int mm_reaper(void *data)
+{
+	(void) data;
+
+	set_thread_nice(current(), MM_REAPER_NICE);
+	while (1) {
+		LIST_HEAD(batch);
+
+		WAIT_EVENT(&mm_reaper_wq, !list_empty(&dead_mms));
+
+		const bool enabled = spin_lock_irqsave(&mm_reaper_wq.lock);
+
+		list_splice(&dead_mms, &batch);
+		spin_unlock_irqrestore(&mm_reaper_wq.lock, enabled);
+
+		while (!list_empty(&batch)) {
+			struct mm *mm = LIST_ENTRY(list_first(&batch),
+						struct mm, link);
+
+			list_del(&mm->link);
+			release_mm(mm);
+
+			/* we are not in hurry */
+			if (need_resched())
+				schedule();
+		}
+	}
+	return 0;
+}
+
+void setup_mm_reaper(void)
+{
+	DBG_ASSERT(create_kthread(&mm_reaper, 0) >= 0);
+}
+
 void setup_mm(void)
 {
 	DBG_ASSERT((mm_cachep = KMEM_CACHE(struct mm)) != 0);
 	DBG_ASSERT((vma_cachep = KMEM_CACHE(struct vma)) != 0);
+	setup_rmap();
 	DBG_ASSERT((zero_page = alloc_pages(0)) != 0);
 	memset(page_addr(zero_page), 0, PAGE_SIZE);
 	zero_page->u.refcount = 1;
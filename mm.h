@@ -1,13 +1,16 @@
 #ifndef __MM_H__
 #define __MM_H__
 
+#include "locking.h"
 #include "rbtree.h"
+#include "list.h"
 #include "memory.h"
 #include "paging.h"
 
 
 enum vma_perm {
 	VMA_PERM_WRITE = 1 << 0,
+	VMA_PERM_SHARED = 1 << 1, /* writes go to the file */
 };
 
 enum vma_access {
@@ -16,29 +19,133 @@ enum vma_access {
 };
 
 struct mm;
+struct fs_node;
+struct fs_file;
+
+/* get_unmapped_area doesn't return addresses below that */
+#define MMAP_BASE	0x0000100000000000ul
 
 struct vma {
 	struct rb_node link;
 	virt_t begin;
 	virt_t end;
+	virt_t gap;	/* free space right before the vma */
+	virt_t max_gap;	/* max gap in the subtree */
 	int perm;
 	struct mm *mm;
 	int (*fault)(struct mm *, struct vma *, virt_t, int);
+	struct fs_node *node;	/* backing file, if any */
+	size_t pgoff;		/* file offset of begin in pages */
+	struct anon_vma *anon_vma;	/* for new anonymous pages */
+	struct list_head anon_chain;	/* all anon_vmas, see rmap.h */
+};
+
+#define VMA_CACHE_SIZE	4
+
+/*
+ * recently used vmas, valid only while seq matches mm vma_seq, so
+ * __mmap and __munmap don't need to clear it explicitly.
+ */
+struct vma_cache {
+	unsigned long seq;
+	struct vma *vma[VMA_CACHE_SIZE];
 };
 
 struct mm {
 	struct rb_tree vma;
+	unsigned long vma_seq;
+	struct vma_cache vma_cache;
 	struct page *pt;
 	struct vma *stack;
 	uintptr_t stack_pointer;
 	uintptr_t argv_addr;
 	int argc;
+	int refcount;
+	int pt_busy;		// see mm_pt_lock
+	int cpus;		// number of CPUs the mm is loaded on
+	virt_t swap_cursor;	// where swap_reclaim continues from
+	struct list_head link; // all mms list, reaper queue once dead
 };
 
 
 struct mm *create_mm(void);
 int copy_mm(struct mm * dst, struct mm *src);
 void release_mm(struct mm *mm);
+void defer_release_mm(struct mm *mm);
+struct mm *next_mm(struct mm *prev);
+
+/* mm might be shared with a vfork child, so it is refcounted */
+static inline struct mm *get_mm(struct mm *mm)
+{
+	__atomic_add_fetch(&mm->refcount, 1, __ATOMIC_RELAXED);
+	return mm;
+}
+
+static inline void put_mm(struct mm *mm)
+{
+	if (__atomic_sub_fetch(&mm->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+		defer_release_mm(mm);
+}
+
+static inline bool mm_active(struct mm *mm)
+{ return page_paddr(mm->pt) == load_pml4(); }
+
+/* loads next on this CPU instead of prev, preemption must be disabled */
+static inline void switch_mm(struct mm *prev, struct mm *next)
+{
+	__atomic_sub_fetch(&prev->cpus, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&next->cpus, 1, __ATOMIC_RELAXED);
+	store_pml4(page_paddr(next->pt));
+}
+
+/*
+ * swap_reclaim and ksm change page tables of other mms, so they must not
+ * interfere with page fault handling or munmap in progress. pt_busy counts
+ * page faults and munmaps in progress, or is -1 while a scanner owns the
+ * page tables. Scanners only try: they work with preemption disabled and
+ * just skip a busy mm, so page faults can afford to spin for them.
+ */
+static inline void mm_pt_lock(struct mm *mm)
+{
+	int busy = __atomic_load_n(&mm->pt_busy, __ATOMIC_RELAXED);
+
+	do {
+		while (busy < 0) {
+			cpu_relax();
+			busy = __atomic_load_n(&mm->pt_busy, __ATOMIC_RELAXED);
+		}
+	} while (!__atomic_compare_exchange_n(&mm->pt_busy, &busy, busy + 1,
+				false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+}
+
+static inline void mm_pt_unlock(struct mm *mm)
+{ __atomic_sub_fetch(&mm->pt_busy, 1, __ATOMIC_RELEASE); }
+
+static inline void mm_pt_unlock_scan(struct mm *mm)
+{ __atomic_store_n(&mm->pt_busy, 0, __ATOMIC_RELEASE); }
+
+/*
+ * An mm loaded on another CPU is busy as well: stale TLB entries can be
+ * shot down, but its pages can be written while we compress or compare
+ * them. The scanner must drop the lock before it shoots down TLBs, the
+ * other CPU might spin in mm_pt_lock with interrupts disabled.
+ */
+static inline bool mm_pt_trylock_scan(struct mm *mm)
+{
+	int idle = 0;
+
+	if (!__atomic_compare_exchange_n(&mm->pt_busy, &idle, -1, false,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return false;
+
+	const int cpus = __atomic_load_n(&mm->cpus, __ATOMIC_RELAXED);
+
+	if (cpus <= (mm_active(mm) ? 1 : 0))
+		return true;
+
+	mm_pt_unlock_scan(mm);
+	return false;
+}
 
 struct thread;
 
@@ -46,14 +153,21 @@ int mm_page_fault(struct thread *thread, virt_t vaddr, int access);
 
 /* work with current thread mm */
 int __mmap(struct mm *mm, virt_t begin, virt_t end, int perm);
-void __munmap(struct mm *mm, virt_t begin, virt_t end);
-void __mmap_pages(struct mm *mm, virt_t addr, struct page **pages, pfn_t count,
+int __mmap_file(struct mm *mm, virt_t begin, virt_t end, int perm,
+			struct fs_file *file, size_t offset);
+int vma_fault_page(struct mm *mm, struct vma *vma, virt_t vaddr, int access,
+			struct page *page);
+int __munmap(struct mm *mm, virt_t begin, virt_t end);
+int __mmap_pages(struct mm *mm, virt_t addr, struct page **pages, pfn_t count,
 			unsigned long flags);
 struct vma *lookup_vma(struct mm *mm, virt_t addr);
-void __munmap_pages(struct mm *mm, virt_t addr, pfn_t count);
+struct vma *find_vma(struct mm *mm, virt_t addr);
+virt_t get_unmapped_area(struct mm *mm, size_t size, size_t align);
+int __munmap_pages(struct mm *mm, virt_t addr, pfn_t count);
 int mmap(virt_t begin, virt_t end, int perm);
-void munmap(virt_t begin, virt_t end);
+int munmap(virt_t begin, virt_t end);
 
 void setup_mm(void);
+void setup_mm_reaper(void);
 
 #endif /*__MM_H__*/
@@ -0,0 +1,27 @@
+#ifndef __MSR_H__
+#define __MSR_H__
+
+#include <stdint.h>
+
+#define MSR_APIC_BASE      0x0000001bul
+#define MSR_EFER           0xc0000080ul
+#define MSR_GS_BASE        0xc0000101ul
+#define MSR_KERNEL_GS_BASE 0xc0000102ul
+
+static inline uint64_t rdmsr(uint32_t msr)
+{
+	uint32_t low, high;
+
+	__asm__ volatile ("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+	return ((uint64_t)high << 32) | low;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value)
+{
+	const uint32_t low = value & 0xfffffffful;
+	const uint32_t high = value >> 32;
+
+	__asm__ volatile ("wrmsr" : : "c"(msr), "a"(low), "d"(high));
+}
+
+#endif /*__MSR_H__*/
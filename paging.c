@@ -1,7 +1,10 @@
 #include "paging.h"
+#include "swap.h"
+#include "cpuid.h"
 #include "string.h"
 #include "error.h"
 #include "stdio.h"
+#include "smp.h"
 
 
 static int pt_index(virt_t vaddr, int level)
@@ -112,21 +115,69 @@ bool pt_iter_large(const struct pt_iter *iter)
 	return pte_large(iter->pt[level][index]);
 }
 
-static struct page *alloc_page_table(pte_t flags)
+/*
+ * Page tables are released only when they are empty, i. e. all entries
+ * are already zeroed, so every CPU keeps some of them around and saves
+ * both buddy allocator round trip and memset on the next allocation.
+ */
+static struct page *pt_quicklist_get(void)
 {
-	struct page *page =
-		(flags & PTE_LOW) ? __alloc_pages(0, NT_LOW) : alloc_pages(0);
+	struct page *page = 0;
+	const bool enabled = local_preempt_save();
+	struct pt_quicklist *ql = &this_cpu()->pt_quicklist;
+
+	if (ql->count) {
+		page = LIST_ENTRY(list_first(&ql->pages), struct page, link);
+		list_del(&page->link);
+		--ql->count;
+	}
+	local_preempt_restore(enabled);
+
+	return page;
+}
+
+static bool pt_quicklist_put(struct page *page)
+{
+	bool cached = false;
+	const bool enabled = local_preempt_save();
+	struct pt_quicklist *ql = &this_cpu()->pt_quicklist;
+
+	if (ql->count < CONFIG_PT_QUICKLIST_SIZE) {
+		list_add(&page->link, &ql->pages);
+		++ql->count;
+		cached = true;
+	}
+	local_preempt_restore(enabled);
+
+	return cached;
+}
+
+struct page *alloc_page_table(pte_t flags)
+{
+	struct page *page = 0;
+
+	if ((flags & PTE_LOW) == 0)
+		page = pt_quicklist_get();
+
+	if (page)
+		return page;
+
+	page = (flags & PTE_LOW) ? __alloc_pages(0, NT_LOW) : alloc_pages(0);
 
 	if (page) {
 		memset(va(page_paddr(page)), 0, PAGE_SIZE);
 		page->u.refcount = 0;
+		page->shared = 0;
 	}
 	return page;
 }
 
-static void free_page_table(struct page *page)
+void free_page_table(struct page *page)
 {
-	free_pages(page, 0);
+	page->u.refcount = 0;
+	page->shared = 0;
+	if (!pt_quicklist_put(page))
+		free_pages(page, 0);
 }
 
 static void pt_release_pml2(pte_t *pml2, virt_t from, virt_t to)
@@ -195,7 +246,7 @@ static void pt_release_pml3(pte_t *pml3, virt_t from, virt_t to)
 					to - vaddr);
 		const pfn_t pages = bytes >> PAGE_BITS;
 
-		if (pte_present(pte)) {
+		if (pte_present(pte) && !pte_large(pte)) {
 			const phys_t paddr = pte_phys(pte);
 			const pfn_t pfn = paddr >> PAGE_BITS;
 			struct page *pt = pfn2page(pfn);
@@ -223,6 +274,12 @@ static int pt_populate_pml3(pte_t *pml3, virt_t from, virt_t to, pte_t flags)
 			MINU(PML2_SIZE - (vaddr & PML2_MASK), to - vaddr);
 		const pfn_t pages = bytes >> PAGE_BITS;
 
+		if (pte_large(pml3[i]) ||
+				(!pte_present(pml3[i]) && pte_huge(flags))) {
+			vaddr += bytes;
+			continue;
+		}
+
 		if (!pte_present(pml3[i])) {
 			pt = alloc_page_table(flags);
 
@@ -232,7 +289,7 @@ static int pt_populate_pml3(pte_t *pml3, virt_t from, virt_t to, pte_t flags)
 			}
 
 			paddr = page_paddr(pt);
-			pml3[i] = paddr | (flags & ~PTE_LARGE);
+			pml3[i] = paddr | (flags & ~(PTE_LARGE | PTE_HUGE));
 		} else {
 			const pte_t pte = pml3[i];
 
@@ -308,7 +365,7 @@ static int pt_populate_pml4(pte_t *pml4, virt_t from, virt_t to, pte_t flags)
 			}
 
 			paddr = page_paddr(pt);
-			pml4[i] = paddr | (flags & ~PTE_LARGE);
+			pml4[i] = paddr | (flags & ~(PTE_LARGE | PTE_HUGE));
 		} else {
 			const pte_t pte = pml4[i];
 
@@ -361,10 +418,279 @@ void __pt_release_range(pte_t *pml4, virt_t from, virt_t to)
 	pt_release_pml4(pml4, from, to);
 }
 
-static int map_range_large(pte_t *pml4, virt_t from, virt_t to, phys_t phys,
+/*
+ * Looks up entries referencing page tables on the path to addr: entry[0]
+ * is the PML2 entry, entry[1] is the PML3 entry and entry[2] is the PML4
+ * entry. Returns false if there is no PML2 table for addr.
+ */
+static bool pt_lookup_tables(pte_t *pml4, virt_t addr, pte_t **entry)
+{
+	pte_t *pt = pml4;
+
+	for (int level = PT_MAX_LEVEL + 1; level != 1; --level) {
+		pte_t *pte = &pt[pt_index(addr, level)];
+
+		entry[level - 2] = pte;
+		if (level == 2)
+			break;
+
+		if (!pte_present(*pte) || pte_large(*pte))
+			return false;
+		pt = va(pte_phys(*pte));
+	}
+	return true;
+}
+
+static struct page *pt_entry_table(pte_t pte)
+{ return pfn2page(pte_phys(pte) >> PAGE_BITS); }
+
+pte_t *pt_lookup_pte(pte_t *pml4, virt_t addr)
+{
+	pte_t *entry[PT_MAX_LEVEL];
+
+	if (!pt_lookup_tables(pml4, linear(addr), entry))
+		return 0;
+
+	if (!pte_present(*entry[0]) || pte_large(*entry[0]))
+		return 0;
+
+	pte_t *pt = va(pte_phys(*entry[0]));
+
+	return &pt[pml1_i(addr)];
+}
+
+static void __pt_put_tables(pte_t **entry, int from, pfn_t count)
+{
+	for (int i = from; i != PT_MAX_LEVEL; ++i) {
+		struct page *pt = pt_entry_table(*entry[i]);
+
+		DBG_ASSERT(pt->u.refcount >= count);
+		pt->u.refcount -= count;
+
+		if (pt->u.refcount == 0) {
+			*entry[i] = 0;
+			free_page_table(pt);
+		}
+	}
+}
+
+void pt_put_pages(pte_t *pml4, virt_t addr, pfn_t count)
+{
+	pte_t *entry[PT_MAX_LEVEL];
+
+	DBG_ASSERT(pt_lookup_tables(pml4, linear(addr), entry));
+	DBG_ASSERT(pte_present(*entry[0]) && !pte_large(*entry[0]));
+	DBG_ASSERT(pt_entry_table(*entry[0])->shared == 0);
+
+	__pt_put_tables(entry, 0, count);
+}
+
+void pt_get_pages(pte_t *pml4, virt_t addr, pfn_t count)
+{
+	pte_t *entry[PT_MAX_LEVEL];
+
+	DBG_ASSERT(pt_lookup_tables(pml4, linear(addr), entry));
+	DBG_ASSERT(pte_present(*entry[0]) && !pte_large(*entry[0]));
+	DBG_ASSERT(pt_entry_table(*entry[0])->shared == 0);
+
+	for (int i = 0; i != PT_MAX_LEVEL; ++i)
+		pt_entry_table(*entry[i])->u.refcount += count;
+}
+
+/*
+ * Makes sure that PML3 and PML2 tables for addr exist and takes count
+ * references on them, returns the PML2 entry for addr.
+ */
+static pte_t *pt_get_pml2_entry(pte_t *pml4, virt_t addr, pfn_t count)
+{
+	pte_t *entry[PT_MAX_LEVEL];
+	pte_t *pt = pml4;
+
+	for (int level = PT_MAX_LEVEL + 1; level != 2; --level) {
+		pte_t *pte = &pt[pt_index(addr, level)];
+
+		if (!pte_present(*pte)) {
+			struct page *page = alloc_page_table(0);
+
+			if (!page) {
+				/* release tables we might have allocated */
+				if (level == PT_MAX_LEVEL)
+					__pt_put_tables(entry, 2, 0);
+				return 0;
+			}
+			*pte = page_paddr(page) | PTE_PT_FLAGS | PTE_PRESENT;
+		}
+		entry[level - 2] = pte;
+		pt = va(pte_phys(*pte));
+	}
+
+	for (int i = 1; i != PT_MAX_LEVEL; ++i)
+		pt_entry_table(*entry[i])->u.refcount += count;
+
+	return &pt[pml2_i(addr)];
+}
+
+static bool pt_shared_entry(pte_t pte)
+{ return pte_present(pte) && !pte_large(pte) && !pte_write(pte); }
+
+int pt_share_pml1(pte_t *dst, pte_t *src, virt_t addr)
+{
+	pte_t *sentry[PT_MAX_LEVEL];
+	pte_t *dentry[PT_MAX_LEVEL];
+
+	addr = ALIGN_DOWN(linear(addr), PML1_SIZE);
+
+	if (!pt_lookup_tables(src, addr, sentry))
+		return 0;
+
+	const pte_t pte = *sentry[0];
+
+	if (!pte_present(pte) || pte_large(pte))
+		return 0;
+
+	/* the table might be shared already through another vma */
+	if (pt_lookup_tables(dst, addr, dentry) && pte_present(*dentry[0]))
+		return 0;
+
+	struct page *pt = pt_entry_table(pte);
+	pte_t *entry = pt_get_pml2_entry(dst, addr, pt->u.refcount);
+
+	if (!entry)
+		return -ENOMEM;
+
+	*sentry[0] = pte & ~PTE_WRITE;
+	*entry = pte & ~PTE_WRITE;
+	__atomic_add_fetch(&pt->shared, 1, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+/*
+ * Users of a shared table lock only their own mm, so several of them might
+ * unshare or release it at once. The table doesn't change while it's
+ * shared, whoever takes shared from 1 to 0 leaves and the other one is the
+ * last user, it keeps the table. Returns false if we are the last user.
+ */
+static bool pt_leave_shared(struct page *pt)
+{
+	unsigned long shared = __atomic_load_n(&pt->shared, __ATOMIC_ACQUIRE);
+
+	while (shared) {
+		if (__atomic_compare_exchange_n(&pt->shared, &shared,
+					shared - 1, false, __ATOMIC_ACQ_REL,
+					__ATOMIC_ACQUIRE))
+			return true;
+	}
+	return false;
+}
+
+/* drops references a copy of a shared table took, see pt_unshare_pml1 */
+static void pt_free_copy(struct page *page)
+{
+	pte_t *pt = page_addr(page);
+
+	for (size_t i = 0; i != PT_SIZE; ++i) {
+		if (pte_swap(pt[i]))
+			swap_free(pt[i]);
+		else if (pte_present(pt[i]))
+			put_page(pfn2page(pte_phys(pt[i]) >> PAGE_BITS));
+		pt[i] = 0;
+	}
+	free_page_table(page);
+}
+
+int pt_unshare_pml1(pte_t *pml4, virt_t addr)
+{
+	pte_t *entry[PT_MAX_LEVEL];
+
+	if (!pt_lookup_tables(pml4, linear(addr), entry))
+		return 0;
+
+	const pte_t pte = *entry[0];
+
+	if (!pt_shared_entry(pte))
+		return 0;
+
+	struct page *pt = pt_entry_table(pte);
+
+	/* we are the last user of the table */
+	if (__atomic_load_n(&pt->shared, __ATOMIC_ACQUIRE) == 0) {
+		*entry[0] = pte | PTE_WRITE;
+		return 0;
+	}
+
+	struct page *page = alloc_page_table(0);
+
+	if (!page)
+		return -ENOMEM;
+
+	pte_t *old = va(pte_phys(pte));
+	pte_t *new = page_addr(page);
+
+	/*
+	 * pages are shared between two tables now, so write protect them
+	 * in both of them to make page fault handler copy them on write
+	 */
+	for (size_t i = 0; i != PT_SIZE; ++i) {
+		if (pte_swap(old[i])) {
+			new[i] = old[i];
+			swap_dup(old[i]);
+			continue;
+		}
+
+		if (!pte_present(old[i]))
+			continue;
+
+		old[i] &= ~PTE_WRITE;
+		new[i] = old[i];
+		get_page(pfn2page(pte_phys(old[i]) >> PAGE_BITS));
+	}
+
+	/* the last user changes the table once we've left */
+	page->u.refcount = pt->u.refcount;
+
+	/* the other user left while we were copying, the table is ours */
+	if (!pt_leave_shared(pt)) {
+		pt_free_copy(page);
+		*entry[0] = pte | PTE_WRITE;
+		return 0;
+	}
+
+	*entry[0] = page_paddr(page) | (pte & PTE_FLAGS) | PTE_WRITE;
+
+	return 0;
+}
+
+bool pt_release_shared_pml1(pte_t *pml4, virt_t addr)
+{
+	pte_t *entry[PT_MAX_LEVEL];
+
+	if (!pt_lookup_tables(pml4, linear(addr), entry))
+		return false;
+
+	const pte_t pte = *entry[0];
+
+	if (!pt_shared_entry(pte))
+		return false;
+
+	struct page *pt = pt_entry_table(pte);
+	const pfn_t count = pt->u.refcount;
+
+	if (!pt_leave_shared(pt))
+		return false;
+
+	*entry[0] = 0;
+	__pt_put_tables(entry, 1, count);
+
+	return true;
+}
+
+static bool gbpages;
+
+static int __map_range(pte_t *pml4, virt_t from, virt_t to, phys_t phys,
 			pte_t flags)
 {
-	const int rc = __pt_populate_range(pml4, from, to, flags | PTE_LARGE);
+	const int rc = __pt_populate_range(pml4, from, to, flags);
 	const pte_t page_flags = PTE_WRITE | PTE_PRESENT;
 
 	if (rc)
@@ -377,10 +703,13 @@ static int map_range_large(pte_t *pml4, virt_t from, virt_t to, phys_t phys,
 		const int index = iter.idx[level];
 		pte_t *pt = iter.pt[level];
 
-		DBG_ASSERT(level == 1 || level == 0);
+		DBG_ASSERT(level <= 2);
 		DBG_ASSERT(!pte_present(pt[index]));
 
-		if (level == 1) {
+		if (level == 2) {
+			pt[index] = phys | page_flags | PTE_LARGE;
+			phys += PML2_SIZE;
+		} else if (level == 1) {
 			pt[index] = phys | page_flags | PTE_LARGE;
 			phys += PML1_SIZE;
 		} else {
@@ -392,6 +721,39 @@ static int map_range_large(pte_t *pml4, virt_t from, virt_t to, phys_t phys,
 	return 0;
 }
 
+/*
+ * Maps [from; to) to the physical memory starting at phys using 1GB pages
+ * where the cpu supports them and both addresses are suitably aligned,
+ * and 2MB pages for the rest of the range.
+ */
+static int map_range_large(pte_t *pml4, virt_t from, virt_t to, phys_t phys,
+			pte_t flags)
+{
+	const virt_t huge_from = ALIGN(from, PML2_SIZE);
+	const virt_t huge_to = ALIGN_DOWN(to, PML2_SIZE);
+	int rc;
+
+	if (!gbpages || ((from - phys) & PML2_MASK) || huge_from >= huge_to)
+		return __map_range(pml4, from, to, phys, flags | PTE_LARGE);
+
+	if (from != huge_from) {
+		rc = __map_range(pml4, from, huge_from, phys,
+					flags | PTE_LARGE);
+		if (rc)
+			return rc;
+	}
+
+	rc = __map_range(pml4, huge_from, huge_to, phys + (huge_from - from),
+				flags | PTE_HUGE);
+	if (rc)
+		return rc;
+
+	if (huge_to != to)
+		return __map_range(pml4, huge_to, to, phys + (huge_to - from),
+					flags | PTE_LARGE);
+	return 0;
+}
+
 #define KMAP_ORDERS 16
 
 struct kmap_range {
@@ -400,6 +762,8 @@ struct kmap_range {
 };
 
 
+/* kmap is used on any CPU, kmap_lock protects free_kmap_ranges */
+static DEFINE_SPINLOCK(kmap_lock);
 static struct kmap_range all_kmap_ranges[KMAP_PAGES];
 static struct list_head free_kmap_ranges[KMAP_ORDERS];
 
@@ -435,7 +799,7 @@ static struct kmap_range *kmap_find_free_range(int order, pfn_t pages)
 	return 0;
 }
 
-static void kmap_free_range(struct kmap_range *range, pfn_t pages)
+static void __kmap_free_range(struct kmap_range *range, pfn_t pages)
 {
 	if (range > all_kmap_ranges) {
 		struct kmap_range *prev = range - (range - 1)->pages;
@@ -460,7 +824,7 @@ static void kmap_free_range(struct kmap_range *range, pfn_t pages)
 	list_add(&range->link, free_kmap_ranges + kmap_order(pages));
 }
 
-static struct kmap_range *kmap_alloc_range(pfn_t pages)
+static struct kmap_range *__kmap_alloc_range(pfn_t pages)
 {
 	for (int order = kmap_order(pages); order < KMAP_ORDERS; ++order) {
 		struct kmap_range *range = kmap_find_free_range(order, pages);
@@ -475,13 +839,30 @@ static struct kmap_range *kmap_alloc_range(pfn_t pages)
 		(range + pages - 1)->pages = range->pages = pages;
 
 		if (range_pages > pages)
-			kmap_free_range(range + pages, range_pages - pages);
+			__kmap_free_range(range + pages, range_pages - pages);
 
 		return range;
 	}
 	return 0;
 }
 
+static struct kmap_range *kmap_alloc_range(pfn_t pages)
+{
+	const bool enabled = spin_lock_irqsave(&kmap_lock);
+	struct kmap_range *range = __kmap_alloc_range(pages);
+
+	spin_unlock_irqrestore(&kmap_lock, enabled);
+	return range;
+}
+
+static void kmap_free_range(struct kmap_range *range, pfn_t pages)
+{
+	const bool enabled = spin_lock_irqsave(&kmap_lock);
+
+	__kmap_free_range(range, pages);
+	spin_unlock_irqrestore(&kmap_lock, enabled);
+}
+
 void *kmap(struct page **pages, size_t count)
 {
 	struct kmap_range *range = kmap_alloc_range(count);
@@ -515,7 +896,6 @@ void kunmap(void *vaddr)
 	const virt_t from = (virt_t)vaddr;
 	const virt_t to = from + (count << PAGE_BITS);
 	pte_t *pt = va(load_pml4());
-	virt_t virt = from;
 	struct pt_iter iter;
 
 	for_each_slot_in_range(pt, from, to, iter) {
@@ -523,10 +903,45 @@ void kunmap(void *vaddr)
 		const int idx = iter.idx[level];
 
 		iter.pt[level][idx] = 0;
-		flush_tlb_addr(virt);
-		virt += PAGE_SIZE;
 	}
-	kmap_free_range(range, range->pages);
+
+	/* no CPU may keep the old mapping once the range is reused */
+	flush_tlb_range(0, from, to);
+	kmap_free_range(range, count);
+}
+
+void *ioremap(phys_t addr, size_t size)
+{
+	const phys_t begin = ALIGN_DOWN(addr, PAGE_SIZE);
+	const phys_t end = ALIGN(addr + size, PAGE_SIZE);
+	const pfn_t count = (end - begin) >> PAGE_BITS;
+	struct kmap_range *range = kmap_alloc_range(count);
+
+	if (!range)
+		return 0;
+
+	const virt_t from = kmap2virt(range);
+	const virt_t to = from + (count << PAGE_BITS);
+	pte_t *pt = va(load_pml4());
+	phys_t paddr = begin;
+	struct pt_iter iter;
+
+	for_each_slot_in_range(pt, from, to, iter) {
+		const int level = iter.level;
+		const int idx = iter.idx[level];
+
+		iter.pt[level][idx] = paddr | PTE_PCD | PTE_PWT | PTE_WRITE |
+					PTE_PRESENT;
+		flush_tlb_addr(iter.addr);
+		paddr += PAGE_SIZE;
+	}
+
+	return (char *)from + (addr - begin);
+}
+
+void iounmap(void *ptr)
+{
+	kunmap((void *)ALIGN_DOWN((virt_t)ptr, PAGE_SIZE));
 }
 
 static int setup_kmap_mapping(pte_t *pml4)
@@ -534,7 +949,7 @@ static int setup_kmap_mapping(pte_t *pml4)
 	for (int i = 0; i != KMAP_ORDERS; ++i)
 		list_init(&free_kmap_ranges[i]);
 
-	kmap_free_range(all_kmap_ranges, KMAP_PAGES);
+	__kmap_free_range(all_kmap_ranges, KMAP_PAGES);
 
 	return __pt_populate_range(pml4, KMAP_BASE, KMAP_BASE + KMAP_SIZE,
 				PTE_WRITE | PTE_LOW);
@@ -558,6 +973,9 @@ static int setup_kernel_mapping(pte_t *pml4)
 
 void setup_paging(void)
 {
+	gbpages = cpu_has_pdpe1gb();
+	DBG_INFO("1GB pages %ssupported", gbpages ? "" : "not ");
+
 	struct page *page = alloc_page_table(PTE_LOW);
 
 	DBG_ASSERT(page != 0);
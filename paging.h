@@ -13,12 +13,19 @@ typedef uint64_t pte_t;
 #define PTE_PRESENT  ((pte_t)BIT_CONST(0))
 #define PTE_WRITE    ((pte_t)BIT_CONST(1))
 #define PTE_USER     ((pte_t)BIT_CONST(2))
+#define PTE_PWT      ((pte_t)BIT_CONST(3))
+#define PTE_PCD      ((pte_t)BIT_CONST(4))
+#define PTE_ACCESSED ((pte_t)BIT_CONST(5))
 #define PTE_LARGE    ((pte_t)BIT_CONST(7))
 #define PTE_LOW      ((pte_t)BIT_CONST(9))
-#define PTE_FLAGS    (PTE_PRESENT | PTE_WRITE | PTE_USER | PTE_LARGE | PTE_LOW)
+#define PTE_HUGE     ((pte_t)BIT_CONST(10))
+#define PTE_SWAP     ((pte_t)BIT_CONST(11)) /* not present, see swap.h */
+#define PTE_FLAGS    (PTE_PRESENT | PTE_WRITE | PTE_USER | PTE_LARGE | \
+			PTE_LOW | PTE_HUGE)
 
 #define PTE_PT_FLAGS       (PTE_WRITE | PTE_USER)
 #define PTE_LARGE_PT_FLAGS (PTE_PT_FLAGS | PTE_LARGE)
+#define PTE_HUGE_PT_FLAGS  (PTE_PT_FLAGS | PTE_HUGE)
 
 #define PT_SIZE     (PAGE_SIZE / sizeof(pte_t))
 #define PML1_PAGES  ((pfn_t)PT_SIZE)
@@ -37,6 +44,9 @@ typedef uint64_t pte_t;
 static inline bool pte_present(pte_t pte)
 { return (pte & PTE_PRESENT) != 0; }
 
+static inline bool pte_swap(pte_t pte)
+{ return !pte_present(pte) && (pte & PTE_SWAP) != 0; }
+
 static inline bool pte_write(pte_t pte)
 { return (pte & PTE_WRITE) != 0; }
 
@@ -46,6 +56,9 @@ static inline bool pte_user(pte_t pte)
 static inline bool pte_large(pte_t pte)
 { return (pte & PTE_LARGE) != 0; }
 
+static inline bool pte_huge(pte_t pte)
+{ return (pte & PTE_HUGE) != 0; }
+
 static inline phys_t pte_phys(pte_t pte)
 { return (phys_t)(pte & (pte_t)BITS_CONST(47, 12)); }
 
@@ -93,16 +106,64 @@ static inline int pt_populate_range(pte_t *pml4, virt_t from, virt_t to)
 static inline int pt_populate_range_large(pte_t *pml4, virt_t from, virt_t to)
 { return __pt_populate_range(pml4, from, to, PTE_LARGE_PT_FLAGS); }
 
+static inline int pt_populate_range_huge(pte_t *pml4, virt_t from, virt_t to)
+{ return __pt_populate_range(pml4, from, to, PTE_HUGE_PT_FLAGS); }
+
 static inline void pt_release_range(pte_t *pml4, virt_t from, virt_t to)
 { __pt_release_range(pml4, from, to); }
 
+/* returns PML1 entry for addr or 0 if there is no PML1 table for it */
+pte_t *pt_lookup_pte(pte_t *pml4, virt_t addr);
+
+/*
+ * Drops count references from every page table on the path to addr and
+ * releases tables that became empty, all count pages must belong to the
+ * same PML1 table.
+ */
+void pt_put_pages(pte_t *pml4, virt_t addr, pfn_t count);
+
+/*
+ * Takes count references on every page table on the path to addr, tables
+ * must exist already (see pt_populate_range).
+ */
+void pt_get_pages(pte_t *pml4, virt_t addr, pfn_t count);
+
+/*
+ * PML1 tables can be shared between address spaces, shared tables are
+ * write protected on PML2 level and must be unshared before modification.
+ *  - pt_share_pml1 makes dst use the same PML1 table for addr as src;
+ *  - pt_unshare_pml1 gives pml4 a private copy of the PML1 table for addr,
+ *    all the pages mapped by the table become copy-on-write;
+ *  - pt_release_shared_pml1 drops the PML1 table for addr from pml4 if the
+ *    table is still used by someone else, and returns true in that case.
+ */
+int pt_share_pml1(pte_t *dst, pte_t *src, virt_t addr);
+int pt_unshare_pml1(pte_t *pml4, virt_t addr);
+bool pt_release_shared_pml1(pte_t *pml4, virt_t addr);
+
+/* page tables must be empty (all entries zeroed) when released */
+struct page *alloc_page_table(pte_t flags);
+void free_page_table(struct page *page);
+
+/*
+ * Pages are shared between mms (zero page, COW and merged pages, file
+ * pages) and those mms fault on different CPUs, so the count is atomic.
+ */
+static inline unsigned long page_count(const struct page *page)
+{ return __atomic_load_n(&page->u.refcount, __ATOMIC_ACQUIRE); }
+
 static inline void get_page(struct page *page)
-{ ++page->u.refcount; }
+{ __atomic_add_fetch(&page->u.refcount, 1, __ATOMIC_RELAXED); }
+
+void page_remove_rmap(struct page *page);
 
 static inline void put_page(struct page *page)
 {
-	if (--page->u.refcount == 0)
-		free_pages(page, 0);
+	if (__atomic_sub_fetch(&page->u.refcount, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	page_remove_rmap(page);
+	free_pages(page, 0);
 }
 
 static inline virt_t canonical(virt_t addr)
@@ -131,9 +192,29 @@ static inline phys_t load_pml4(void)
 static inline void flush_tlb_addr(virt_t vaddr)
 { __asm__ volatile ("invlpg (%0)" : : "r"(vaddr) : "memory"); }
 
+static inline void flush_tlb(void)
+{ store_pml4(load_pml4()); }
+
+struct mm;
+
+/*
+ * Flushes [begin, end) of mm on every CPU the mm is loaded on, mm 0 means
+ * any address space on every CPU (kernel mappings are shared by all page
+ * tables). Other CPUs might spin on a spinlock with interrupts disabled,
+ * so it must not be called holding one.
+ */
+void flush_tlb_range(struct mm *mm, virt_t begin, virt_t end);
+
+static inline void flush_tlb_all(void)
+{ flush_tlb_range(0, 0, TASK_SIZE); }
+
 void *kmap(struct page **pages, size_t count);
 void kunmap(void *ptr);
 
+/* maps physical range that has no struct page (like MMIO) uncached */
+void *ioremap(phys_t addr, size_t size);
+void iounmap(void *ptr);
+
 
 void setup_paging(void);
 
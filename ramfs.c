@@ -8,6 +8,7 @@
 #include "string.h"
 #include "error.h"
 #include "ramfs.h"
+#include "mm.h"
 
 
 static struct kmem_cache *ramfs_node_cache;
@@ -247,13 +248,15 @@ static struct ramfs_page *ramfs_alloc_page(size_t index)
 	}
 
 	memset(page_addr(rpage->page), 0, PAGE_SIZE);
+	/* the file holds a reference, mappings take their own */
+	rpage->page->u.refcount = 1;
 	rpage->index = index;
 	return rpage;
 }
 
 static void ramfs_free_page(struct ramfs_page *page)
 {
-	free_pages(page->page, 0);
+	put_page(page->page);
 	kmem_cache_free(ramfs_page_cache, page);
 }
 
@@ -347,6 +350,24 @@ static int ramfs_lookup_page(struct ramfs_node *node,
 	return 0;
 }
 
+/* must be called with node mux held */
+static struct ramfs_page *ramfs_get_page(struct ramfs_node *node, size_t index)
+{
+	struct ramfs_page_iter iter;
+
+	if (ramfs_lookup_page(node, &iter, index))
+		return iter.page;
+
+	struct ramfs_page *rpage = ramfs_alloc_page(index);
+
+	if (!rpage)
+		return 0;
+
+	rb_link(&rpage->link, iter.parent, iter.plink);
+	rb_insert(&rpage->link, &node->pages);
+	return rpage;
+}
+
 static int ramfs_write(struct fs_file *file, const char *data, size_t size)
 {
 	struct fs_node *fs_node = file->node;
@@ -358,20 +379,11 @@ static int ramfs_write(struct fs_file *file, const char *data, size_t size)
 	const size_t off = file->offset & PAGE_MASK;
 	const size_t sz = MINU(PAGE_SIZE - off, size);
 
-	struct ramfs_page_iter iter;
-	struct ramfs_page *rpage;
+	struct ramfs_page *rpage = ramfs_get_page(node, idx);
 
-	if (ramfs_lookup_page(node, &iter, idx)) {
-		rpage = iter.page;
-	} else {
-		rpage = ramfs_alloc_page(idx);
-		if (!rpage) {
-			mutex_unlock(&fs_node->mux);
-			return -ENOMEM;
-		}
-
-		rb_link(&rpage->link, iter.parent, iter.plink);
-		rb_insert(&rpage->link, &node->pages);
+	if (!rpage) {
+		mutex_unlock(&fs_node->mux);
+		return -ENOMEM;
 	}
 
 	struct page *page = rpage->page;
@@ -446,10 +458,45 @@ static struct fs_file_ops ramfs_dir_ops = {
 	.seek = vfs_seek_default
 };
 
+static int ramfs_page_fault(struct mm *mm, struct vma *vma, virt_t vaddr,
+			int access)
+{
+	struct fs_node *fs_node = vma->node;
+	struct ramfs_node *node = RAMFS_NODE(fs_node);
+	const size_t index = vma->pgoff + ((vaddr - vma->begin) >> PAGE_BITS);
+
+	mutex_lock(&fs_node->mux);
+
+	/* there is nothing to map beyond the end of the file */
+	if (index >= ALIGN(fs_node->size, PAGE_SIZE) >> PAGE_BITS) {
+		mutex_unlock(&fs_node->mux);
+		return -EINVAL;
+	}
+
+	/* holes are filled, so that all mappers share the same page */
+	struct ramfs_page *rpage = ramfs_get_page(node, index);
+	int rc = -ENOMEM;
+
+	if (rpage)
+		rc = vma_fault_page(mm, vma, vaddr, access, rpage->page);
+	mutex_unlock(&fs_node->mux);
+
+	return rc;
+}
+
+static int ramfs_mmap(struct fs_file *file, struct vma *vma)
+{
+	(void) file;
+
+	vma->fault = &ramfs_page_fault;
+	return 0;
+}
+
 static struct fs_file_ops ramfs_file_ops = {
 	.read = ramfs_read,
 	.write = ramfs_write,
-	.seek = vfs_seek_default
+	.seek = vfs_seek_default,
+	.mmap = ramfs_mmap
 };
 
 static int ramfs_mount(struct fs_mount *mnt, const void *data, size_t size)
@@ -29,7 +29,8 @@ static bool rb_red(const struct rb_node *node)
 static bool rb_black(const struct rb_node *node)
 { return !rb_red(node); }
 
-static void rb_rotate_left(struct rb_node *x, struct rb_tree *tree)
+static void rb_rotate_left(struct rb_node *x, struct rb_tree *tree,
+			rb_augment_t augment)
 {
 	struct rb_node *p = rb_parent(x);
 	struct rb_node *r = x->right;
@@ -48,9 +49,15 @@ static void rb_rotate_left(struct rb_node *x, struct rb_tree *tree)
 	else
 		tree->root = r;
 	rb_set_parent(x, r);
+
+	if (augment) {
+		augment(x);
+		augment(r);
+	}
 }
 
-static void rb_rotate_right(struct rb_node *x, struct rb_tree *tree)
+static void rb_rotate_right(struct rb_node *x, struct rb_tree *tree,
+			rb_augment_t augment)
 {
 	struct rb_node *p = rb_parent(x);
 	struct rb_node *l = x->left;
@@ -69,6 +76,11 @@ static void rb_rotate_right(struct rb_node *x, struct rb_tree *tree)
 	else
 		tree->root = l;
 	rb_set_parent(x, l);
+
+	if (augment) {
+		augment(x);
+		augment(l);
+	}
 }
 
 struct rb_node *rb_rightmost(struct rb_node *node)
@@ -127,8 +139,20 @@ struct rb_node *rb_prev(struct rb_node *node)
 	return p;
 }
 
-void rb_insert(struct rb_node *node, struct rb_tree *tree)
+void rb_augment_propagate(struct rb_node *node, rb_augment_t augment)
+{
+	while (node) {
+		augment(node);
+		node = rb_parent(node);
+	}
+}
+
+static void __rb_insert(struct rb_node *node, struct rb_tree *tree,
+			rb_augment_t augment)
 {
+	if (augment)
+		rb_augment_propagate(node, augment);
+
 	struct rb_node *p = rb_parent(node);
 
 	while (rb_red(p)) {
@@ -147,10 +171,10 @@ void rb_insert(struct rb_node *node, struct rb_tree *tree)
 			}
 
 			if (node == p->right) {
-				rb_rotate_left(p, tree);
+				rb_rotate_left(p, tree, augment);
 				p = node;
 			}
-			rb_rotate_right(g, tree);
+			rb_rotate_right(g, tree, augment);
 			rb_set_black(p);
 			rb_set_red(g);
 			break;
@@ -167,10 +191,10 @@ void rb_insert(struct rb_node *node, struct rb_tree *tree)
 			}
 
 			if (node == p->left) {
-				rb_rotate_right(p, tree);
+				rb_rotate_right(p, tree, augment);
 				p = node;
 			}
-			rb_rotate_left(g, tree);
+			rb_rotate_left(g, tree, augment);
 			rb_set_black(p);
 			rb_set_red(g);
 			break;
@@ -179,8 +203,15 @@ void rb_insert(struct rb_node *node, struct rb_tree *tree)
 	rb_set_black(tree->root);
 }
 
+void rb_insert(struct rb_node *node, struct rb_tree *tree)
+{ __rb_insert(node, tree, 0); }
+
+void rb_insert_augmented(struct rb_node *node, struct rb_tree *tree,
+			rb_augment_t augment)
+{ __rb_insert(node, tree, augment); }
+
 static void rb_erase_fix(struct rb_node *child, struct rb_node *parent,
-			struct rb_tree *tree)
+			struct rb_tree *tree, rb_augment_t augment)
 {
 	while (rb_black(child) && child != tree->root) {
 		if (child == parent->left) {
@@ -189,7 +220,7 @@ static void rb_erase_fix(struct rb_node *child, struct rb_node *parent,
 			if (rb_red(b)) {
 				rb_set_black(b);
 				rb_set_red(parent);
-				rb_rotate_left(parent, tree);
+				rb_rotate_left(parent, tree, augment);
 				b = parent->right;
 			}
 
@@ -201,14 +232,14 @@ static void rb_erase_fix(struct rb_node *child, struct rb_node *parent,
 				if (rb_black(b->right)) {
 					rb_set_black(b->left);
 					rb_set_red(b);
-					rb_rotate_right(b, tree);
+					rb_rotate_right(b, tree, augment);
 					b = parent->right;
 				}
 				rb_set_color(b, rb_color(parent));
 				rb_set_black(parent);
 				if (b->right)
 					rb_set_black(b->right);
-				rb_rotate_left(parent, tree);
+				rb_rotate_left(parent, tree, augment);
 				child = tree->root;
 				break;
 			}
@@ -218,7 +249,7 @@ static void rb_erase_fix(struct rb_node *child, struct rb_node *parent,
 			if (rb_red(b)) {
 				rb_set_black(b);
 				rb_set_red(parent);
-				rb_rotate_right(parent, tree);
+				rb_rotate_right(parent, tree, augment);
 				b = parent->left;
 			}
 
@@ -230,14 +261,14 @@ static void rb_erase_fix(struct rb_node *child, struct rb_node *parent,
 				if (rb_black(b->left)) {
 					rb_set_black(b->right);
 					rb_set_red(b);
-					rb_rotate_left(b, tree);
+					rb_rotate_left(b, tree, augment);
 					b = parent->left;
 				}
 				rb_set_color(b, rb_color(parent));
 				rb_set_black(parent);
 				if (b->left)
 					rb_set_black(b->left);
-				rb_rotate_right(parent, tree);
+				rb_rotate_right(parent, tree, augment);
 				child = tree->root;
 				break;
 			}
@@ -248,7 +279,8 @@ static void rb_erase_fix(struct rb_node *child, struct rb_node *parent,
 		rb_set_black(child);
 }
 
-void rb_erase(struct rb_node *node, struct rb_tree *tree)
+static void __rb_erase(struct rb_node *node, struct rb_tree *tree,
+			rb_augment_t augment)
 {
 	struct rb_node *p, *c, *x;
 	int color;
@@ -291,6 +323,17 @@ void rb_erase(struct rb_node *node, struct rb_tree *tree)
 	} else
 		tree->root = x;
 
+	/* p is the lowest node whose subtree has changed */
+	if (augment)
+		rb_augment_propagate(p, augment);
+
 	if (color == BLACK)
-		rb_erase_fix(c, p, tree);
+		rb_erase_fix(c, p, tree, augment);
 }
+
+void rb_erase(struct rb_node *node, struct rb_tree *tree)
+{ __rb_erase(node, tree, 0); }
+
+void rb_erase_augmented(struct rb_node *node, struct rb_tree *tree,
+			rb_augment_t augment)
+{ __rb_erase(node, tree, augment); }
@@ -32,4 +32,18 @@ struct rb_node *rb_prev(struct rb_node *node);
 void rb_erase(struct rb_node *node, struct rb_tree *tree);
 void rb_insert(struct rb_node *node, struct rb_tree *tree);
 
+/*
+ * Augmented trees keep some per node data computed from the node and its
+ * children (e. g. subtree maximum), augment must recalculate it for the
+ * node assuming that children are up to date. If data of a node changes
+ * without changing the tree structure call rb_augment_propagate on it.
+ */
+typedef void (*rb_augment_t)(struct rb_node *);
+
+void rb_augment_propagate(struct rb_node *node, rb_augment_t augment);
+void rb_erase_augmented(struct rb_node *node, struct rb_tree *tree,
+			rb_augment_t augment);
+void rb_insert_augmented(struct rb_node *node, struct rb_tree *tree,
+			rb_augment_t augment);
+
 #endif /*__RED_BLACK_TREE_H__*/
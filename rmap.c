@@ -0,0 +1,172 @@
+#include "kmem_cache.h"
+#include "stdio.h"
+#include "error.h"
+#include "rmap.h"
+#include "mm.h"
+
+
+static struct kmem_cache *anon_vma_cachep;
+static struct kmem_cache *anon_vma_chain_cachep;
+
+static struct anon_vma *alloc_anon_vma(void)
+{
+	struct anon_vma *anon_vma = kmem_cache_alloc(anon_vma_cachep);
+
+	if (!anon_vma)
+		return 0;
+
+	anon_vma->refcount = 0;
+	list_init(&anon_vma->chain);
+	return anon_vma;
+}
+
+static struct anon_vma *get_anon_vma(struct anon_vma *anon_vma)
+{
+	++anon_vma->refcount;
+	return anon_vma;
+}
+
+static void put_anon_vma(struct anon_vma *anon_vma)
+{
+	if (--anon_vma->refcount)
+		return;
+
+	DBG_ASSERT(list_empty(&anon_vma->chain));
+	kmem_cache_free(anon_vma_cachep, anon_vma);
+}
+
+static int anon_vma_link(struct vma *vma, struct anon_vma *anon_vma)
+{
+	struct anon_vma_chain *avc = kmem_cache_alloc(anon_vma_chain_cachep);
+
+	if (!avc)
+		return -ENOMEM;
+
+	avc->vma = vma;
+	avc->anon_vma = get_anon_vma(anon_vma);
+	list_add_tail(&avc->same_vma, &vma->anon_chain);
+	list_add_tail(&avc->same_anon, &anon_vma->chain);
+	return 0;
+}
+
+int anon_vma_prepare(struct vma *vma)
+{
+	if (vma->anon_vma)
+		return 0;
+
+	struct anon_vma *anon_vma = alloc_anon_vma();
+
+	if (!anon_vma)
+		return -ENOMEM;
+
+	const int rc = anon_vma_link(vma, anon_vma);
+
+	if (rc) {
+		kmem_cache_free(anon_vma_cachep, anon_vma);
+		return rc;
+	}
+
+	vma->anon_vma = anon_vma;
+	return 0;
+}
+
+/* dst gets its own anon_vma lazily, so its new pages stay apart */
+int anon_vma_clone(struct vma *dst, struct vma *src)
+{
+	struct list_head *head = &src->anon_chain;
+
+	for (struct list_head *ptr = head->next; ptr != head; ptr = ptr->next) {
+		struct anon_vma_chain *avc = LIST_ENTRY(ptr,
+					struct anon_vma_chain, same_vma);
+		const int rc = anon_vma_link(dst, avc->anon_vma);
+
+		if (rc) {
+			unlink_anon_vmas(dst);
+			return rc;
+		}
+	}
+	return 0;
+}
+
+void unlink_anon_vmas(struct vma *vma)
+{
+	while (!list_empty(&vma->anon_chain)) {
+		struct anon_vma_chain *avc = LIST_ENTRY(
+					list_first(&vma->anon_chain),
+					struct anon_vma_chain, same_vma);
+
+		list_del(&avc->same_vma);
+		list_del(&avc->same_anon);
+		put_anon_vma(avc->anon_vma);
+		kmem_cache_free(anon_vma_chain_cachep, avc);
+	}
+	vma->anon_vma = 0;
+}
+
+void page_add_anon_rmap(struct page *page, struct vma *vma, virt_t addr)
+{
+	DBG_ASSERT(!page->anon_vma);
+	DBG_ASSERT(vma->anon_vma);
+
+	page->anon_vma = get_anon_vma(vma->anon_vma);
+	page->index = addr;
+}
+
+void page_remove_rmap(struct page *page)
+{
+	if (!page->anon_vma)
+		return;
+
+	put_anon_vma(page->anon_vma);
+	page->anon_vma = 0;
+	page->index = 0;
+}
+
+void rmap_iter_init(struct rmap_iter *iter, struct page *page)
+{
+	iter->page = page;
+	iter->pos = page->anon_vma ? &page->anon_vma->chain : 0;
+	iter->vma = 0;
+	iter->pte = 0;
+}
+
+bool rmap_iter_next(struct rmap_iter *iter)
+{
+	struct anon_vma *anon_vma = iter->page->anon_vma;
+	const virt_t addr = iter->page->index;
+
+	if (!iter->pos)
+		return false;
+
+	for (iter->pos = iter->pos->next; iter->pos != &anon_vma->chain;
+				iter->pos = iter->pos->next) {
+		struct anon_vma_chain *avc = LIST_ENTRY(iter->pos,
+					struct anon_vma_chain, same_anon);
+		struct vma *vma = avc->vma;
+
+		if (addr < vma->begin || addr >= vma->end)
+			continue;
+
+		pte_t *pte = pt_lookup_pte(page_addr(vma->mm->pt), addr);
+
+		if (!pte || !pte_present(*pte))
+			continue;
+
+		if (pte_phys(*pte) != page_paddr(iter->page))
+			continue;
+
+		iter->vma = vma;
+		iter->pte = pte;
+		return true;
+	}
+
+	iter->pos = 0;
+	return false;
+}
+
+void setup_rmap(void)
+{
+	DBG_ASSERT((anon_vma_cachep = KMEM_CACHE(struct anon_vma)) != 0);
+	DBG_ASSERT((anon_vma_chain_cachep =
+				KMEM_CACHE(struct anon_vma_chain)) != 0);
+}
@@ -0,0 +1,64 @@
+#ifndef __RMAP_H__
+#define __RMAP_H__
+
+#include "paging.h"
+#include "list.h"
+
+#include <stdbool.h>
+
+
+/*
+ * Reverse mapping of anonymous pages. Every vma that might contain
+ * anonymous pages has an anon_vma for pages allocated in it, and a chain
+ * of all anon_vmas pages of the vma might belong to: on fork the child vma
+ * joins all the anon_vmas of the parent vma. A page remembers its anon_vma
+ * and address, since pages never move within an address space, it's
+ * enough to check that address in every vma on the anon_vma chain.
+ *
+ * Only pages mapped for the first time by __mmap_pages or fault around get
+ * a reverse mapping: the zero page, file pages, cached exec images and
+ * merged pages don't have one.
+ */
+struct anon_vma {
+	int refcount; // chain links and pages
+	struct list_head chain;
+};
+
+struct anon_vma_chain {
+	struct vma *vma;
+	struct anon_vma *anon_vma;
+	struct list_head same_vma;
+	struct list_head same_anon;
+};
+
+struct vma;
+
+int anon_vma_prepare(struct vma *vma);
+int anon_vma_clone(struct vma *dst, struct vma *src);
+void unlink_anon_vmas(struct vma *vma);
+
+/* page must not be mapped anywhere yet, vma must be prepared */
+void page_add_anon_rmap(struct page *page, struct vma *vma, virt_t addr);
+void page_remove_rmap(struct page *page);
+
+/*
+ * Iterates over PTEs that map page, PML1 tables shared after fork show up
+ * once for every mm that uses them. Page tables must not change during
+ * the iteration, so preemption must be disabled.
+ */
+struct rmap_iter {
+	struct page *page;
+	struct list_head *pos;
+	struct vma *vma;
+	pte_t *pte;
+};
+
+void rmap_iter_init(struct rmap_iter *iter, struct page *page);
+bool rmap_iter_next(struct rmap_iter *iter);
+
+#define for_each_rmap(page, iter) \
+	for (rmap_iter_init(&(iter), page); rmap_iter_next(&(iter)); )
+
+void setup_rmap(void);
+
+#endif /*__RMAP_H__*/
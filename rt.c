@@ -0,0 +1,141 @@
+#include "threads.h"
+#include "stdio.h"
+#include "time.h"
+#include "list.h"
+
+#define RT_RR_SLICE_NS 100000000ull
+
+/*
+ * Real-time class: a list per priority and a bitmap of non empty lists.
+ * Higher priority maps to a lower bit, so the first set bit is the list
+ * to run from. Threads of the class aren't allocated by it, so the links
+ * live in struct thread.
+ */
+
+static int rt_index(int prio)
+{ return MAX_RT_PRIO - 1 - prio; }
+
+static int rt_first_index(const struct rt_rq *rt)
+{
+	for (int i = 0; i != RT_BITMAP_WORDS; ++i) {
+		if (rt->bitmap[i])
+			return i * 64 + __builtin_ctzll(rt->bitmap[i]);
+	}
+	return MAX_RT_PRIO;
+}
+
+static void rt_enqueue(struct runqueue *rq, struct thread *thread, bool head)
+{
+	const int index = rt_index(thread->rt_priority);
+	struct rt_rq *rt = &rq->rt;
+
+	if (head)
+		list_add(&thread->rt_link, &rt->queue[index]);
+	else
+		list_add_tail(&thread->rt_link, &rt->queue[index]);
+	rt->bitmap[index / 64] |= 1ull << (index % 64);
+	++rt->nr_running;
+}
+
+static void rt_dequeue(struct runqueue *rq, struct thread *thread, int index)
+{
+	struct rt_rq *rt = &rq->rt;
+
+	list_del(&thread->rt_link);
+	if (list_empty(&rt->queue[index]))
+		rt->bitmap[index / 64] &= ~(1ull << (index % 64));
+	--rt->nr_running;
+}
+
+static bool rt_slice_expired(const struct thread *thread)
+{ return ktime_get_ns() - thread->time >= RT_RR_SLICE_NS; }
+
+/* only RR threads sharing the level have a deadline */
+static unsigned long long rt_slice(struct runqueue *rq, struct thread *thread)
+{
+	const unsigned long long ran = ktime_get_ns() - thread->time;
+
+	if (thread->policy != SCHED_RR ||
+			rt_first_index(&rq->rt) != rt_index(thread->rt_priority))
+		return SCHED_SLICE_NONE;
+	return ran < RT_RR_SLICE_NS ? RT_RR_SLICE_NS - ran : 0;
+}
+
+static void rt_activate_thread(struct runqueue *rq, struct thread *thread)
+{
+	DBG_ASSERT(local_preempt_disabled());
+	DBG_ASSERT(thread->state == THREAD_ACTIVE);
+
+	rt_enqueue(rq, thread, false);
+}
+
+/* preempted thread keeps its place unless it used up its RR slice */
+static void rt_preempt_thread(struct runqueue *rq, struct thread *thread)
+{
+	DBG_ASSERT(local_preempt_disabled());
+
+	rt_enqueue(rq, thread, thread->policy != SCHED_RR ||
+				!rt_slice_expired(thread));
+}
+
+static struct thread *rt_next_thread(struct runqueue *rq)
+{
+	const int index = rt_first_index(&rq->rt);
+
+	DBG_ASSERT(local_preempt_disabled());
+
+	if (index == MAX_RT_PRIO)
+		return 0;
+
+	struct thread *thread = LIST_ENTRY(list_first(&rq->rt.queue[index]),
+				struct thread, rt_link);
+
+	rt_dequeue(rq, thread, index);
+	return thread;
+}
+
+/* take the lowest priority thread, from the tail of its list */
+static struct thread *rt_steal_thread(struct runqueue *rq)
+{
+	DBG_ASSERT(local_preempt_disabled());
+
+	for (int index = MAX_RT_PRIO - 1; index >= 0; --index) {
+		struct list_head *head = &rq->rt.queue[index];
+
+		for (struct list_head *ptr = head->prev; ptr != head;
+					ptr = ptr->prev) {
+			struct thread *thread = LIST_ENTRY(ptr, struct thread,
+						rt_link);
+
+			if (thread->on_cpu)
+				continue;
+
+			rt_dequeue(rq, thread, index);
+			return thread;
+		}
+	}
+	return 0;
+}
+
+/* FIFO runs until a higher priority thread shows up, RR shares its level */
+static bool rt_need_preempt(struct runqueue *rq, struct thread *thread)
+{
+	const int first = rt_first_index(&rq->rt);
+	const int index = rt_index(thread->rt_priority);
+
+	if (first < index)
+		return true;
+
+	return first == index && thread->policy == SCHED_RR &&
+				rt_slice_expired(thread);
+}
+
+
+struct scheduler rt_scheduler = {
+	.activate = rt_activate_thread,
+	.need_preempt = rt_need_preempt,
+	.slice = rt_slice,
+	.next = rt_next_thread,
+	.steal = rt_steal_thread,
+	.preempt = rt_preempt_thread
+};
@@ -4,8 +4,7 @@
 #include "time.h"
 #include "list.h"
 
-#define RR_SCHED_SLICE 20
-#define RR_MS          1000
+#define RR_SCHED_SLICE_NS 20000000ull
 
 struct rr_thread {
 	struct thread thread;
@@ -21,7 +20,6 @@ static struct thread *THREAD(struct rr_thread *thread)
 
 
 static struct kmem_cache *rr_thread_cache;
-static LIST_HEAD(rr_active_list);
 
 
 static struct thread *rr_alloc_thread(void)
@@ -43,19 +41,30 @@ static void rr_free_thread(struct thread *thread)
 	kmem_cache_free(rr_thread_cache, rr_thread);
 }
 
-static bool rr_need_preempt(struct thread *thread)
+static bool rr_need_preempt(struct runqueue *rq, struct thread *thread)
 {
-	return (jiffies() - thread->time) * RR_MS > RR_SCHED_SLICE * HZ;
+	(void) rq;
+
+	return ktime_get_ns() - thread->time >= RR_SCHED_SLICE_NS;
 }
 
-static struct thread *rr_next_thread(void)
+static unsigned long long rr_slice(struct runqueue *rq, struct thread *thread)
+{
+	const unsigned long long ran = ktime_get_ns() - thread->time;
+
+	if (list_empty(&rq->rr))
+		return SCHED_SLICE_NONE;
+	return ran < RR_SCHED_SLICE_NS ? RR_SCHED_SLICE_NS - ran : 0;
+}
+
+static struct thread *rr_next_thread(struct runqueue *rq)
 {
 	DBG_ASSERT(local_preempt_disabled());
 
-	if (list_empty(&rr_active_list))
+	if (list_empty(&rq->rr))
 		return 0;
 
-	struct list_head *first = list_first(&rr_active_list);
+	struct list_head *first = list_first(&rq->rr);
 	struct rr_thread *thread = LIST_ENTRY(first, struct rr_thread, link);
 
 	list_del(&thread->link);
@@ -63,20 +72,40 @@ static struct thread *rr_next_thread(void)
 	return THREAD(thread);
 }
 
-static void rr_activate_thread(struct thread *thread)
+/* take from the tail, threads at the head are about to run here */
+static struct thread *rr_steal_thread(struct runqueue *rq)
+{
+	struct list_head *head = &rq->rr;
+
+	DBG_ASSERT(local_preempt_disabled());
+
+	for (struct list_head *ptr = head->prev; ptr != head; ptr = ptr->prev) {
+		struct rr_thread *thread = LIST_ENTRY(ptr, struct rr_thread,
+					link);
+
+		if (THREAD(thread)->on_cpu)
+			continue;
+
+		list_del(&thread->link);
+		return THREAD(thread);
+	}
+	return 0;
+}
+
+static void rr_activate_thread(struct runqueue *rq, struct thread *thread)
 {
 	DBG_ASSERT(local_preempt_disabled());
 	DBG_ASSERT(thread->state == THREAD_ACTIVE);
 
-	list_add_tail(&RR_THREAD(thread)->link, &rr_active_list);
+	list_add_tail(&RR_THREAD(thread)->link, &rq->rr);
 }
 
-static void rr_preempt_thread(struct thread *thread)
+static void rr_preempt_thread(struct runqueue *rq, struct thread *thread)
 {
 	DBG_ASSERT(local_preempt_disabled());
 
 	if (thread->state == THREAD_ACTIVE)
-		list_add_tail(&RR_THREAD(thread)->link, &rr_active_list);
+		list_add_tail(&RR_THREAD(thread)->link, &rq->rr);
 }
 
 
@@ -85,7 +114,9 @@ struct scheduler round_robin = {
 	.free = rr_free_thread,
 	.activate = rr_activate_thread,
 	.need_preempt = rr_need_preempt,
+	.slice = rr_slice,
 	.next = rr_next_thread,
+	.steal = rr_steal_thread,
 	.preempt = rr_preempt_thread
 };
 
@@ -0,0 +1,445 @@
+#include "interrupt.h"
+#include "threads.h"
+#include "balloc.h"
+#include "memory.h"
+#include "paging.h"
+#include "string.h"
+#include "stdio.h"
+#include "error.h"
+#include "lapic.h"
+#include "acpi.h"
+#include "time.h"
+#include "msr.h"
+#include "smp.h"
+#include "mm.h"
+
+
+#define TRAMPOLINE_LIMIT  0x100000ul
+#define SMP_INIT_DELAY_MS 10
+#define SMP_SIPI_DELAY_MS 1
+#define SMP_START_WAIT_MS 10000
+#define TLB_FLUSH_PAGES   32
+
+struct trampoline_data {
+	uint64_t cr3;
+	uint64_t stack;
+	uint64_t entry;
+	uint64_t cpu;
+} __attribute__((packed));
+
+struct tss_desc {
+	uint64_t low;
+	uint64_t high;
+} __attribute((packed));
+
+/* the only TLB shootdown in flight, see flush_tlb_range */
+struct tlb_request {
+	struct mm *mm;
+	virt_t begin;
+	virt_t end;
+	int pending; // CPUs that haven't flushed yet
+};
+
+
+struct cpu cpus[CONFIG_MAX_CPUS];
+static int cpus_count = 1;
+static bool resched_ipi;
+static int apic_ids[CONFIG_MAX_CPUS];
+static int apic_ids_count;
+static phys_t trampoline_paddr;
+static struct tlb_request tlb_request;
+static int tlb_busy;
+static bool tlb_ipi;
+
+
+int cpu_count(void)
+{ return cpus_count; }
+
+/* consistent with the switches of the CPU, see place_thread */
+unsigned long long cpu_idle_ns(int id)
+{
+	const struct cpu *cpu = &cpus[id];
+	unsigned long long start, ns;
+	unsigned seq;
+
+	do {
+		while ((seq = __atomic_load_n(&cpu->idle_seq,
+					__ATOMIC_ACQUIRE)) & 1)
+			cpu_relax();
+		start = __atomic_load_n(&cpu->idle_start, __ATOMIC_RELAXED);
+		ns = __atomic_load_n(&cpu->idle_ns, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&cpu->idle_seq, __ATOMIC_RELAXED) != seq);
+
+	const unsigned long long now = ktime_get_ns();
+
+	return start && now > start ? ns + now - start : ns;
+}
+
+static void resched_interrupt_handler(int intno)
+{
+	(void) intno;
+}
+
+void smp_send_reschedule(struct cpu *cpu)
+{
+	if (!resched_ipi)
+		return;
+
+	/* ICR is written in two steps, interrupt must not send in between */
+	const unsigned long flags = local_irqsave();
+
+	lapic_send_fixed(cpu->apic_id, RESCHED_INTNO);
+	local_irqrestore(flags);
+}
+
+static void flush_tlb_local(struct mm *mm, virt_t begin, virt_t end)
+{
+	if (mm && !mm_active(mm))
+		return;
+
+	/* there are no global pages, so reloading CR3 drops everything */
+	if ((end - begin) >> PAGE_BITS > TLB_FLUSH_PAGES) {
+		flush_tlb();
+		return;
+	}
+
+	for (virt_t addr = begin; addr < end; addr += PAGE_SIZE)
+		flush_tlb_addr(addr);
+}
+
+/* handles the shootdown if it's addressed to us, interrupts are disabled */
+static void tlb_poll(void)
+{
+	struct cpu *cpu = this_cpu();
+
+	if (!__atomic_load_n(&cpu->tlb_pending, __ATOMIC_ACQUIRE))
+		return;
+
+	flush_tlb_local(tlb_request.mm, tlb_request.begin, tlb_request.end);
+	cpu->tlb_pending = false;
+	__atomic_sub_fetch(&tlb_request.pending, 1, __ATOMIC_RELEASE);
+}
+
+static void tlb_interrupt_handler(int intno)
+{
+	(void) intno;
+	tlb_poll();
+}
+
+static bool tlb_loaded_elsewhere(struct mm *mm)
+{
+	/* page table changes must be visible before we look at cpus */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!mm)
+		return true;
+
+	/*
+	 * A CPU that loads the mm after that has nothing stale, CR3 reload
+	 * drops all the entries.
+	 */
+	const int cpus = __atomic_load_n(&mm->cpus, __ATOMIC_RELAXED);
+
+	return cpus > (mm_active(mm) ? 1 : 0);
+}
+
+void flush_tlb_range(struct mm *mm, virt_t begin, virt_t end)
+{
+	const unsigned long flags = local_irqsave();
+
+	flush_tlb_local(mm, begin, end);
+	if (!tlb_ipi || !tlb_loaded_elsewhere(mm)) {
+		local_irqrestore(flags);
+		return;
+	}
+
+	/* the CPU holding the request might be waiting for us */
+	while (__atomic_exchange_n(&tlb_busy, 1, __ATOMIC_ACQUIRE)) {
+		tlb_poll();
+		cpu_relax();
+	}
+
+	struct cpu *self = this_cpu();
+
+	/* our own reference keeps pending above zero until all are sent */
+	tlb_request.mm = mm;
+	tlb_request.begin = begin;
+	tlb_request.end = end;
+	tlb_request.pending = 1;
+
+	/* a CPU that doesn't have the mm loaded just acknowledges */
+	for (int i = 0; i != CONFIG_MAX_CPUS; ++i) {
+		struct cpu *cpu = &cpus[i];
+
+		if (cpu == self || !cpu->online)
+			continue;
+
+		__atomic_add_fetch(&tlb_request.pending, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&cpu->tlb_pending, true, __ATOMIC_RELEASE);
+		lapic_send_fixed(cpu->apic_id, TLB_INTNO);
+	}
+
+	__atomic_sub_fetch(&tlb_request.pending, 1, __ATOMIC_RELEASE);
+	while (__atomic_load_n(&tlb_request.pending, __ATOMIC_ACQUIRE))
+		cpu_relax();
+
+	__atomic_store_n(&tlb_busy, 0, __ATOMIC_RELEASE);
+	local_irqrestore(flags);
+}
+
+static void setup_tss_desc(struct tss_desc *desc, struct tss *tss)
+{
+	const uint64_t limit = sizeof(*tss) - 1;
+	const uint64_t base = (uint64_t)tss;
+
+	desc->low = (limit & BITS_CONST(15, 0))
+			| ((base & BITS_CONST(23, 0)) << 16)
+			| (((uint64_t)9 | BIT_CONST(7)) << 40)
+			| ((limit & BITS_CONST(19, 16)) << 32)
+			| ((base & BITS_CONST(31, 24)) << 32);
+	desc->high = base >> 32;
+}
+
+static void load_gdt(const uint64_t *gdt, size_t size)
+{
+	struct gdt_ptr ptr;
+
+	ptr.size = size - 1;
+	ptr.addr = (uint64_t)gdt;
+	__asm__ volatile ("lgdt %0" : : "m"(ptr));
+}
+
+static void load_tr(unsigned short sel)
+{ __asm__ volatile ("ltr %0" : : "a"(sel)); }
+
+static void init_cpu(struct cpu *cpu, int id)
+{
+	cpu->self = cpu;
+	cpu->id = id;
+	runqueue_init(&cpu->rq);
+	list_init(&cpu->pt_quicklist.pages);
+	cpu->pt_quicklist.count = 0;
+}
+
+static void load_cpu(struct cpu *cpu)
+{
+	wrmsr(MSR_GS_BASE, (uint64_t)cpu);
+	wrmsr(MSR_KERNEL_GS_BASE, 0);
+}
+
+/* every CPU has its own GDT, since TSS descriptor is marked busy by ltr */
+static void setup_cpu(struct cpu *cpu, const uint64_t *gdt, void *stack)
+{
+	const int tss_entry = TSS >> 3;
+	struct tss *tss = &cpu->tss;
+	struct tss_desc desc;
+
+	memcpy(cpu->gdt, gdt, sizeof(cpu->gdt));
+
+	tss->iomap_base = offsetof(struct tss, iomap);
+	tss->rsp[0] = (uint64_t)stack;
+	memset(tss->iomap, 0xff, sizeof(tss->iomap));
+	setup_tss_desc(&desc, tss);
+	memcpy(cpu->gdt + tss_entry, &desc, sizeof(desc));
+
+	load_gdt(cpu->gdt, sizeof(cpu->gdt));
+	load_tr(TSS);
+}
+
+void setup_boot_cpu(void)
+{
+	extern char init_stack_top[];
+	struct cpu *cpu = &cpus[0];
+
+	init_cpu(cpu, 0);
+	load_cpu(cpu);
+	setup_cpu(cpu, get_gdt_ptr(), init_stack_top);
+	cpu->online = true;
+}
+
+/* must be called before buddy allocator takes over low memory */
+void setup_trampoline(void)
+{
+	const long long addr = balloc_alloc_aligned(PAGE_SIZE,
+				TRAMPOLINE_LIMIT, PAGE_SIZE, PAGE_SIZE);
+
+	if (addr < 0) {
+		DBG_ERR("failed to reserve AP trampoline page");
+		return;
+	}
+	trampoline_paddr = addr;
+}
+
+static void ap_start(struct cpu *cpu)
+{
+	struct thread *thread = cpu->idle;
+
+	load_cpu(cpu);
+	store_pml4(page_paddr(thread->mm->pt));
+	setup_cpu(cpu, cpus[0].gdt, thread_stack_end(thread));
+	load_ints();
+	lapic_enable(SPURIOUS_INTNO);
+	setup_local_timer();
+
+	thread->on_cpu = true;
+	__atomic_add_fetch(&thread->mm->cpus, 1, __ATOMIC_RELAXED);
+
+	barrier();
+	cpu->online = true;
+
+	/* idle steals work from other CPUs */
+	local_preempt_enable();
+	idle();
+}
+
+/* at least ms, ktime might have jiffy resolution */
+static unsigned long long smp_deadline(unsigned long ms)
+{ return ktime_get_ns() + ms * (NSEC_PER_SEC / 1000) + NSEC_PER_JIFFY; }
+
+static void smp_delay(unsigned long ms)
+{
+	const unsigned long long deadline = smp_deadline(ms);
+
+	while (ktime_get_ns() < deadline)
+		barrier();
+}
+
+static bool smp_wait_cpu(struct cpu *cpu, unsigned long ms)
+{
+	const unsigned long long deadline = smp_deadline(ms);
+
+	while (!cpu->online && ktime_get_ns() < deadline)
+		barrier();
+	return cpu->online;
+}
+
+static int start_cpu(struct cpu *cpu, phys_t pml4)
+{
+	extern char trampoline_begin[];
+	extern char trampoline_data[];
+
+	struct thread *idle = create_idle_thread();
+
+	if (!idle)
+		return -ENOMEM;
+
+	struct trampoline_data *data = va(trampoline_paddr +
+				(trampoline_data - trampoline_begin));
+
+	cpu->idle = idle;
+	cpu->current = idle;
+
+	data->cr3 = pml4;
+	data->stack = (uint64_t)thread_stack_end(idle);
+	data->entry = (uint64_t)&ap_start;
+	data->cpu = (uint64_t)cpu;
+
+	lapic_send_init(cpu->apic_id);
+	smp_delay(SMP_INIT_DELAY_MS);
+
+	for (int i = 0; i != 2 && !cpu->online; ++i) {
+		lapic_send_sipi(cpu->apic_id, trampoline_paddr >> PAGE_BITS);
+		smp_delay(SMP_SIPI_DELAY_MS);
+	}
+
+	if (!smp_wait_cpu(cpu, SMP_START_WAIT_MS))
+		return -EBUSY;
+	return 0;
+}
+
+/* low copy of the kernel page table with identity mapping at 0 */
+static struct page *alloc_trampoline_pml4(void)
+{
+	struct page *page = __alloc_pages(0, NT_LOW);
+
+	if (!page)
+		return 0;
+
+	const size_t offset = pml4_i(HIGH_BASE) * sizeof(pte_t);
+	pte_t *pml4 = page_addr(page);
+
+	memset(pml4, 0, offset);
+	memcpy((char *)pml4 + offset,
+		(char *)va(load_pml4()) + offset, PAGE_SIZE - offset);
+	pml4[0] = pml4[pml4_i(HIGH_BASE)];
+
+	return page;
+}
+
+static void smp_add_cpu(int apic_id)
+{
+	if (apic_ids_count == CONFIG_MAX_CPUS) {
+		DBG_WARN("CPU with APIC id %d ignored, CONFIG_MAX_CPUS is %d",
+					apic_id, CONFIG_MAX_CPUS);
+		return;
+	}
+	apic_ids[apic_ids_count++] = apic_id;
+}
+
+/* must be called with interrupts enabled, time might come from the PIT tick */
+void setup_smp(void)
+{
+	extern char trampoline_begin[];
+	extern char trampoline_end[];
+
+	const phys_t lapic = acpi_parse_madt(&smp_add_cpu);
+
+	if (!lapic)
+		return;
+
+	if (setup_lapic(lapic)) {
+		DBG_ERR("failed to map local APIC");
+		return;
+	}
+
+	/* i8259 keeps working through LINT0 of the BSP */
+	cpus[0].apic_id = lapic_id();
+	lapic_virtual_wire();
+	lapic_enable(SPURIOUS_INTNO);
+	setup_local_timer();
+	register_local_handler(RESCHED_INTNO, &resched_interrupt_handler);
+	resched_ipi = true;
+	register_local_handler(TLB_INTNO, &tlb_interrupt_handler);
+	tlb_ipi = true;
+
+	if (apic_ids_count < 2 || !trampoline_paddr)
+		return;
+
+	struct page *pml4 = alloc_trampoline_pml4();
+
+	if (!pml4) {
+		DBG_ERR("failed to allocate AP page table");
+		return;
+	}
+
+	memcpy(va(trampoline_paddr), trampoline_begin,
+				trampoline_end - trampoline_begin);
+
+	for (int i = 0; i != apic_ids_count &&
+				cpus_count != CONFIG_MAX_CPUS; ++i) {
+		struct cpu *cpu = &cpus[cpus_count];
+
+		if (apic_ids[i] == cpus[0].apic_id)
+			continue;
+
+		init_cpu(cpu, cpus_count);
+		cpu->apic_id = apic_ids[i];
+
+		const int rc = start_cpu(cpu, page_paddr(pml4));
+
+		/* late AP could still use the trampoline, so stop here */
+		if (rc) {
+			DBG_ERR("failed to start CPU with APIC id %d: %s",
+						cpu->apic_id, errstr(rc));
+			break;
+		}
+		++cpus_count;
+	}
+
+	if (cpus_count == apic_ids_count)
+		free_pages(pml4, 0);
+
+	DBG_INFO("%d CPUs are up, MADT reported %d", cpus_count,
+				apic_ids_count);
+	DBG_ASSERT(cpus_count == apic_ids_count);
+}
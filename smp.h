@@ -0,0 +1,94 @@
+#ifndef __SMP_H__
+#define __SMP_H__
+
+#include "threads.h"
+#include "kernel.h"
+#include "list.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define GDT_ENTRIES 9
+
+#define IO_MAP_BITS  BIT_CONST(16)
+#define IO_MAP_WORDS (IO_MAP_BITS / sizeof(unsigned long))
+
+struct tss {
+	uint32_t rsrv0;
+	uint64_t rsp[3];
+	uint64_t rsrv1;
+	uint64_t ist[7];
+	uint64_t rsrv2;
+	uint16_t rsrv3;
+	uint16_t iomap_base;
+	unsigned long iomap[IO_MAP_WORDS + 1];
+} __attribute__((packed));
+
+struct thread;
+
+/* zeroed page tables cached by the CPU, see alloc_page_table */
+struct pt_quicklist {
+	struct list_head pages;
+	size_t count;
+};
+
+/*
+ * Per-CPU data, GS base of every CPU points to its own struct cpu while in
+ * the kernel (entry.S does swapgs on the way from and to userspace).
+ */
+struct cpu {
+	struct cpu *self; // must be the first
+	struct thread *current;
+	struct thread *idle;
+	struct runqueue rq;
+	struct pt_quicklist pt_quicklist;
+	int id;
+	int apic_id;
+	volatile bool online;
+	bool tlb_pending; // has to handle the current TLB shootdown
+	unsigned long long idle_ns; // time spent in the idle thread
+	unsigned long long idle_start; // 0 if not in the idle thread
+	unsigned idle_seq; // odd while idle_ns and idle_start change
+	uint64_t gdt[GDT_ENTRIES];
+	struct tss tss;
+};
+
+extern struct cpu cpus[CONFIG_MAX_CPUS];
+
+static inline struct cpu *this_cpu(void)
+{
+	struct cpu *cpu;
+
+	__asm__ volatile ("movq %%gs:0, %0" : "=r"(cpu));
+	return cpu;
+}
+
+static inline struct thread *this_cpu_current(void)
+{
+	struct thread *thread;
+
+	__asm__ volatile ("movq %%gs:%c1, %0"
+		: "=r"(thread)
+		: "i"(offsetof(struct cpu, current)));
+	return thread;
+}
+
+static inline int cpu_id(void)
+{ return this_cpu()->id; }
+
+/* number of CPUs that are up */
+int cpu_count(void);
+
+/* ns CPU id spent in its idle thread so far */
+unsigned long long cpu_idle_ns(int id);
+
+/* wakes up cpu if it's halted, it reschedules on the way out */
+void smp_send_reschedule(struct cpu *cpu);
+
+void setup_boot_cpu(void);
+void setup_trampoline(void);
+void setup_smp(void);
+
+#endif /*__SMP_H__*/
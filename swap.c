@@ -0,0 +1,516 @@
+#include "kmem_cache.h"
+#include "threads.h"
+#include "string.h"
+#include "stdio.h"
+#include "error.h"
+#include "swap.h"
+#include "ide.h"
+#include "mm.h"
+#include "lz.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+#define SWAP_SECTOR_SIZE 512
+
+/* the area must be prepared with mkswap, we use its first page header */
+#define SWAP_MAGIC      "SWAPSPACE2"
+#define SWAP_MAGIC_SIZE (sizeof(SWAP_MAGIC) - 1)
+
+struct swap_header {
+	uint8_t bootbits[1024];
+	uint32_t version;
+	uint32_t last_page;
+};
+
+/* compressed page must save at least a quarter of a page to be stored */
+#define SWAP_MAX_SIZE   (PAGE_SIZE - PAGE_SIZE / 4)
+
+/* how many page slots we look at per page we want to reclaim */
+#define SWAP_SCAN_RATIO 4
+
+/* swap PTE points to a disk slot rather than to a compressed entry */
+#define PTE_SWAP_DISK   ((pte_t)BIT_CONST(52))
+
+struct swap_entry {
+	int refcount;
+	size_t size;
+	uint8_t data[];
+};
+
+/* page we've copied to the cluster buffer, but not written yet */
+struct swap_candidate {
+	struct mm *mm;
+	unsigned long vma_seq;
+	virt_t addr;
+	pte_t pte;
+	struct page *page;
+};
+
+struct swap_control {
+	struct mm *self;
+	size_t count;
+	size_t freed;
+	size_t queued;
+	bool flush;
+};
+
+/* reclaim works with preemption disabled, so one buffer is enough */
+static uint8_t swap_buffer[SWAP_MAX_SIZE];
+
+/*
+ * Disk swap area: swap_map contains number of references to every slot,
+ * cluster buffer and candidates are protected by swap_mutex. Slots are
+ * only allocated under swap_mutex, but references are taken and dropped
+ * by page faults and munmap on any CPU, so they are atomic.
+ */
+static DEFINE_MUTEX(swap_mutex);
+static uint16_t *swap_map;
+static size_t swap_slots;
+static size_t swap_next_slot;
+static struct page *swap_cluster;
+static struct bio *swap_bio;
+static struct swap_candidate swap_queue[CONFIG_SWAP_CLUSTER_PAGES];
+
+static bool swap_disk(pte_t pte)
+{ return (pte & PTE_SWAP_DISK) != 0; }
+
+static pte_t swap_pte(struct swap_entry *entry)
+{ return ((pte_t)pa(entry) << PAGE_BITS) | PTE_SWAP; }
+
+static pte_t swap_slot_pte(size_t slot)
+{ return ((pte_t)slot << PAGE_BITS) | PTE_SWAP | PTE_SWAP_DISK; }
+
+static struct swap_entry *swap_entry(pte_t pte)
+{
+	DBG_ASSERT(pte_swap(pte) && !swap_disk(pte));
+	return va(pte >> PAGE_BITS);
+}
+
+static size_t swap_slot(pte_t pte)
+{
+	DBG_ASSERT(pte_swap(pte) && swap_disk(pte));
+	return (size_t)((pte & ~PTE_SWAP_DISK) >> PAGE_BITS);
+}
+
+static int swap_io(enum bio_dir dir, size_t slot, size_t count)
+{
+	struct bio *bio = swap_bio;
+
+	bio->dir = dir;
+	bio->status = BIO_NONE;
+	bio->map.page = swap_cluster;
+	bio->map.sector = CONFIG_SWAP_SECTOR +
+			(unsigned long long)slot * (PAGE_SIZE / SWAP_SECTOR_SIZE);
+	bio->map.offset = 0;
+	bio->map.length = count * PAGE_SIZE;
+
+	bio_submit(bio);
+	bio_wait(bio);
+
+	return bio->status == BIO_FINISHED ? 0 : -EIO;
+}
+
+static int swap_read_disk(size_t slot, struct page **pages, size_t count)
+{
+	DBG_ASSERT(count <= CONFIG_SWAP_CLUSTER_PAGES);
+
+	mutex_lock(&swap_mutex);
+
+	const int rc = swap_io(BIO_READ, slot, count);
+
+	if (!rc) {
+		const char *data = page_addr(swap_cluster);
+
+		for (size_t i = 0; i != count; ++i)
+			memcpy(page_addr(pages[i]), data + i * PAGE_SIZE,
+						PAGE_SIZE);
+	}
+	mutex_unlock(&swap_mutex);
+
+	return rc;
+}
+
+int swap_read(pte_t pte, struct page **pages, size_t count)
+{
+	if (swap_disk(pte))
+		return swap_read_disk(swap_slot(pte), pages, count);
+
+	DBG_ASSERT(count == 1);
+
+	struct swap_entry *entry = swap_entry(pte);
+	const size_t size = lz_decompress(entry->data, entry->size,
+				page_addr(pages[0]), PAGE_SIZE);
+
+	return size == PAGE_SIZE ? 0 : -EIO;
+}
+
+bool swap_adjacent(pte_t prev, pte_t next)
+{
+	if (!pte_swap(prev) || !pte_swap(next))
+		return false;
+
+	if (!swap_disk(prev) || !swap_disk(next))
+		return false;
+
+	return swap_slot(prev) + 1 == swap_slot(next);
+}
+
+void swap_dup(pte_t pte)
+{
+	if (swap_disk(pte))
+		__atomic_add_fetch(&swap_map[swap_slot(pte)], 1,
+					__ATOMIC_RELAXED);
+	else
+		__atomic_add_fetch(&swap_entry(pte)->refcount, 1,
+					__ATOMIC_RELAXED);
+}
+
+void swap_free(pte_t pte)
+{
+	if (swap_disk(pte)) {
+		const size_t slot = swap_slot(pte);
+		const uint16_t prev = __atomic_fetch_sub(&swap_map[slot], 1,
+					__ATOMIC_RELEASE);
+
+		DBG_ASSERT(prev != 0);
+		return;
+	}
+
+	struct swap_entry *entry = swap_entry(pte);
+
+	if (__atomic_sub_fetch(&entry->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+		kmem_free(entry);
+}
+
+static struct swap_entry *swap_store(struct page *page)
+{
+	const size_t size = lz_compress(page_addr(page), PAGE_SIZE,
+				swap_buffer, sizeof(swap_buffer));
+
+	/* doesn't compress well enough */
+	if (!size)
+		return 0;
+
+	struct swap_entry *entry = kmem_alloc(sizeof(*entry) + size);
+
+	if (!entry)
+		return 0;
+
+	entry->refcount = 1;
+	entry->size = size;
+	memcpy(entry->data, swap_buffer, size);
+	return entry;
+}
+
+/* copies page to the cluster buffer, it'll be written later */
+static void swap_queue_page(struct swap_control *ctl, struct mm *mm,
+			virt_t addr, pte_t pte, struct page *page)
+{
+	struct swap_candidate *cand = &swap_queue[ctl->queued];
+	char *data = page_addr(swap_cluster);
+
+	memcpy(data + ctl->queued * PAGE_SIZE, page_addr(page), PAGE_SIZE);
+	get_page(page);
+	cand->mm = get_mm(mm);
+	cand->vma_seq = mm->vma_seq;
+	cand->addr = addr;
+	cand->pte = pte;
+	cand->page = page;
+	++ctl->queued;
+}
+
+/*
+ * Clock algorithm: the first time we see an accessed page we just clear
+ * the accessed bit, so only pages not used since the last time we looked
+ * at them are swapped out.
+ */
+static void swap_out_pte(struct swap_control *ctl, struct mm *mm,
+			virt_t addr, pte_t *pte)
+{
+	if (!pte_present(*pte))
+		return;
+
+	struct page *page = pfn2page(pte_phys(*pte) >> PAGE_BITS);
+
+	/* the zero page, merged pages and pages shared after fork */
+	if (page_count(page) != 1)
+		return;
+
+	if (*pte & PTE_ACCESSED) {
+		*pte &= ~PTE_ACCESSED;
+		ctl->flush = true;
+		return;
+	}
+
+	struct swap_entry *entry = swap_store(page);
+
+	if (!entry) {
+		if (swap_slots && ctl->queued != CONFIG_SWAP_CLUSTER_PAGES)
+			swap_queue_page(ctl, mm, addr, *pte, page);
+		return;
+	}
+
+	/* swap pte still occupies the slot, so page tables stay as is */
+	*pte = swap_pte(entry);
+	ctl->flush = true;
+	++ctl->freed;
+	put_page(page);
+}
+
+static bool swap_done(const struct swap_control *ctl)
+{ return ctl->freed + ctl->queued >= ctl->count; }
+
+static void swap_scan_mm(struct swap_control *ctl, struct mm *mm)
+{
+	pte_t *pml4 = page_addr(mm->pt);
+	size_t scan = (ctl->count - ctl->freed) * SWAP_SCAN_RATIO;
+	virt_t addr = mm->swap_cursor;
+	bool wrapped = false;
+
+	while (scan && !swap_done(ctl)) {
+		struct vma *vma = find_vma(mm, addr);
+
+		if (!vma) {
+			if (wrapped)
+				break;
+			wrapped = true;
+			addr = 0;
+			continue;
+		}
+
+		/* file pages belong to the file */
+		if (vma->node || !(vma->perm & VMA_PERM_WRITE)) {
+			addr = vma->end;
+			continue;
+		}
+
+		const virt_t from = MAXU(addr, vma->begin);
+		struct pt_iter iter;
+
+		addr = vma->end;
+		for_each_slot_in_range(pml4, from, vma->end, iter) {
+			if (!scan || swap_done(ctl)) {
+				addr = iter.addr;
+				break;
+			}
+
+			--scan;
+			if (iter.level == 0)
+				swap_out_pte(ctl, mm, iter.addr,
+						&iter.pt[0][iter.idx[0]]);
+		}
+	}
+
+	mm->swap_cursor = addr;
+}
+
+/* next fit, returns the first slot and updates count with the run size */
+static size_t swap_alloc_slots(size_t *count)
+{
+	for (size_t i = 0; i != swap_slots; ++i) {
+		const size_t slot = (swap_next_slot + i) % swap_slots;
+		size_t len = 0;
+
+		/* free slot stays free, only we allocate */
+		while (len != *count && slot + len != swap_slots &&
+				!__atomic_load_n(&swap_map[slot + len],
+					__ATOMIC_ACQUIRE))
+			__atomic_store_n(&swap_map[slot + len++], 1,
+					__ATOMIC_RELAXED);
+
+		if (!len)
+			continue;
+
+		swap_next_slot = (slot + len) % swap_slots;
+		*count = len;
+		return slot;
+	}
+
+	*count = 0;
+	return 0;
+}
+
+/*
+ * The page might have been used or unmapped while we were writing it, in
+ * that case it has to stay where it is.
+ */
+static bool swap_replace(struct swap_control *ctl,
+			struct swap_candidate *cand, size_t slot)
+{
+	struct mm *mm = cand->mm;
+
+	if (mm != ctl->self && !mm_pt_trylock_scan(mm))
+		return false;
+
+	pte_t *pte = mm->vma_seq == cand->vma_seq
+			? pt_lookup_pte(page_addr(mm->pt), cand->addr) : 0;
+
+	/* the reference from the candidate and the one from the pte */
+	const bool ok = pte && *pte == cand->pte &&
+				page_count(cand->page) == 2;
+
+	if (ok) {
+		*pte = swap_slot_pte(slot);
+		put_page(cand->page);
+	}
+
+	if (mm != ctl->self)
+		mm_pt_unlock_scan(mm);
+	return ok;
+}
+
+static void swap_write_queue(struct swap_control *ctl)
+{
+	size_t written = ctl->queued;
+	bool enabled = local_preempt_save();
+	const size_t slot = swap_alloc_slots(&written);
+
+	local_preempt_restore(enabled);
+
+	const bool ok = written && swap_io(BIO_WRITE, slot, written) == 0;
+
+	enabled = local_preempt_save();
+	for (size_t i = 0; i != ctl->queued; ++i) {
+		struct swap_candidate *cand = &swap_queue[i];
+
+		if (ok && i < written && swap_replace(ctl, cand, slot + i)) {
+			ctl->flush = true;
+			++ctl->freed;
+		} else if (i < written) {
+			__atomic_store_n(&swap_map[slot + i], 0,
+						__ATOMIC_RELEASE);
+		}
+
+		put_page(cand->page);
+		put_mm(cand->mm);
+	}
+
+	ctl->queued = 0;
+	if (ctl->flush)
+		flush_tlb_all();
+	local_preempt_restore(enabled);
+}
+
+size_t swap_reclaim(size_t count)
+{
+	struct swap_control ctl;
+	struct mm *mm = 0;
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.self = current()->mm;
+	ctl.count = count;
+
+	mutex_lock(&swap_mutex);
+
+	const bool enabled = local_preempt_save();
+
+	while (!swap_done(&ctl) && (mm = next_mm(mm))) {
+		/* page tables are being changed right now, leave it alone */
+		if (mm == ctl.self) {
+			swap_scan_mm(&ctl, mm);
+		} else if (mm_pt_trylock_scan(mm)) {
+			swap_scan_mm(&ctl, mm);
+			mm_pt_unlock_scan(mm);
+		}
+	}
+
+	if (mm)
+		put_mm(mm);
+
+	if (ctl.flush)
+		flush_tlb_all();
+	local_preempt_restore(enabled);
+
+	/* pages that don't compress go to the disk */
+	if (ctl.queued) {
+		ctl.flush = false;
+		swap_write_queue(&ctl);
+	}
+	mutex_unlock(&swap_mutex);
+
+	return ctl.freed;
+}
+
+static int swap_order(size_t size)
+{
+	int order = 0;
+
+	while (((size_t)PAGE_SIZE << order) < size)
+		++order;
+	return order;
+}
+
+/* returns number of usable slots, slot 0 holds the header */
+static size_t swap_check_area(void)
+{
+	const unsigned long long sectors =
+				(unsigned long long)CONFIG_SWAP_PAGES *
+				(PAGE_SIZE / SWAP_SECTOR_SIZE);
+
+	if (ide_capacity() < CONFIG_SWAP_SECTOR + sectors) {
+		DBG_ERR("swap: area doesn't fit the disk of %lu sectors",
+					(unsigned long)ide_capacity());
+		return 0;
+	}
+
+	mutex_lock(&swap_mutex);
+
+	const int rc = swap_io(BIO_READ, 0, 1);
+
+	mutex_unlock(&swap_mutex);
+
+	const char *data = page_addr(swap_cluster);
+	const struct swap_header *hdr = (const void *)data;
+
+	if (rc || memcmp(data + PAGE_SIZE - SWAP_MAGIC_SIZE, SWAP_MAGIC,
+				SWAP_MAGIC_SIZE)) {
+		DBG_ERR("swap: no swap signature at sector %lu",
+					(unsigned long)CONFIG_SWAP_SECTOR);
+		return 0;
+	}
+
+	return MINU((size_t)hdr->last_page + 1, (size_t)CONFIG_SWAP_PAGES);
+}
+
+void setup_swap(void)
+{
+	const size_t size = CONFIG_SWAP_PAGES * sizeof(*swap_map);
+
+	if (!CONFIG_SWAP_PAGES)
+		return;
+
+	struct page *map = alloc_pages(swap_order(size));
+
+	swap_cluster = alloc_pages(swap_order(
+				CONFIG_SWAP_CLUSTER_PAGES * PAGE_SIZE));
+	swap_bio = bio_alloc();
+
+	const size_t slots = map && swap_cluster && swap_bio
+				? swap_check_area() : 0;
+
+	if (slots < 2) {
+		DBG_ERR("failed to setup disk swap");
+		if (map)
+			free_pages(map, swap_order(size));
+		if (swap_cluster)
+			free_pages(swap_cluster, swap_order(
+					CONFIG_SWAP_CLUSTER_PAGES * PAGE_SIZE));
+		if (swap_bio)
+			bio_free(swap_bio);
+		swap_cluster = 0;
+		swap_bio = 0;
+		return;
+	}
+
+	swap_map = page_addr(map);
+	memset(swap_map, 0, size);
+	/* never allocated, so the header is never overwritten */
+	swap_map[0] = 1;
+	swap_slots = slots;
+	swap_next_slot = 1;
+	DBG_INFO("swap: %lu pages starting from sector %lu",
+				(unsigned long)swap_slots,
+				(unsigned long)CONFIG_SWAP_SECTOR);
+}
@@ -0,0 +1,39 @@
+#ifndef __SWAP_H__
+#define __SWAP_H__
+
+#include "paging.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+/*
+ * Anonymous pages are swapped out to a compressed in memory store or, if
+ * they don't compress well, to the swap area on the disk. PTE of a swapped
+ * out page isn't present and has PTE_SWAP set, the rest of it tells where
+ * the page is. Swap entries are refcounted, since page tables with swapped
+ * out pages might be copied on fork.
+ */
+
+/*
+ * Reads count swap entries starting from pte into pages, count greater
+ * than 1 is only allowed for entries in adjacent disk slots (see
+ * swap_adjacent) and must not exceed CONFIG_SWAP_CLUSTER_PAGES.
+ */
+int swap_read(pte_t pte, struct page **pages, size_t count);
+
+/* returns true if next is stored on the disk right after prev */
+bool swap_adjacent(pte_t prev, pte_t next);
+
+void swap_dup(pte_t pte);
+void swap_free(pte_t pte);
+
+/*
+ * Tries to swap out up to count pages, returns number of freed pages,
+ * might sleep waiting for the disk.
+ */
+size_t swap_reclaim(size_t count);
+
+void setup_swap(void);
+
+#endif /*__SWAP_H__*/
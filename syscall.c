@@ -1,9 +1,13 @@
 #include "syscall.h"
 #include "threads.h"
 #include "stdio.h"
+#include "error.h"
 #include "exec.h"
+#include "vfs.h"
+#include "mm.h"
 
 #include <stddef.h>
+#include <stdint.h>
 
 static int write(const char *data, size_t size)
 {
@@ -12,11 +16,68 @@ static int write(const char *data, size_t size)
 	return 0;
 }
 
+static intptr_t sys_mmap(size_t size, int perm)
+{
+	if (!size || size > TASK_SIZE)
+		return -EINVAL;
+
+	struct mm *mm = current()->mm;
+	const virt_t addr = get_unmapped_area(mm, size, PAGE_SIZE);
+
+	if (!addr)
+		return -ENOMEM;
+
+	const int rc = __mmap(mm, addr, addr + ALIGN_CONST(size, PAGE_SIZE),
+				perm & VMA_PERM_WRITE);
+
+	return rc ? rc : (intptr_t)addr;
+}
+
+/* perm takes VMA_PERM_WRITE and VMA_PERM_SHARED */
+static intptr_t sys_mmap_file(const char *name, size_t offset, size_t size,
+			int perm)
+{
+	if (!size || size > TASK_SIZE)
+		return -EINVAL;
+
+	struct fs_file file;
+	int rc = vfs_open(name, &file);
+
+	if (rc)
+		return rc;
+
+	struct mm *mm = current()->mm;
+	const virt_t addr = get_unmapped_area(mm, size, PAGE_SIZE);
+
+	if (addr)
+		rc = __mmap_file(mm, addr, addr + ALIGN_CONST(size, PAGE_SIZE),
+					perm & (VMA_PERM_WRITE | VMA_PERM_SHARED),
+					&file, offset);
+	else
+		rc = -ENOMEM;
+	vfs_release(&file);
+
+	return rc ? rc : (intptr_t)addr;
+}
+
+static int sys_munmap(virt_t addr, size_t size)
+{
+	if ((addr & PAGE_MASK) || addr + size > TASK_SIZE || addr + size < addr)
+		return -EINVAL;
+
+	return munmap(addr, addr + ALIGN_CONST(size, PAGE_SIZE));
+}
+
 syscall_t syscall_table[MAX_SYSCALL_NR] = {
 	(syscall_t)write,
 	(syscall_t)getpid,
 	(syscall_t)exit,
 	(syscall_t)wait,
 	(syscall_t)fork,
-	(syscall_t)exec
+	(syscall_t)exec,
+	(syscall_t)sys_mmap,
+	(syscall_t)sys_munmap,
+	(syscall_t)spawn,
+	(syscall_t)vfork,
+	(syscall_t)sys_mmap_file
 };
@@ -1,7 +1,7 @@
 #ifndef __SYSCALL_H__
 #define __SYSCALL_H__
 
-#define MAX_SYSCALL_NR 10 // 10 is enough so far
+#define MAX_SYSCALL_NR 16
 
 #ifndef __ASM_FILE__
 
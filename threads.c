@@ -5,8 +5,10 @@
 #include "string.h"
 #include "paging.h"
 #include "error.h"
+#include "exec.h"
 #include "stdio.h"
 #include "time.h"
+#include "smp.h"
 #include "mm.h"
 
 #include <stdint.h>
@@ -39,26 +41,11 @@ struct thread_iter {
 	struct thread *thread;
 };
 
-#define IO_MAP_BITS  BIT_CONST(16)
-#define IO_MAP_WORDS (IO_MAP_BITS / sizeof(unsigned long))
-
-struct tss {
-	uint32_t rsrv0;
-	uint64_t rsp[3];
-	uint64_t rsrv1;
-	uint64_t ist[7];
-	uint64_t rsrv2;
-	uint16_t rsrv3;
-	uint16_t iomap_base;
-	unsigned long iomap[IO_MAP_WORDS + 1];
-} __attribute__((packed));
-
-static struct thread *current_thread;
 static struct thread bootstrap;
 static DEFINE_SPINLOCK(threads_lock);
 static struct rb_tree threads;
 static struct scheduler *scheduler;
-static struct tss tss __attribute__((aligned (PAGE_SIZE)));
+extern struct scheduler rt_scheduler;
 
 static void check_stack(struct thread *thread)
 {
@@ -76,16 +63,112 @@ static void check_stack(struct thread *thread)
 	}
 }
 
-void idle(void)
-{ while (1) schedule(); }
+static struct scheduler *policy_scheduler(const struct thread *thread)
+{ return thread->policy == SCHED_NORMAL ? scheduler : &rt_scheduler; }
+
+static void block_thread(struct thread *thread)
+{
+	if (thread->sched->block)
+		thread->sched->block(thread);
+}
+
+static bool cpu_is_idle(const struct cpu *cpu)
+{ return __atomic_load_n(&cpu->current, __ATOMIC_RELAXED) == cpu->idle; }
+
+/*
+ * The thread might exit and be freed while we look at it, kmem_cache
+ * memory stays mapped though, so the worst case is a useless IPI.
+ */
+static bool cpu_runs_normal(const struct cpu *cpu)
+{
+	const struct thread *thread = __atomic_load_n(&cpu->current,
+				__ATOMIC_RELAXED);
 
+	return thread != cpu->idle &&
+		__atomic_load_n(&thread->policy, __ATOMIC_RELAXED) ==
+				SCHED_NORMAL;
+}
+
+/*
+ * Halted CPU only wakes up on an interrupt: kick the CPU the thread was
+ * queued on if it's idle, otherwise some idle CPU that can steal it. RT
+ * thread must not wait for the next tick behind a SCHED_NORMAL thread,
+ * the IPI makes the CPU check need_resched on the way out.
+ */
+static void kick_cpu(struct cpu *cpu, const struct thread *thread)
+{
+	const bool enabled = local_preempt_save();
+	struct cpu *self = this_cpu();
+
+	/* pairs with the fence in idle_halt */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (cpu_is_idle(cpu)) {
+		if (cpu != self)
+			smp_send_reschedule(cpu);
+	} else if (cpu != self && thread->policy != SCHED_NORMAL &&
+				cpu_runs_normal(cpu)) {
+		smp_send_reschedule(cpu);
+	} else if (!cpu_is_idle(self)) {
+		for (int i = 0; i != cpu_count(); ++i) {
+			struct cpu *other = &cpus[i];
+
+			if (other != cpu && other != self &&
+						cpu_is_idle(other)) {
+				smp_send_reschedule(other);
+				break;
+			}
+		}
+	}
+	local_preempt_restore(enabled);
+}
+
+static void enqueue_thread(struct cpu *cpu, struct thread *thread)
+{
+	struct runqueue *rq = &cpu->rq;
+	const bool enabled = spin_lock_irqsave(&rq->lock);
+
+	thread->sched = policy_scheduler(thread);
+	thread->sched->activate(rq, thread);
+	++rq->nr_running;
+	spin_unlock_irqrestore(&rq->lock, enabled);
+	kick_cpu(cpu, thread);
+}
+
+/*
+ * Thread that stopped running is either queued back on this CPU or, if it
+ * blocked, leaves the runqueue and the next wakeup queues it again. If its
+ * policy changed it leaves the old class as if it blocked.
+ */
 static void preempt_thread(struct thread *thread)
 {
-	if (thread == &bootstrap)
+	struct cpu *cpu = this_cpu();
+
+	if (thread == cpu->idle)
 		return;
 
-	if (scheduler->preempt)
-		scheduler->preempt(thread);
+	const bool locked = spin_lock_irqsave(&thread->lock);
+
+	if (thread->state == THREAD_ACTIVE) {
+		struct scheduler *sched = policy_scheduler(thread);
+		struct runqueue *rq = &cpu->rq;
+		const bool enabled = spin_lock_irqsave(&rq->lock);
+
+		if (sched != thread->sched) {
+			block_thread(thread);
+			thread->sched = sched;
+			sched->activate(rq, thread);
+		} else if (sched->preempt) {
+			sched->preempt(rq, thread);
+		} else {
+			sched->activate(rq, thread);
+		}
+		++rq->nr_running;
+		spin_unlock_irqrestore(&rq->lock, enabled);
+	} else {
+		block_thread(thread);
+		thread->on_rq = false;
+	}
+	spin_unlock_irqrestore(&thread->lock, locked);
 }
 
 static size_t thread_stack_size(void)
@@ -111,28 +194,86 @@ void *thread_stack_end(struct thread *thread)
 	return (char *)thread_stack_begin(thread) + thread_stack_size();
 }
 
-static void place_thread(struct thread *thread)
+/*
+ * The local timer fires for the earliest timer or when the running thread
+ * might need preemption. Idle CPU only needs it for timers. Busy CPU still
+ * checks at least once per jiffy, since nothing tells it about threads
+ * queued from elsewhere. Zero slice means the thread is already due for
+ * preemption, so the timer is programmed with the minimum delta.
+ */
+static void program_tick(struct cpu *cpu, struct thread *thread)
 {
-	struct thread *prev = current_thread;
+	const unsigned long long timer = timer_next_event();
 
-	if (prev != &bootstrap)
-		check_stack(prev);
+	if (thread == cpu->idle) {
+		clockevent_program(timer);
+		return;
+	}
 
-	current_thread = thread;
+	struct runqueue *rq = &cpu->rq;
+	const bool enabled = spin_lock_irqsave(&rq->lock);
+	const unsigned long long slice = thread->sched->slice
+				? thread->sched->slice(rq, thread)
+				: SCHED_SLICE_NONE;
 
-	store_pml4(page_paddr(current_thread->mm->pt));
-	tss.rsp[0] = (uint64_t)thread_stack_end(current_thread);
+	spin_unlock_irqrestore(&rq->lock, enabled);
+	clockevent_program(MINU(timer, MINU(slice, NSEC_PER_JIFFY)));
+}
 
-	if (prev->state == THREAD_FINISHED)
-		prev->state = THREAD_DEAD;
+void scheduler_tick(void)
+{
+	const bool enabled = local_preempt_save();
+	struct cpu *cpu = this_cpu();
 
-	if (thread == &bootstrap)
-		return;
+	program_tick(cpu, cpu->current);
+	local_preempt_restore(enabled);
+}
+
+static void place_thread(struct thread *thread)
+{
+	struct cpu *cpu = this_cpu();
+	struct thread *prev = cpu->current;
+
+	if (prev != &bootstrap)
+		check_stack(prev);
 
-	if (scheduler->place)
-		scheduler->place(thread);
+	cpu->current = thread;
+	thread->cpu = cpu;
+
+	switch_mm(prev->mm, thread->mm);
+	cpu->tss.rsp[0] = (uint64_t)thread_stack_end(thread);
+
+	/* once prev is off cpu it might be reaped or run elsewhere */
+	const bool finished = prev->state == THREAD_FINISHED;
+
+	__atomic_store_n(&prev->on_cpu, false, __ATOMIC_RELEASE);
+	if (finished)
+		__atomic_store_n(&prev->state, THREAD_DEAD, __ATOMIC_RELEASE);
+
+	const unsigned long long now = ktime_get_ns();
+
+	if (prev == cpu->idle || thread == cpu->idle) {
+		/* odd sequence tells cpu_idle_ns to retry */
+		__atomic_store_n(&cpu->idle_seq, cpu->idle_seq + 1,
+					__ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		if (prev == cpu->idle)
+			__atomic_store_n(&cpu->idle_ns, cpu->idle_ns + now -
+					cpu->idle_start, __ATOMIC_RELAXED);
+		__atomic_store_n(&cpu->idle_start,
+					thread == cpu->idle ? now : 0,
+					__ATOMIC_RELAXED);
+		__atomic_store_n(&cpu->idle_seq, cpu->idle_seq + 1,
+					__ATOMIC_RELEASE);
+	}
+
+	if (thread != cpu->idle) {
+		if (thread->sched->place)
+			thread->sched->place(thread);
+		thread->time = now;
+	}
 
-	thread->time = jiffies();
+	program_tick(cpu, thread);
 }
 
 int thread_entry(struct thread *thread, int (*fptr)(void *),
@@ -199,41 +340,65 @@ static void register_thread(struct thread *thread)
 	while (__lookup_thread(&iter, thread_pid(thread)))
 		thread->pid = next_pid++;
 
+	struct thread *parent = current();
+
+	thread->parent = parent;
+	list_add_tail(&thread->sibling, &parent->children);
+
 	rb_link(&thread->node, iter.parent, iter.plink);
 	rb_insert(&thread->node, &threads);
 	spin_unlock_irqrestore(&threads_lock, enabled);
 }
 
-static struct thread *alloc_thread(void)
+/* takes ownership of mm, if mm is 0 creates a new empty one */
+static struct thread *alloc_thread(struct mm *mm)
 {
 	const size_t stack_order = KERNEL_STACK_ORDER;
 	const size_t stack_pages = (size_t)1 << stack_order;
 	const size_t stack_size = stack_pages << PAGE_BITS;
 
+	if (!mm)
+		mm = create_mm();
+
+	if (!mm)
+		return 0;
+
 	struct page *stack = alloc_pages(stack_order);
 
-	if (!stack)
+	if (!stack) {
+		put_mm(mm);
 		return 0;
+	}
 
 	struct thread *thread = scheduler->alloc();
 
 	if (!thread) {
 		free_pages(stack, stack_order);
+		put_mm(mm);
 		return 0;
 	}
 
-	thread->mm = create_mm();
-	if (!thread->mm) {
-		scheduler->free(thread);
-		free_pages(stack, stack_order);
-		return 0;
-	}
+	thread->mm = mm;
+	thread->vfork = false;
+	thread->parent = 0;
+	list_init(&thread->children);
+	list_init(&thread->sibling);
+	wait_queue_init(&thread->exit_wq);
+	wait_queue_init(&thread->child_wq);
 
 	spinlock_init(&thread->lock);
 	thread->refcount = 1; // one for wait
 	thread->stack = stack;
 	thread->state = THREAD_BLOCKED;
 	thread->pid = -1;
+	thread->nice = 0;
+	thread->policy = SCHED_NORMAL;
+	thread->rt_priority = 0;
+	list_init(&thread->rt_link);
+	thread->sched = scheduler;
+	thread->cpu = 0;
+	thread->on_rq = false;
+	thread->on_cpu = false;
 
 	memset(thread_stack_begin(thread), 0, stack_size);
 	thread->stack_pointer = thread_stack_end(thread);
@@ -246,7 +411,7 @@ static pid_t __create_thread(int (*fptr)(void *), void *arg)
 	const size_t frame_size = sizeof(struct thread_start_frame);
 	extern void __thread_entry(void);
 
-	struct thread *thread = alloc_thread();
+	struct thread *thread = alloc_thread(0);
 
 	if (!thread)
 		return -ENOMEM;
@@ -278,10 +443,8 @@ static pid_t __create_thread(int (*fptr)(void *), void *arg)
 	return thread_pid(thread);
 }
 
-pid_t create_kthread(int (*fptr)(void *), void *arg)
+static pid_t start_thread(pid_t pid)
 {
-	const pid_t pid = __create_thread(fptr, arg);
-
 	if (pid < 0)
 		return pid;
 
@@ -294,23 +457,28 @@ pid_t create_kthread(int (*fptr)(void *), void *arg)
 	return pid;
 }
 
-static pid_t __fork(void)
+pid_t create_kthread(int (*fptr)(void *), void *arg)
 {
-	const size_t frame_size = sizeof(struct thread_start_frame);
-	extern void __jump_to_userspace(void);
-	extern void __thread_entry(void);
+	return start_thread(__create_thread(fptr, arg));
+}
 
-	struct thread *thread = alloc_thread();
+/* idle thread of a secondary CPU, the CPU starts on its stack */
+struct thread *create_idle_thread(void)
+{
+	struct thread *thread = alloc_thread(0);
 
 	if (!thread)
-		return -ENOMEM;
+		return 0;
 
-	const int rc = copy_mm(thread->mm, current()->mm);
+	thread->state = THREAD_ACTIVE;
+	return thread;
+}
 
-	if (rc)	{
-		put_thread(thread);
-		return rc;
-	}
+/* new thread returns to userspace with regs */
+static struct thread_start_frame *user_thread_frame(struct thread *thread)
+{
+	const size_t frame_size = sizeof(struct thread_start_frame);
+	extern void __thread_entry(void);
 
 	struct thread_start_frame *frame =
 		(void *)((char *)thread_stack_end(thread) - frame_size);
@@ -320,10 +488,33 @@ static pid_t __fork(void)
 	frame->frame.r14 = 0;
 	frame->frame.r13 = 0;
 
+	thread->stack_pointer = frame;
+	return frame;
+}
+
+static pid_t __fork(bool share)
+{
+	struct mm *mm = current()->mm;
+	struct thread *thread = alloc_thread(share ? get_mm(mm) : 0);
+
+	if (!thread)
+		return -ENOMEM;
+
+	if (!share) {
+		const int rc = copy_mm(thread->mm, mm);
+
+		if (rc)	{
+			put_thread(thread);
+			return rc;
+		}
+	}
+
+	struct thread_start_frame *frame = user_thread_frame(thread);
+
 	frame->regs = *thread_regs(current());
 	frame->regs.rax = 0; // syscall return value for child process
 
-	thread->stack_pointer = frame;
+	thread->vfork = share;
 	register_thread(thread);
 
 	return thread_pid(thread);
@@ -331,7 +522,16 @@ static pid_t __fork(void)
 
 pid_t fork(void)
 {
-	pid_t pid = __fork();
+	return start_thread(__fork(false));
+}
+
+/*
+ * Child borrows our address space instead of copying it, so we must not
+ * return to userspace until the child calls exec or exit.
+ */
+pid_t vfork(void)
+{
+	const pid_t pid = __fork(true);
 
 	if (pid < 0)
 		return pid;
@@ -341,10 +541,47 @@ pid_t fork(void)
 	DBG_ASSERT(thread != 0);
 
 	activate_thread(thread);
+	WAIT_EVENT(&thread->exit_wq, !__atomic_load_n(&thread->vfork,
+				__ATOMIC_ACQUIRE));
 	put_thread(thread);
 	return pid;
 }
 
+/* the child doesn't use our address space anymore, see vfork */
+void vfork_done(struct thread *thread)
+{
+	if (!thread->vfork)
+		return;
+
+	__atomic_store_n(&thread->vfork, false, __ATOMIC_RELEASE);
+	wait_queue_notify_all(&thread->exit_wq);
+}
+
+static pid_t __spawn(int argc, const char **argv)
+{
+	struct thread *thread = alloc_thread(0);
+
+	if (!thread)
+		return -ENOMEM;
+
+	struct thread_start_frame *frame = user_thread_frame(thread);
+	const int rc = exec_mm(thread->mm, &frame->regs, argc, argv);
+
+	if (rc) {
+		put_thread(thread);
+		return rc;
+	}
+
+	register_thread(thread);
+	return thread_pid(thread);
+}
+
+/* fork + exec, but without copying our address space */
+pid_t spawn(int argc, const char **argv)
+{
+	return start_thread(__spawn(argc, argv));
+}
+
 /*
  * every thread in kernel except dying one has thread_regs at the top of
  * the stack - this is contract!!!
@@ -356,12 +593,18 @@ struct thread_regs *thread_regs(struct thread *thread)
 	return (void *)(stack_end - sizeof(struct thread_regs));
 }
 
+/* finished thread is notified about before its last switch completes */
+static void wait_dead(struct thread *thread)
+{
+	while (__atomic_load_n(&thread->state, __ATOMIC_ACQUIRE) ==
+				THREAD_FINISHED)
+		cpu_relax();
+}
+
 static void __wait_thread(struct thread *thread)
 {
-	while (thread->state != THREAD_DEAD) {
-		barrier();
-		schedule();
-	}
+	WAIT_EVENT(&thread->exit_wq, thread->state >= THREAD_FINISHED);
+	wait_dead(thread);
 }
 
 static int reap_thread(struct thread *thread)
@@ -377,7 +620,11 @@ static int reap_thread(struct thread *thread)
 
 	locked = spin_lock_irqsave(&threads_lock);
 	rb_erase(&thread->node, &threads);
-	spin_unlock_irqrestore(&threads_lock, locked);	
+	if (thread->parent) {
+		list_del(&thread->sibling);
+		thread->parent = 0;
+	}
+	spin_unlock_irqrestore(&threads_lock, locked);
 	put_thread(thread);
 
 	return 1;
@@ -399,33 +646,219 @@ int wait(pid_t pid)
 	return rc;
 }
 
+static struct thread *find_finished_child(struct thread *thread)
+{
+	struct list_head *head = &thread->children;
+
+	for (struct list_head *ptr = head->next; ptr != head; ptr = ptr->next) {
+		struct thread *child = LIST_ENTRY(ptr, struct thread, sibling);
+
+		if (child->state >= THREAD_FINISHED)
+			return child;
+	}
+	return 0;
+}
+
+/*
+ * Children list is checked and we get on the wait queue under
+ * threads_lock, exiting child notifies under it too, so the wakeup can't
+ * be missed.
+ */
+static struct thread *wait_child(struct thread *self)
+{
+	struct wait_head wh;
+
+	wh.thread = self;
+	while (1) {
+		bool enabled = spin_lock_irqsave(&threads_lock);
+		struct thread *child = find_finished_child(self);
+
+		if (child || list_empty(&self->children)) {
+			if (child)
+				get_thread(child);
+			spin_unlock_irqrestore(&threads_lock, enabled);
+			return child;
+		}
+
+		const bool locked = spin_lock_irqsave(&self->child_wq.lock);
+
+		self->state = THREAD_BLOCKED;
+		list_add_tail(&wh.link, &self->child_wq.threads);
+		spin_unlock_irqrestore(&self->child_wq.lock, locked);
+		spin_unlock_irqrestore(&threads_lock, enabled);
+
+		schedule();
+
+		enabled = spin_lock_irqsave(&self->child_wq.lock);
+		list_del(&wh.link);
+		spin_unlock_irqrestore(&self->child_wq.lock, enabled);
+	}
+}
+
+pid_t wait_any(void)
+{
+	struct thread *self = current();
+	struct thread *child;
+
+	/* somebody might reap the child with wait before us */
+	while ((child = wait_child(self)) != 0) {
+		const pid_t pid = thread_pid(child);
+
+		wait_dead(child);
+
+		const bool reaped = reap_thread(child);
+
+		put_thread(child);
+		if (reaped)
+			return pid;
+	}
+	return -ENOENT;
+}
+
+/*
+ * Woken thread goes back to the CPU it ran on, its cache might still be
+ * warm there, unless the waker's CPU is less loaded. A new thread starts
+ * on the CPU of its creator, load balancing moves it later if needed.
+ */
+static struct cpu *select_cpu(struct thread *thread)
+{
+	struct cpu *waker = this_cpu();
+	struct cpu *last = thread->cpu;
+
+	if (!last || last == waker)
+		return waker;
+
+	const int last_load = __atomic_load_n(&last->rq.nr_running,
+				__ATOMIC_RELAXED);
+	const int waker_load = __atomic_load_n(&waker->rq.nr_running,
+				__ATOMIC_RELAXED);
+
+	return last_load <= waker_load ? last : waker;
+}
+
 void activate_thread(struct thread *thread)
 {
 	const bool locked = spin_lock_irqsave(&thread->lock);
 
-	DBG_ASSERT(thread != &bootstrap);
+	DBG_ASSERT(thread != this_cpu()->idle);
 
 	if (thread->state == THREAD_BLOCKED) {
 		thread->state = THREAD_ACTIVE;
-		scheduler->activate(thread);
+
+		/* still on its CPU, preempt_thread will queue it */
+		if (!thread->on_rq) {
+			thread->on_rq = true;
+			enqueue_thread(select_cpu(thread), thread);
+		}
 	}
 	spin_unlock_irqrestore(&thread->lock, locked);
 }
 
+static void wakeup_timer_fn(struct timer *timer)
+{
+	struct wakeup_timer *wakeup = CONTAINER_OF(timer, struct wakeup_timer,
+				timer);
+
+	activate_thread(wakeup->thread);
+}
+
+void wakeup_timer_init(struct wakeup_timer *timer, unsigned long long timeout)
+{
+	timer_init(&timer->timer, &wakeup_timer_fn);
+	timer->thread = current();
+	timer->deadline = ktime_get_ns() + timeout;
+}
+
+bool wakeup_timer_expired(const struct wakeup_timer *timer)
+{ return ktime_get_ns() >= timer->deadline; }
+
+void wakeup_timer_arm(struct wakeup_timer *timer)
+{ timer_add(&timer->timer, timer->deadline); }
+
+void wakeup_timer_cancel(struct wakeup_timer *timer)
+{ timer_del(&timer->timer); }
+
+void thread_sleep_ns(unsigned long long ns)
+{
+	struct wakeup_timer timer;
+
+	wakeup_timer_init(&timer, ns);
+	while (!wakeup_timer_expired(&timer)) {
+		const bool enabled = local_preempt_save();
+
+		/* preempted after this the thread just stays blocked */
+		current()->state = THREAD_BLOCKED;
+		wakeup_timer_arm(&timer);
+		local_preempt_restore(enabled);
+		schedule();
+	}
+	wakeup_timer_cancel(&timer);
+}
+
+void set_thread_nice(struct thread *thread, int nice)
+{
+	const bool locked = spin_lock_irqsave(&thread->lock);
+
+	thread->nice = (int)MIN(MAX(nice, MIN_NICE), MAX_NICE);
+	spin_unlock_irqrestore(&thread->lock, locked);
+}
+
+int set_thread_scheduler(struct thread *thread, enum sched_policy policy,
+			int priority)
+{
+	if (policy == SCHED_NORMAL && priority != 0)
+		return -EINVAL;
+
+	if (priority < 0 || priority >= MAX_RT_PRIO)
+		return -EINVAL;
+
+	const bool locked = spin_lock_irqsave(&thread->lock);
+
+	thread->policy = policy;
+	thread->rt_priority = priority;
+	spin_unlock_irqrestore(&thread->lock, locked);
+	return 0;
+}
+
+/* orphans our children and wakes up everybody waiting for us */
+static void exit_notify(struct thread *thread)
+{
+	const bool enabled = spin_lock_irqsave(&threads_lock);
+
+	while (!list_empty(&thread->children)) {
+		struct thread *child = LIST_ENTRY(list_first(&thread->children),
+					struct thread, sibling);
+
+		list_del(&child->sibling);
+		list_init(&child->sibling);
+		child->parent = 0;
+	}
+
+	if (thread->parent)
+		wait_queue_notify_all(&thread->parent->child_wq);
+	spin_unlock_irqrestore(&threads_lock, enabled);
+
+	wait_queue_notify_all(&thread->exit_wq);
+}
+
 void exit(void)
 {
+	struct thread *thread = current();
+
 	local_preempt_disable();
-	current_thread->state = THREAD_FINISHED;
+	__atomic_store_n(&thread->vfork, false, __ATOMIC_RELEASE);
+	thread->state = THREAD_FINISHED;
+	exit_notify(thread);
 	schedule();
 	DBG_ASSERT(0 && "Unreachable");
 }
 
 struct thread *current(void)
-{ return current_thread; }
+{ return this_cpu_current(); }
 
 static void release_thread(struct thread *thread)
 {
-	release_mm(thread->mm);
+	put_mm(thread->mm);
 	free_pages(thread->stack, KERNEL_STACK_ORDER);
 	scheduler->free(thread);
 }
@@ -451,98 +884,213 @@ void put_thread(struct thread *thread)
 
 static void switch_to(struct thread *next)
 {
-	struct thread *prev = current_thread;
+	struct thread *prev = current();
 
 	void switch_threads(void **prev, void *next);
 
+	/* next might be still switching out on another CPU */
+	while (__atomic_load_n(&next->on_cpu, __ATOMIC_ACQUIRE))
+		cpu_relax();
+	next->on_cpu = true;
+
 	preempt_thread(prev);
 	switch_threads(&prev->stack_pointer, next->stack_pointer);
 	place_thread(prev);
 }
 
+static struct cpu *busiest_cpu(struct cpu *self)
+{
+	struct cpu *busiest = 0;
+	int max_load = 0;
+
+	for (int i = 0; i != cpu_count(); ++i) {
+		struct cpu *cpu = &cpus[i];
+		const int load = __atomic_load_n(&cpu->rq.nr_running,
+					__ATOMIC_RELAXED);
+
+		if (cpu != self && load > max_load) {
+			busiest = cpu;
+			max_load = load;
+		}
+	}
+	return busiest;
+}
+
+static struct thread *steal_thread(struct cpu *from)
+{
+	struct runqueue *rq = &from->rq;
+	const bool enabled = spin_lock_irqsave(&rq->lock);
+	struct thread *thread = rt_scheduler.steal(rq);
+
+	if (!thread)
+		thread = scheduler->steal(rq);
+
+	if (thread)
+		--rq->nr_running;
+	spin_unlock_irqrestore(&rq->lock, enabled);
+
+	return thread;
+}
+
+/*
+ * Periodically pull a thread from the busiest CPU if it has at least two
+ * threads more than we do, so queues don't stay unbalanced while nobody
+ * is idle.
+ */
+static void balance_cpu(struct cpu *cpu)
+{
+	struct runqueue *rq = &cpu->rq;
+	const unsigned long long now = jiffies();
+
+	if ((now - rq->balanced) * 1000 < CONFIG_SCHED_BALANCE_MS * HZ)
+		return;
+
+	rq->balanced = now;
+
+	struct cpu *busiest = busiest_cpu(cpu);
+
+	if (!busiest || busiest->rq.nr_running < rq->nr_running + 2)
+		return;
+
+	struct thread *thread = steal_thread(busiest);
+
+	if (thread)
+		enqueue_thread(cpu, thread);
+}
+
 static struct thread *next_thread(void)
-{ return scheduler->next(); }
+{
+	struct cpu *cpu = this_cpu();
+	struct runqueue *rq = &cpu->rq;
+
+	balance_cpu(cpu);
+
+	const bool enabled = spin_lock_irqsave(&rq->lock);
+	struct thread *thread = rt_scheduler.next(rq);
+
+	if (!thread)
+		thread = scheduler->next(rq);
+
+	if (thread)
+		--rq->nr_running;
+	spin_unlock_irqrestore(&rq->lock, enabled);
+
+	if (thread)
+		return thread;
+
+	/* nothing to do here, help the busiest CPU */
+	struct cpu *busiest = busiest_cpu(cpu);
+
+	return busiest ? steal_thread(busiest) : 0;
+}
 
 void schedule(void)
 {
 	const bool enabled = local_preempt_save();
 	struct thread *thread = next_thread();
+	struct thread *prev = current();
 
-	if (thread == current_thread) {
+	if (thread == prev) {
 		local_preempt_restore(enabled);
 		return;
 	}
 	
-	const bool force = (current_thread->state != THREAD_ACTIVE);
+	const bool force = (prev->state != THREAD_ACTIVE);
 
 	if (!force && !thread) {
 		local_preempt_restore(enabled);
 		return;
 	}
 
-	switch_to(thread ? thread : &bootstrap);
+	switch_to(thread ? thread : this_cpu()->idle);
 	local_preempt_restore(enabled);
 }
 
-bool need_resched(void)
+/*
+ * Halts until the next interrupt if there is nothing to run or steal, a
+ * thread queued after the check comes with an IPI (see kick_cpu) that
+ * can't be taken before hlt.
+ */
+static void idle_halt(struct cpu *cpu)
 {
-	if (current_thread == &bootstrap)
-		return true;
-	return scheduler->need_preempt(current_thread);
+	local_preempt_disable();
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&cpu->rq.nr_running, __ATOMIC_RELAXED) ||
+				busiest_cpu(cpu)) {
+		local_preempt_enable();
+		return;
+	}
+	local_irq_enable_halt();
 }
 
-struct tss_desc {
-	uint64_t low;
-	uint64_t high;
-} __attribute((packed));
-
-static void setup_tss_desc(struct tss_desc *desc, struct tss *tss)
+void idle(void)
 {
-	const uint64_t limit = sizeof(*tss) - 1;
-	const uint64_t base = (uint64_t)tss;
+	local_preempt_disable();
 
-	desc->low = (limit & BITS_CONST(15, 0))
-			| ((base & BITS_CONST(23, 0)) << 16)
-			| (((uint64_t)9 | BIT_CONST(7)) << 40)
-			| ((limit & BITS_CONST(19, 16)) << 32)
-			| ((base & BITS_CONST(31, 24)) << 32);
-	desc->high = base >> 32;
-}
+	struct cpu *cpu = this_cpu();
 
-static void load_tr(unsigned short sel)
-{ __asm__ ("ltr %0" : : "a"(sel)); }
+	cpu->idle_ns = 0;
+	cpu->idle_start = ktime_get_ns();
+	local_preempt_enable();
 
-static void setup_tss(void)
+	while (1) {
+		schedule();
+		idle_halt(cpu);
+	}
+}
+
+bool need_resched(void)
 {
-	extern char init_stack_top[];
-	const int tss_sel = TSS;
-	const int tss_entry = TSS >> 3;
-	struct tss_desc desc;
-	uint64_t *gdt = get_gdt_ptr();
+	struct thread *thread = current();
+	struct cpu *cpu = this_cpu();
+
+	if (thread == cpu->idle)
+		return true;
+
+	const bool enabled = spin_lock_irqsave(&cpu->rq.lock);
+	const bool preempt = (thread->sched != &rt_scheduler &&
+				cpu->rq.rt.nr_running) ||
+				thread->sched->need_preempt(&cpu->rq, thread);
 
-	tss.iomap_base = offsetof(struct tss, iomap);
-	tss.rsp[0] = (uint64_t)init_stack_top;
-	memset(tss.iomap, 0xff, sizeof(tss.iomap));
-	setup_tss_desc(&desc, &tss);
-	memcpy(gdt + tss_entry, &desc, sizeof(desc));
-	load_tr(tss_sel);
+	spin_unlock_irqrestore(&cpu->rq.lock, enabled);
+	return preempt;
 }
 
 void setup_threading(void)
 {
+#ifdef CONFIG_SCHED_FAIR
+	extern struct scheduler fair;
+	void setup_fair(void);
+
+	setup_fair();
+	scheduler = &fair;
+#else
 	extern struct scheduler round_robin;
 	void setup_round_robin(void);
 
 	setup_round_robin();
 	scheduler = &round_robin;
+#endif
 
 	setup_mm();
-	setup_tss();
 
 	static struct mm mm;
+	struct cpu *cpu = this_cpu();
 
 	bootstrap.state = THREAD_ACTIVE;
+	list_init(&bootstrap.children);
+	list_init(&bootstrap.sibling);
+	wait_queue_init(&bootstrap.exit_wq);
+	wait_queue_init(&bootstrap.child_wq);
+	bootstrap.policy = SCHED_NORMAL;
+	bootstrap.sched = scheduler;
+	list_init(&bootstrap.rt_link);
 	bootstrap.mm = &mm;
 	mm.pt = pfn2page(load_pml4() >> PAGE_BITS);
-	current_thread = &bootstrap;
+	mm.cpus = 1;
+	bootstrap.on_cpu = true;
+	cpu->idle = &bootstrap;
+	cpu->current = &bootstrap;
+
+	setup_mm_reaper();
 }
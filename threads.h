@@ -3,10 +3,13 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include "locking.h"
 #include "kernel.h"
 #include "rbtree.h"
+#include "timer.h"
+#include "list.h"
 
 
 enum thread_state {
@@ -20,25 +23,106 @@ enum thread_state {
 
 typedef intptr_t pid_t;
 
+#define MIN_NICE -20
+#define MAX_NICE 19
+
+/* real-time threads always run before SCHED_NORMAL ones */
+enum sched_policy {
+	SCHED_NORMAL,
+	SCHED_FIFO,
+	SCHED_RR
+};
+
+#define MAX_RT_PRIO     100
+#define RT_BITMAP_WORDS ((MAX_RT_PRIO + 63) / 64)
+
+struct cpu;
+struct scheduler;
+
 struct thread {
 	struct rb_node node;
 	pid_t pid;
 	void *stack_pointer;
-	unsigned long long time;
+	unsigned long long time; // ktime when it started running
 	enum thread_state state;
 	struct page *stack;
 	struct mm *mm;
 	struct spinlock lock;
 	int refcount;
+	bool vfork; // parent waits until we exec or exit
+	struct thread *parent; // 0 once the parent exited
+	struct list_head children; // protected by threads_lock
+	struct list_head sibling;
+	struct wait_queue exit_wq; // notified on finish and vfork_done
+	struct wait_queue child_wq; // notified when any child finishes
+	int nice;
+	enum sched_policy policy;
+	int rt_priority; // 0 to MAX_RT_PRIO - 1, higher runs first
+	struct list_head rt_link;
+	struct scheduler *sched; // class the thread is queued or runs in
+	struct cpu *cpu; // the last CPU thread ran on
+	bool on_rq; // queued or running, wakeup mustn't queue it again
+	bool on_cpu; // context isn't saved yet, nobody else can run it
+};
+
+struct fair_rq {
+	struct rb_tree tree; // ordered by virtual runtime
+	unsigned long long min_vruntime;
+	unsigned long weight; // sum of weights of the queued threads
+};
+
+struct rt_rq {
+	uint64_t bitmap[RT_BITMAP_WORDS]; // non empty queues
+	struct list_head queue[MAX_RT_PRIO]; // the highest priority first
+	int nr_running;
 };
 
+/* per-CPU queue of runnable threads, lock protects all the fields */
+struct runqueue {
+	struct spinlock lock;
+	struct list_head rr;
+	struct fair_rq fair;
+	struct rt_rq rt;
+	int nr_running;
+	unsigned long long balanced; // jiffies of the last load balancing
+};
+
+static inline void runqueue_init(struct runqueue *rq)
+{
+	spinlock_init(&rq->lock);
+	list_init(&rq->rr);
+	rq->fair.tree.root = 0;
+	rq->fair.min_vruntime = 0;
+	rq->fair.weight = 0;
+	for (int i = 0; i != RT_BITMAP_WORDS; ++i)
+		rq->rt.bitmap[i] = 0;
+	for (int i = 0; i != MAX_RT_PRIO; ++i)
+		list_init(&rq->rt.queue[i]);
+	rq->rt.nr_running = 0;
+	rq->nr_running = 0;
+	rq->balanced = 0;
+}
+
+#define SCHED_SLICE_NONE (~0ull)
+
+/*
+ * Scheduler policy only orders threads within a runqueue, runqueue is
+ * locked by the caller. steal returns a thread that can be moved to
+ * another CPU (not on_cpu), if any. place is called when a thread starts
+ * running, preempt or block when it stops. slice tells in how many ns
+ * need_preempt might become true for the running thread (0 if it already
+ * is), or SCHED_SLICE_NONE if only a wakeup can change that.
+ */
 struct scheduler {
 	struct thread *(*alloc)(void);
 	void (*free)(struct thread *);
-	void (*activate)(struct thread *);
-	bool (*need_preempt)(struct thread *);
-	struct thread *(*next)(void);
-	void (*preempt)(struct thread *);
+	void (*activate)(struct runqueue *, struct thread *);
+	bool (*need_preempt)(struct runqueue *, struct thread *);
+	unsigned long long (*slice)(struct runqueue *, struct thread *);
+	struct thread *(*next)(struct runqueue *);
+	struct thread *(*steal)(struct runqueue *);
+	void (*preempt)(struct runqueue *, struct thread *);
+	void (*block)(struct thread *);
 	void (*place)(struct thread *);
 };
 
@@ -47,6 +131,7 @@ static inline pid_t thread_pid(const struct thread *thread)
 { return thread->pid; }
 
 pid_t create_kthread(int (*fptr)(void *), void *arg);
+struct thread *create_idle_thread(void);
 
 struct thread_regs;
 
@@ -59,14 +144,61 @@ void put_thread(struct thread *thread);
 void get_thread(struct thread *thread);
 void schedule(void);
 bool need_resched(void);
+/* local timer interrupt */
+void scheduler_tick(void);
 
 
 static inline pid_t getpid(void)
 { return thread_pid(current()); }
 
 void activate_thread(struct thread *thread);
+
+/* takes effect the next time the thread is queued */
+void set_thread_nice(struct thread *thread, int nice);
+
+static inline int thread_nice(const struct thread *thread)
+{ return thread->nice; }
+
+/*
+ * priority must be 0 for SCHED_NORMAL and below MAX_RT_PRIO otherwise,
+ * like nice takes effect the next time the thread is queued.
+ */
+int set_thread_scheduler(struct thread *thread, enum sched_policy policy,
+			int priority);
+
+static inline enum sched_policy thread_policy(const struct thread *thread)
+{ return thread->policy; }
+
+static inline int thread_priority(const struct thread *thread)
+{ return thread->rt_priority; }
+
+/*
+ * Wakes the thread that initialized it up at the deadline, for sleeps and
+ * waits with a timeout. Must be canceled before it goes out of scope.
+ */
+struct wakeup_timer {
+	struct timer timer;
+	struct thread *thread;
+	unsigned long long deadline;
+};
+
+void wakeup_timer_init(struct wakeup_timer *timer, unsigned long long timeout);
+bool wakeup_timer_expired(const struct wakeup_timer *timer);
+void wakeup_timer_arm(struct wakeup_timer *timer);
+void wakeup_timer_cancel(struct wakeup_timer *timer);
+
+void thread_sleep_ns(unsigned long long ns);
+
 pid_t fork(void);
+pid_t vfork(void);
+void vfork_done(struct thread *thread);
+pid_t spawn(int argc, const char **argv);
 int wait(pid_t pid);
+/*
+ * Reaps a finished child, sleeps until one finishes if there is none yet.
+ * Returns pid of the child or -ENOENT if there are no children.
+ */
+pid_t wait_any(void);
 void exit(void);
 
 
@@ -1,8 +1,15 @@
 #include "interrupt.h"
+#include "threads.h"
 #include "kernel.h"
 #include "ioport.h"
+#include "cpuid.h"
+#include "lapic.h"
+#include "stdio.h"
+#include "timer.h"
 #include "time.h"
 
+#include <stdint.h>
+
 /*
  * Timer/Counter Control Register Format:
  * +-----+-----+-----+-----+-----+-----+-----+-----+
@@ -19,6 +26,8 @@
  */
 #define I8254_CTRL_PORT     0x43
 #define I8254_CH0_DATA_PORT 0x40
+#define I8254_CH2_DATA_PORT 0x42
+#define I8254_CH2_GATE_PORT 0x61
 #define I8254_FREQUENCY     1193180ul
 #define I8254_IRQ           0
 
@@ -29,14 +38,38 @@
 #define I8254_CTRL_M2       3
 
 #define I8254_SELECT_CH0    0ul
+#define I8254_SELECT_CH2    (2ul << 6)
 #define I8254_BINARY        0ul
 #define I8254_LOW_BYTE      BIT_CONST(I8254_CTRL_RW0)
 #define I8254_HIGH_BYTE     BIT_CONST(I8254_CTRL_RW1)
 #define I8254_HILO_BYTES    (I8254_LOW_BYTE | I8254_HIGH_BYTE)
 #define I8254_RATE_GEN      BIT_CONST(I8254_CTRL_M1)
+#define I8254_TERMINAL      0ul
+
+/* channel 2 gate and output are in the system control port */
+#define I8254_CH2_GATE      BIT_CONST(0)
+#define I8254_CH2_SPEAKER   BIT_CONST(1)
+#define I8254_CH2_OUT       BIT_CONST(5)
+
+#define LOCAL_TIMER_CALIBRATE_MS 10
+#define LOCAL_TIMER_MAX_NS       (1000 * NSEC_PER_SEC)
+
+/* channel 2 counter is 16 bit, that's at most ~54ms */
+#define TSC_CALIBRATE_MS         50
+#define TSC_SHIFT                24
 
 
 static unsigned long long jiffies_value;
+/* local APIC timer counts per millisecond, the same on all CPUs */
+static unsigned long local_timer_khz;
+
+/*
+ * ns = (cycles * tsc_mult) >> TSC_SHIFT, 0 tsc_mult means there is no
+ * usable TSC and time comes from the PIT tick. TSCs of all CPUs are
+ * assumed to be in sync.
+ */
+static unsigned long long tsc_base;
+static unsigned long long tsc_mult;
 
 
 static unsigned long i8254_divisor(unsigned long freq)
@@ -58,13 +91,162 @@ static void i8254_interrupt_handler(int irq)
 	(void) irq;
 
 	++jiffies_value;
+	run_timers();
+}
+
+/* channel 2 counts ms down, i8254_oneshot_wait polls for the end */
+static uint8_t i8254_oneshot_start(unsigned long ms)
+{
+	const unsigned long count = I8254_FREQUENCY * ms / 1000;
+	const unsigned char cmd = I8254_SELECT_CH2 | I8254_HILO_BYTES
+				| I8254_TERMINAL | I8254_BINARY;
+	const uint8_t gate = in8(I8254_CH2_GATE_PORT);
+
+	out8(I8254_CH2_GATE_PORT, (gate & ~I8254_CH2_SPEAKER) | I8254_CH2_GATE);
+	out8(I8254_CTRL_PORT, cmd);
+	out8(I8254_CH2_DATA_PORT, count & BITS(7, 0));
+	out8(I8254_CH2_DATA_PORT, (count & BITS(15, 8)) >> 8);
+	return gate;
+}
+
+static void i8254_oneshot_wait(uint8_t gate)
+{
+	while (!(in8(I8254_CH2_GATE_PORT) & I8254_CH2_OUT))
+		barrier();
+	out8(I8254_CH2_GATE_PORT, gate);
+}
+
+static unsigned long long rdtsc(void)
+{
+	uint32_t low, high;
+
+	__asm__ volatile ("rdtsc" : "=a"(low), "=d"(high));
+	return ((unsigned long long)high << 32) | low;
+}
+
+static unsigned long tsc_calibrate(void)
+{
+	const unsigned long flags = local_irqsave();
+	const uint8_t gate = i8254_oneshot_start(TSC_CALIBRATE_MS);
+	const unsigned long long begin = rdtsc();
+
+	i8254_oneshot_wait(gate);
+
+	const unsigned long long end = rdtsc();
+
+	local_irqrestore(flags);
+	return (end - begin) / TSC_CALIBRATE_MS;
+}
+
+/* split the product, so it doesn't overflow for large cycles */
+static unsigned long long tsc_cycles_to_ns(unsigned long long cycles)
+{
+	return (((cycles >> 32) * tsc_mult) << (32 - TSC_SHIFT)) +
+		(((cycles & BITS_CONST(31, 0)) * tsc_mult) >> TSC_SHIFT);
+}
+
+unsigned long long ktime_get_ns(void)
+{
+	if (!tsc_mult)
+		return jiffies_value * NSEC_PER_JIFFY;
+	return tsc_cycles_to_ns(rdtsc() - tsc_base);
 }
 
 unsigned long long jiffies(void)
-{ return jiffies_value; }
+{
+	if (!tsc_mult)
+		return jiffies_value;
+	return ktime_get_ns() / NSEC_PER_JIFFY;
+}
+
+static unsigned long local_timer_calibrate(void)
+{
+	const unsigned long flags = local_irqsave();
+	const uint8_t gate = i8254_oneshot_start(LOCAL_TIMER_CALIBRATE_MS);
+
+	lapic_timer_start(UINT32_MAX);
+	i8254_oneshot_wait(gate);
+
+	const uint32_t left = lapic_timer_count();
+
+	lapic_timer_start(0);
+	local_irqrestore(flags);
+
+	return (UINT32_MAX - left) / LOCAL_TIMER_CALIBRATE_MS;
+}
+
+static void local_timer_interrupt_handler(int intno)
+{
+	(void) intno;
+
+	run_timers();
+	scheduler_tick();
+}
+
+void clockevent_program(unsigned long long ns)
+{
+	if (!local_timer_khz)
+		return;
+
+	if (ns == CLOCKEVENT_NONE) {
+		lapic_timer_start(0);
+		return;
+	}
+
+	ns = MINU(ns, LOCAL_TIMER_MAX_NS);
+
+	const unsigned long long count = ns / 1000 * local_timer_khz / 1000;
+
+	lapic_timer_start(MINU(MAXU(count, 1), UINT32_MAX));
+}
+
+static void setup_tsc(void)
+{
+	if (!cpu_has_invariant_tsc()) {
+		DBG_INFO("no invariant TSC, time has jiffy resolution");
+		return;
+	}
+
+	const unsigned long khz = tsc_calibrate();
+
+	if (!khz) {
+		DBG_ERR("failed to calibrate TSC");
+		return;
+	}
+
+	tsc_base = rdtsc();
+	tsc_mult = (1000000ull << TSC_SHIFT) / khz;
+	DBG_INFO("TSC %lu kHz", khz);
+}
 
 void setup_time(void)
 {
+	setup_tsc();
 	i8254_set_frequency(HZ);
 	register_irq_handler(I8254_IRQ, &i8254_interrupt_handler);
 }
+
+void setup_local_timer(void)
+{
+	if (!lapic_present())
+		return;
+
+	lapic_timer_setup(TIMER_INTNO);
+	if (local_timer_khz)
+		return;
+
+	const unsigned long khz = local_timer_calibrate();
+
+	if (!khz) {
+		DBG_ERR("failed to calibrate local APIC timer");
+		return;
+	}
+
+	register_local_handler(TIMER_INTNO, &local_timer_interrupt_handler);
+	local_timer_khz = khz;
+	DBG_INFO("local APIC timer %lu kHz", khz);
+
+	/* time doesn't need the tick anymore, local timer preempts threads */
+	if (tsc_mult)
+		unregister_irq_handler(I8254_IRQ, &i8254_interrupt_handler);
+}
@@ -3,8 +3,24 @@
 
 #define HZ 100
 
+#define NSEC_PER_SEC    1000000000ull
+#define NSEC_PER_MSEC   1000000ull
+#define NSEC_PER_JIFFY  (NSEC_PER_SEC / HZ)
+#define CLOCKEVENT_NONE (~0ull)
+
 unsigned long long jiffies(void);
+/* monotonic time since boot, falls back to jiffies without a stable TSC */
+unsigned long long ktime_get_ns(void);
+
+/*
+ * Per-CPU one-shot timer (local APIC timer), raises TIMER_INTNO in ns
+ * nanoseconds on this CPU, CLOCKEVENT_NONE stops it. Does nothing until
+ * the local timer is set up.
+ */
+void clockevent_program(unsigned long long ns);
 
 void setup_time(void);
+/* called on every CPU once its local APIC is enabled */
+void setup_local_timer(void);
 
 #endif /*__TIME_H__*/
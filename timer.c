@@ -0,0 +1,258 @@
+#include "threads.h"
+#include "locking.h"
+#include "stdio.h"
+#include "timer.h"
+#include "time.h"
+#include "smp.h"
+
+
+/*
+ * Hierarchical timer wheel: level 0 has a slot per tick for the next
+ * TIMER_SLOTS ticks, every next level has TIMER_SLOTS times coarser
+ * slots. When level 0 wraps, the current slot of level 1 is cascaded
+ * into level 0 and so on, so adding and deleting timers is O(1) and
+ * every timer moves down at most TIMER_LEVELS - 1 times. A tick is
+ * ~1ms, timers that don't fit the wheel wait in the last level and
+ * cascade again.
+ */
+#define TIMER_SHIFT     20
+#define TIMER_TICK_NS   (1ull << TIMER_SHIFT)
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS     (1 << TIMER_SLOT_BITS)
+#define TIMER_LEVELS    4
+#define TIMER_MAX_DELTA ((1ull << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1)
+
+struct timer_base {
+	struct spinlock lock;
+	struct list_head wheel[TIMER_LEVELS][TIMER_SLOTS];
+	unsigned long long clk; // the next tick to process
+	unsigned long long next; // tick of the earliest timer, might be early
+	size_t count;
+};
+
+
+static struct timer_base timer_bases[CONFIG_MAX_CPUS];
+
+
+/* round up, timer must never fire early */
+static unsigned long long timer_tick(unsigned long long ns)
+{ return (ns + TIMER_TICK_NS - 1) >> TIMER_SHIFT; }
+
+static unsigned long long timer_now(void)
+{ return ktime_get_ns() >> TIMER_SHIFT; }
+
+static int timer_slot(unsigned long long tick, int level)
+{ return (tick >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1); }
+
+static void __timer_enqueue(struct timer_base *base, struct timer *timer)
+{
+	unsigned long long tick = MAXU(timer_tick(timer->expires), base->clk);
+	const unsigned long long delta = MINU(tick - base->clk,
+				TIMER_MAX_DELTA);
+	int level = 0;
+
+	tick = base->clk + delta;
+	while (delta >> (TIMER_SLOT_BITS * (level + 1)))
+		++level;
+
+	list_add_tail(&timer->link, &base->wheel[level][timer_slot(tick,
+				level)]);
+	timer->base = base;
+}
+
+static void __timer_dequeue(struct timer_base *base, struct timer *timer)
+{
+	list_del(&timer->link);
+	list_init(&timer->link);
+	--base->count;
+}
+
+static void timer_cascade(struct timer_base *base, int level)
+{
+	struct list_head *slot = &base->wheel[level][timer_slot(base->clk,
+				level)];
+	LIST_HEAD(timers);
+
+	list_splice(slot, &timers);
+	while (!list_empty(&timers)) {
+		struct timer *timer = LIST_ENTRY(list_first(&timers),
+					struct timer, link);
+
+		list_del(&timer->link);
+		__timer_enqueue(base, timer);
+	}
+}
+
+static void timer_run_tick(struct timer_base *base)
+{
+	for (int level = 1; level != TIMER_LEVELS; ++level) {
+		if (timer_slot(base->clk, level - 1))
+			break;
+		timer_cascade(base, level);
+	}
+
+	struct list_head *slot = &base->wheel[0][timer_slot(base->clk, 0)];
+
+	while (!list_empty(slot)) {
+		struct timer *timer = LIST_ENTRY(list_first(slot),
+					struct timer, link);
+
+		__timer_dequeue(base, timer);
+		timer->fn(timer);
+		__atomic_store_n(&timer->base, 0, __ATOMIC_RELEASE);
+	}
+	++base->clk;
+}
+
+/*
+ * Looks at slots, not at timers: level 0 slots from clk on hold one tick
+ * each, so the first non-empty one is exact. A higher level slot is only
+ * known to expire not before it cascades, next might be early because of
+ * that, but run_timers just finds nothing to run and updates it again.
+ */
+static void timer_update_next(struct timer_base *base)
+{
+	unsigned long long next = ~0ull;
+
+	for (int level = 0; level != TIMER_LEVELS && base->count; ++level) {
+		const int shift = TIMER_SLOT_BITS * level;
+		const unsigned long long clk = base->clk >> shift;
+		/* the current slot cascades at clk if it's aligned */
+		const int first = base->clk & ((1ull << shift) - 1) ? 1 : 0;
+
+		for (int i = first; i != TIMER_SLOTS + first; ++i) {
+			const unsigned long long tick = (clk + i) << shift;
+
+			if (tick >= next)
+				break;
+
+			if (!list_empty(&base->wheel[level][timer_slot(tick,
+						level)])) {
+				next = tick;
+				break;
+			}
+		}
+	}
+	base->next = next;
+}
+
+void timer_init(struct timer *timer, void (*fn)(struct timer *))
+{
+	list_init(&timer->link);
+	timer->expires = 0;
+	timer->fn = fn;
+	timer->base = 0;
+}
+
+void timer_add(struct timer *timer, unsigned long long expires)
+{
+	timer_del(timer);
+
+	const bool enabled = local_preempt_save();
+	struct timer_base *base = &timer_bases[cpu_id()];
+
+	__spin_lock(&base->lock);
+	/* clk of an empty wheel might be way behind */
+	if (!base->count)
+		base->clk = timer_now();
+
+	timer->expires = expires;
+	__timer_enqueue(base, timer);
+	++base->count;
+
+	const bool earliest = timer_tick(expires) < base->next;
+
+	if (earliest)
+		base->next = timer_tick(expires);
+	__spin_unlock(&base->lock);
+
+	/* the local timer might be programmed for later */
+	if (earliest)
+		scheduler_tick();
+	local_preempt_restore(enabled);
+}
+
+bool timer_del(struct timer *timer)
+{
+	struct timer_base *base = __atomic_load_n(&timer->base,
+				__ATOMIC_ACQUIRE);
+	bool pending = false;
+
+	if (!base)
+		return false;
+
+	const bool enabled = spin_lock_irqsave(&base->lock);
+
+	if (timer->base == base) {
+		__timer_dequeue(base, timer);
+		timer->base = 0;
+		pending = true;
+	}
+	spin_unlock_irqrestore(&base->lock, enabled);
+	return pending;
+}
+
+unsigned long long timer_next_event(void)
+{
+	const bool enabled = local_preempt_save();
+	struct timer_base *base = &timer_bases[cpu_id()];
+
+	__spin_lock(&base->lock);
+
+	const unsigned long long next = base->count ? base->next : ~0ull;
+
+	__spin_unlock(&base->lock);
+	local_preempt_restore(enabled);
+
+	if (next == ~0ull)
+		return CLOCKEVENT_NONE;
+
+	const unsigned long long now = ktime_get_ns();
+	const unsigned long long expires = next << TIMER_SHIFT;
+
+	return expires > now ? expires - now : 0;
+}
+
+void run_timers(void)
+{
+	const bool enabled = local_preempt_save();
+	struct timer_base *base = &timer_bases[cpu_id()];
+	const unsigned long long now = timer_now();
+
+	__spin_lock(&base->lock);
+	while (base->count && base->clk <= now) {
+		/* nothing expires before next, but the wheel must cascade */
+		if (timer_slot(base->clk, 0) && base->next > base->clk) {
+			const unsigned long long wrap = ALIGN(base->clk,
+						TIMER_SLOTS);
+
+			base->clk = MINU(MINU(base->next, wrap), now + 1);
+			continue;
+		}
+		timer_run_tick(base);
+	}
+
+	if (!base->count)
+		base->clk = now + 1;
+	timer_update_next(base);
+	__spin_unlock(&base->lock);
+	local_preempt_restore(enabled);
+}
+
+void setup_timers(void)
+{
+	const unsigned long long now = timer_now();
+
+	for (int i = 0; i != CONFIG_MAX_CPUS; ++i) {
+		struct timer_base *base = &timer_bases[i];
+
+		spinlock_init(&base->lock);
+		for (int level = 0; level != TIMER_LEVELS; ++level) {
+			for (int slot = 0; slot != TIMER_SLOTS; ++slot)
+				list_init(&base->wheel[level][slot]);
+		}
+		base->clk = now;
+		base->next = ~0ull;
+		base->count = 0;
+	}
+}
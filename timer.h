@@ -0,0 +1,45 @@
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include "list.h"
+
+#include <stdbool.h>
+
+
+struct timer_base;
+
+/*
+ * Timer callback runs in the timer interrupt of the CPU the timer was
+ * added on, with the timer base locked: it must not add or delete timers
+ * itself.
+ */
+struct timer {
+	struct list_head link;
+	unsigned long long expires; // ktime in ns
+	void (*fn)(struct timer *);
+	struct timer_base *base; // pending or running if not 0
+};
+
+void timer_init(struct timer *timer, void (*fn)(struct timer *));
+
+/* (re)arms timer to fire at expires ktime on this CPU */
+void timer_add(struct timer *timer, unsigned long long expires);
+
+/*
+ * Returns true if timer was pending, if its callback is running waits
+ * for it to finish, so the timer can be freed after that.
+ */
+bool timer_del(struct timer *timer);
+
+static inline bool timer_pending(const struct timer *timer)
+{ return timer->base != 0; }
+
+/* ns until the earliest timer of this CPU, CLOCKEVENT_NONE if none */
+unsigned long long timer_next_event(void);
+
+/* runs expired timers of this CPU, called from the timer interrupt */
+void run_timers(void);
+
+void setup_timers(void);
+
+#endif /*__TIMER_H__*/
@@ -130,7 +130,8 @@ static struct fs_entry *vfs_lookup(struct fs_entry *dir, const char *name,
 
 	rb_link(&entry->link, parent, plink);
 	rb_insert(&entry->link, &dir->children);
-	entry->parent = vfs_entry_get(dir);
+	++dir->refcount; // dir->lock is held, so no vfs_entry_get
+	entry->parent = dir;
 	entry->cached = true;
 	spin_unlock_irqrestore(&dir->lock, enabled);
 
@@ -388,8 +389,21 @@ int vfs_read(struct fs_file *file, char *buffer, size_t size)
 
 int vfs_write(struct fs_file *file, const char *buffer, size_t size)
 {
-	if (file->ops && file->ops->write)
-		return file->ops->write(file, buffer, size);
+	if (file->ops && file->ops->write) {
+		const int rc = file->ops->write(file, buffer, size);
+
+		if (rc > 0)
+			__atomic_add_fetch(&file->node->version, 1,
+						__ATOMIC_RELEASE);
+		return rc;
+	}
+	return -ENOTSUP;
+}
+
+int vfs_mmap(struct fs_file *file, struct vma *vma)
+{
+	if (file->ops && file->ops->mmap)
+		return file->ops->mmap(file, vma);
 	return -ENOTSUP;
 }
 
@@ -16,6 +16,7 @@ struct fs_entry;
 struct fs_node;
 struct fs_file;
 struct dir_iter_ctx;
+struct vma;
 
 
 struct fs_type_ops {
@@ -48,6 +49,7 @@ struct fs_file_ops {
 	int (*write)(struct fs_file *, const char *, size_t);
 	int (*seek)(struct fs_file *, int off, int whence);
 	int (*iterate)(struct fs_file *, struct dir_iter_ctx *);
+	int (*mmap)(struct fs_file *, struct vma *);
 };
 
 /**
@@ -81,6 +83,8 @@ struct fs_node {
 	struct spinlock lock; // protects refcount access, and probably size
 	int refcount;
 	int size;
+	unsigned long version; // bumped on every write, see exec image cache
+	int mmap_writable; // shared writable mappings, writes bypass vfs_write
 };
 
 void vfs_node_destroy(struct fs_node *node);
@@ -90,6 +94,8 @@ static inline void vfs_node_init(struct fs_node *node)
 	mutex_init(&node->mux);
 	spinlock_init(&node->lock);
 	node->refcount = 1;
+	node->version = 0;
+	node->mmap_writable = 0;
 }
 
 static inline struct fs_node *vfs_node_get(struct fs_node *node)
@@ -164,6 +170,7 @@ int vfs_open(const char *name, struct fs_file *file);
 int vfs_release(struct fs_file *file);
 int vfs_read(struct fs_file *file, char *buffer, size_t size);
 int vfs_write(struct fs_file *file, const char *buffer, size_t size);
+int vfs_mmap(struct fs_file *file, struct vma *vma);
 
 int vfs_seek_default(struct fs_file *file, int off, int whence);
 int vfs_seek(struct fs_file *file, int off, int whence);